@@ -1,911 +1,4797 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && defined(__linux__) && defined(__GNUC__) && !defined(NO_JIT)
+#define USE_JIT
+#include <sys/mman.h>
+#endif
+
+#ifdef __linux__
+#define ALIAS_MEMORY
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+/* the frame renderer gets a second, AVX2 build, picked at run time */
+#if defined(__x86_64__) && defined(__GNUC__)
+#define USE_AVX2
+#endif
+
+/* flag bits of the PSW byte, in 8080 hardware layout */
+#define FLAG_S 0x80
+#define FLAG_Z 0x40
+#define FLAG_AC 0x10
+#define FLAG_P 0x04
+#define FLAG_1 0x02
+#define FLAG_CY 0x01
+#define FLAG_MASK (FLAG_S | FLAG_Z | FLAG_AC | FLAG_P | FLAG_CY)
 
 typedef struct ConditionCodes{
-	uint8_t z:1;
-	uint8_t s:1;
-	uint8_t p:1;
-	uint8_t cy:1;
-	uint8_t ac:1;
-	uint8_t pad:3;
-	uint8_t interrupt_enabled:1;
+	uint8_t psw;
+	uint8_t interrupt_enabled;
 } ConditionCodes;
 
+/*
+ the register file can be read as single registers, as the BC/DE/HL
+ pairs, or through reg[] with the 3 bit register field of an opcode
+ (B C D E H L M A = 0..7, see REG). bytes are laid out so each pair
+ overlays its two registers in host byte order
+*/
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define REG_SWAP 0
+#else
+#define REG_SWAP 1
+#endif
+
 typedef struct State8080{
-	uint8_t a;
-	uint8_t b;
-	uint8_t c;
-	uint8_t d;
-	uint8_t e;
-	uint8_t h;
-	uint8_t l;
+	_Alignas(64) union{
+		uint8_t reg[8];
+		uint16_t pair[4];
+		struct{
+#if REG_SWAP
+			uint8_t c, b, e, d, l, h, a, pad;
+#else
+			uint8_t b, c, d, e, h, l, pad, a;
+#endif
+		};
+		struct{
+			uint16_t bc, de, hl;
+		};
+	};
 	uint16_t sp;
 	uint16_t pc;
+	uint8_t ei_shadow;	/* the last instruction was EI, so no interrupt is taken yet */
 	uint8_t *memory;
+	struct BlockCache8080 *blocks;
+	uint8_t *dirty;	/* DIRTY_ALL per 256 byte page on every store, if not NULL */
+	struct Map8080 *map;	/* how stores treat each page, NULL for all RAM */
+	uint64_t cycles;
 	struct ConditionCodes cc;
 	uint8_t int_enable;
+	uint8_t halted;
 } State8080;
 
+_Static_assert(sizeof(State8080) <= 64, "hot 8080 state should fit one cache line");
+
+/*
+ a store sets its page's byte of the dirty map to DIRTY_ALL, and each
+ user of the map clears only its own bit
+*/
+#define DIRTY_ALL 0xff
+#define DIRTY_RESET 0x01	/* pages Reset8080ToBaseline will copy */
+#define DIRTY_VIDEO 0x02	/* pages RenderDelta8080 will compare */
+#define DIRTY_HASH 0x04	/* pages HashRam8080 will hash again */
+#define DIRTY_REWIND 0x08	/* pages PushRewind8080 will compare */
+#define DIRTY_REPLAY 0x10	/* pages CheckReplay8080 will hash again */
+#define DIRTY_SNAP 0x20	/* pages TakeSnapshot8080 will compare */
+
+/* why Run8080 returned */
+#define RUN_BUDGET 0
+#define RUN_HALT 1
+
+typedef struct RunResult8080{
+	uint64_t cycles;
+	uint64_t instructions;
+	int status;
+} RunResult8080;
+
+/* register with 3 bit field r, M (6) is not in reg[] */
+#define REG(state, r) ((state)->reg[((r) & 7) ^ REG_SWAP])
+
+/* stops this machine only, other machines in the process keep running */
 void UnimplementedInstruction(State8080* state){
 
 	state->pc -= 1;
-	printf("Error: unimplemented instruction\n");
-	exit(1);
+	state->halted = 1;
+	fprintf(stderr, "Error: unimplemented instruction at $%04x\n", state->pc);
 
 }
 
-int zspflag(State8080* state, uint16_t answer){
-	
-	if((answer & 0xff) == 0){
-		state->cc.z = 1;
-	}else{
-		state->cc.z = 0;
-	}
+/* 1 when x has an even number of bits set */
+static inline uint8_t parity(uint8_t x){
 
-	if(answer & 0x80){
-		state->cc.s = 1;
-	}else{
-		state->cc.s = 0;
-	}
+	x ^= x >> 4;
+	x ^= x >> 2;
+	x ^= x >> 1;
+	return (~x) & 1;
 
-	if(answer % 2 == 0){
-		state->cc.p = 1;
-	}else{
-		state->cc.p = 0;
-	}
+}
+
+#define carry(state) ((state)->cc.psw & FLAG_CY)
+#define flags(state) (&(state)->cc)
+
+/* S, Z and P of the low byte of answer */
+static inline uint8_t zsp(uint16_t answer){
 
+	return (answer & FLAG_S) | (((answer & 0xff) == 0) << 6) |
+		(parity(answer & 0xff) << 2) | FLAG_1;
+
+}
+
+static inline int zspflag(State8080* state, uint16_t answer){
+
+	state->cc.psw = (state->cc.psw & (FLAG_AC | FLAG_CY)) | zsp(answer);
 	return 0;
+
 }
 
-int zspcyflag(State8080* state, uint16_t answer){
+static inline int zspcyflag(State8080* state, uint16_t answer){
 
-	if((answer & 0xff) == 0){
-		state->cc.z = 1;
-	}else{
-		state->cc.z = 0;
-	}
+	state->cc.psw = (state->cc.psw & FLAG_AC) | zsp(answer) | (answer > 0xff ? FLAG_CY : 0);
+	return 0;
 
-	if(answer & 0x80){
-		state->cc.s = 1;
-	}else{
-		state->cc.s = 0;
-	}
+}
 
-	if(answer % 2 == 0){
-		state->cc.p = 1;
-	}else{
-		state->cc.p = 0;
-	}
+/* bit 4 of x is the auxiliary carry */
+static inline int acflag(State8080* state, uint8_t x){
+
+	state->cc.psw = (state->cc.psw & ~FLAG_AC) | (x & FLAG_AC);
+	return 0;
+
+}
+
+#define getflag(state, f) ((flags(state)->psw & (f)) != 0)
 
-	state->cc.cy = (answer > 0xff);
+static inline int setflag(State8080* state, uint8_t f, int value){
 
+	ConditionCodes *cc = flags(state);
+	if (value){
+		cc->psw |= f;
+	}else{
+		cc->psw &= ~f;
+	}
 	return 0;
+
 }
 
-uint8_t inr(State8080* state, uint8_t value){
+static inline uint8_t inr(State8080* state, uint8_t value){
 
 	uint16_t answer = (uint16_t)value + 1;
 	zspflag(state, answer);
+	acflag(state, ((answer & 0x0f) == 0) << 4);
 	return (uint8_t)answer;	
 
 }
 
-uint8_t dcr(State8080* state, uint8_t value){
+static inline uint8_t dcr(State8080* state, uint8_t value){
 
 	uint16_t answer = (uint16_t)value - 1;
 	zspflag(state, answer);
+	acflag(state, ((answer & 0x0f) != 0x0f) << 4);
 	return (uint8_t)answer;
 
 }
 
-uint8_t add(State8080* state, uint8_t value){
+#ifdef ALU_TABLES
+
+/*
+ result and flags of every 8 bit add and subtract, indexed by carry in,
+ A and the operand. the low byte is the result, the high byte the flags
+ in PSW layout. zsp_table has the flags of a logical result. filled
+ once at startup by InitALUTables
+*/
+
+uint16_t add_table[2][256][256];
+uint16_t sub_table[2][256][256];
+uint8_t zsp_table[256];
+
+void InitALUTables(void){
+
+	for (int r = 0; r < 256; r++){
+		zsp_table[r] = (r & FLAG_S) | (r == 0 ? FLAG_Z : 0) | (parity(r) ? FLAG_P : 0) | FLAG_1;
+	}
+
+	for (int c = 0; c < 2; c++){
+		for (int a = 0; a < 256; a++){
+			for (int v = 0; v < 256; v++){
+				uint16_t answer = a + v + c;
+				uint8_t f = zsp_table[answer & 0xff] | ((a ^ v ^ answer) & FLAG_AC);
+				if (answer > 0xff){
+					f |= FLAG_CY;
+				}
+				add_table[c][a][v] = (f << 8) | (answer & 0xff);
+
+				answer = (uint16_t)(a - v - c);
+				f = zsp_table[answer & 0xff] | (~(a ^ v ^ answer) & FLAG_AC);
+				if (answer > 0xff){
+					f |= FLAG_CY;
+				}
+				sub_table[c][a][v] = (f << 8) | (answer & 0xff);
+			}
+		}
+	}
+
+}
+
+static inline uint8_t add(State8080* state, uint8_t value){
+
+	uint16_t entry = add_table[0][state->a][value];
+	state->cc.psw = entry >> 8;
+	return (uint8_t)entry;
+
+}
+
+static inline uint8_t adc(State8080* state, uint8_t value){
+
+	uint16_t entry = add_table[carry(state)][state->a][value];
+	state->cc.psw = entry >> 8;
+	return (uint8_t)entry;
+
+}
+
+static inline uint8_t sub(State8080* state, uint8_t value){
+
+	uint16_t entry = sub_table[0][state->a][value];
+	state->cc.psw = entry >> 8;
+	return (uint8_t)entry;
+
+}
+
+static inline uint8_t sbb(State8080* state, uint8_t value){
+
+	uint16_t entry = sub_table[carry(state)][state->a][value];
+	state->cc.psw = entry >> 8;
+	return (uint8_t)entry;
+
+}
+
+static inline uint8_t ana(State8080* state, uint8_t value){
+
+	uint8_t answer = state->a & value;
+	state->cc.psw = zsp_table[answer] | (((state->a | value) << 1) & FLAG_AC);
+	return answer;
+
+}
+
+static inline uint8_t xra(State8080* state, uint8_t value){
+
+	uint8_t answer = state->a ^ value;
+	state->cc.psw = zsp_table[answer];
+	return answer;
+
+}
+
+static inline uint8_t ora(State8080* state, uint8_t value){
+
+	uint8_t answer = state->a | value;
+	state->cc.psw = zsp_table[answer];
+	return answer;
+
+}
+
+static inline int cmp(State8080* state, uint8_t value){
+
+	state->cc.psw = sub_table[0][state->a][value] >> 8;
+	return 0;
+
+}
+
+#else
+
+static inline uint8_t add(State8080* state, uint8_t value){
 
 	uint16_t answer = (uint16_t)state->a + (uint16_t)value;
 	zspcyflag(state, answer);
+	acflag(state, state->a ^ value ^ answer);
 	return (uint8_t)answer;
 
 }
 
-uint8_t adc(State8080* state, uint8_t value){
+static inline uint8_t adc(State8080* state, uint8_t value){
 
-	uint16_t answer = (uint16_t)state->a + (uint16_t)value + (uint16_t)state->cc.cy;
+	uint16_t answer = (uint16_t)state->a + (uint16_t)value + (uint16_t)carry(state);
 	zspcyflag(state, answer);
+	acflag(state, state->a ^ value ^ answer);
 	return (uint8_t)answer;
 
 }
 
-uint8_t sub(State8080* state, uint8_t value){
+static inline uint8_t sub(State8080* state, uint8_t value){
 
 	uint16_t answer = (uint16_t)state->a - (uint16_t)value;
 	zspcyflag(state, answer);
+	acflag(state, ~(state->a ^ value ^ answer));
 	return (uint8_t)answer;
 
 }
 
-uint8_t sbb(State8080* state, uint8_t value){
+static inline uint8_t sbb(State8080* state, uint8_t value){
 
-	uint16_t answer = (uint16_t)state->a - (uint16_t)value - (uint16_t)state->cc.cy;
+	uint16_t answer = (uint16_t)state->a - (uint16_t)value - (uint16_t)carry(state);
 	zspcyflag(state, answer);
+	acflag(state, ~(state->a ^ value ^ answer));
 	return (uint8_t)answer;
 
 }
 
-uint8_t ana(State8080* state, uint8_t value){
+static inline uint8_t ana(State8080* state, uint8_t value){
 
 	uint16_t answer = (uint16_t)state->a & (uint16_t)value;
 	zspcyflag(state, answer);
+	acflag(state, (state->a | value) << 1);
 	return (uint8_t)answer;
 
 }
 
-uint8_t xra(State8080* state, uint8_t value){
+static inline uint8_t xra(State8080* state, uint8_t value){
 
 	uint16_t answer = (uint16_t)state->a ^ (uint16_t)value;
 	zspcyflag(state, answer);
+	acflag(state, 0);
 	return (uint8_t)answer;
 
 }
 
-uint8_t ora(State8080* state, uint8_t value){
+static inline uint8_t ora(State8080* state, uint8_t value){
 
 	uint16_t answer = (uint16_t)state->a | (uint16_t)value;
 	zspcyflag(state, answer);
+	acflag(state, 0);
 	return (uint8_t)answer;
 
 }
 
-int call(State8080* state, unsigned char* opcode){
+static inline int cmp(State8080* state, uint8_t value){
+
+	uint16_t answer = (uint16_t)state->a - (uint16_t)value;
+	zspcyflag(state, answer);
+	acflag(state, ~(state->a ^ value ^ answer));
+	return 0;
+
+}
+
+#endif
+
+/*
+ block cache: guest code is decoded once per basic block into Uop8080
+ records, looked up by the pc the block starts at. a block is a header
+ record, one record per instruction and a closing UOP_END record. it
+ ends after any instruction that can change pc, or after BLOCK_MAX
+ instructions, but never on EI
+*/
+
+#define BLOCK_MAX 32
+#define BLOCK_CYCLES (BLOCK_MAX * 18)	/* most a block can run past a budget */
+#define BLOCK_UOPS 0x20000
+
+/* handlers past the 256 opcodes: end of block, record of a dropped block */
+#define UOP_END 256
+#define UOP_STALE 257
+
+/*
+ superinstructions: the first record of a common sequence gets one of
+ these handlers, which runs the whole sequence and moves past the
+ records it covered. see fused8080.h
+*/
+enum{
+	FUSE_DCR_JNZ = UOP_STALE + 1,
+	FUSE_CPI_JCC,
+	FUSE_LXI_MOV,
+	FUSE_INX_DCR_JNZ,
+	FUSE_LDA_ANA_JCC,
+	FUSE_PUSH_PUSH,
+	FUSE_POP_POP,
+	FUSE_EI_RET,
+	UOP_HANDLERS
+};
+
+#define UOP_FUSED FUSE_DCR_JNZ
+#define FUSIONS (UOP_HANDLERS - UOP_FUSED)
+
+typedef struct Uop8080{
+	union{
+		struct{
+			uint8_t op;
+			uint8_t cycles;
+			uint16_t handler;	/* op, UOP_END, UOP_STALE or a superinstruction */
+			uint16_t imm;	/* operand byte or word, branch and call targets */
+			uint16_t next;	/* pc of the following instruction */
+		};
+		struct{	/* block header */
+			uint16_t count;
+			uint16_t total;	/* base cycles of the whole block */
+			uint16_t size;	/* guest bytes covered */
+			uint16_t unused;
+		};
+	};
+} Uop8080;
+
+typedef struct BlockCache8080{
+	uint32_t entry[0x10000];	/* header of the block starting at pc, 0 if none */
+	uint8_t code[256];	/* nonzero for the 256 byte pages holding cached code */
+	uint32_t nuops;
+	uint32_t invalidations;
+	uint8_t fuse;	/* give new blocks superinstructions, on by default */
+	uint64_t fired[FUSIONS];	/* times each superinstruction ran */
+	struct Jit8080 *jit;	/* native translations of these blocks, if any */
+	const uint8_t *ring;	/* mirror rings of the machine's memory map, if any */
+	Uop8080 uop[BLOCK_UOPS];
+} BlockCache8080;
+
+#ifdef USE_JIT
+void KillJit8080(struct Jit8080* jit, uint16_t pc);
+void FlushJit8080(struct Jit8080* jit);
+#endif
+
+static void dropblocks(BlockCache8080* cache, int page){
+
+	int from = (page << 8) - BLOCK_MAX * 3;
+
+	for (int pc = from < 0 ? 0 : from; pc < (page + 1) << 8; pc++){
+		if (cache->entry[pc] == 0){
+			continue;
+		}
+		Uop8080 *u = &cache->uop[cache->entry[pc]];
+		if (pc + u->size > (page << 8)){
+			for (u++; u->handler != UOP_END; u++){
+				u->handler = UOP_STALE;
+			}
+			cache->entry[pc] = 0;
+#ifdef USE_JIT
+			if (cache->jit != NULL){
+				KillJit8080(cache->jit, pc);
+			}
+#endif
+		}
+	}
+	cache->code[page] = 0;
+
+}
+
+/*
+ drops every block that covers a byte of the page holding addr, or of a
+ page mirroring it. their records stay in uop[] until the next flush but
+ become UOP_STALE, so a block that overwrote itself is left right after
+ the store
+*/
+
+void InvalidateBlocks8080(BlockCache8080* cache, uint16_t addr){
+
+	int page = addr >> 8, p = page;
+
+	do{
+		dropblocks(cache, p);
+		p = cache->ring != NULL ? cache->ring[p] : page;
+	}while(p != page);
+	cache->invalidations++;
+
+}
+
+/*
+ memory and I/O map: what a store to each 256 byte page does, and what
+ IN and OUT do on each port. reads always come
+ straight from state->memory, so read-only and mirror pages cost
+ nothing to read and only stores look at the map. an MMIO page hands
+ stores to the map's hook.
+
+ a mirror page has the same bytes as every other page in its ring. where
+ the host can, NewMemory8080 maps a ring onto one set of host pages, so
+ a store to one mirror is seen at all of them and costs no more than
+ a plain RAM store. otherwise the ring is MAP_MIRROR and stores are
+ copied to each page of it
+*/
+
+#define MAP_ROM 0x01	/* stores are dropped */
+#define MAP_MIRROR 0x02	/* stores are copied to every page in the ring */
+#define MAP_MMIO 0x04	/* stores call mmio */
+
+typedef struct Map8080{
+	uint8_t flags[256];	/* MAP_ bits per page, 0 for plain RAM */
+	uint8_t next[256];	/* next page of the mirror ring, itself if none */
+	uint8_t alias;	/* some rings need memory from NewMemory8080 */
+	void (*mmio)(struct State8080* state, uint16_t addr, uint8_t value);
+	void *device;	/* for mmio and the port handlers */
+	uint64_t dropped;	/* stores to read-only pages */
+
+	/* I/O ports, see input() and output() */
+	uint8_t (*in[256])(struct State8080* state, uint8_t port);
+	void (*out[256])(struct State8080* state, uint8_t port, uint8_t value);
+	uint8_t inputs[256];	/* read by IN from ports with no handler */
+	uint64_t reads[256];
+	uint64_t writes[256];
+	uint8_t shifter;	/* OUT 2, OUT 4 and IN 3 are the Invaders shift register */
+	uint8_t shift_offset;
+	uint16_t shift;
+} Map8080;
+
+/* a map of all RAM with no mirrors */
+void InitMap8080(Map8080* map){
+
+	memset(map, 0, sizeof(Map8080));
+	for (int p = 0; p < 256; p++){
+		map->next[p] = p;
+	}
+
+}
+
+void SetPages8080(Map8080* map, uint16_t first, uint16_t last, uint8_t flags){
+
+	for (int p = first >> 8; p <= last >> 8; p++){
+		map->flags[p] = (map->flags[p] & MAP_MIRROR) | flags;
+	}
+
+}
+
+/* bytes in a host page when memory can be aliased, else 0 */
+static long hostpage(void){
+
+#ifdef ALIAS_MEMORY
+	long size = sysconf(_SC_PAGESIZE);
+	if (size >= 256 && size <= 0x10000 && 0x10000 % size == 0){
+		return size;
+	}
+#endif
+	return 0;
+
+}
+
+/*
+ makes first..last repeat the pages from source on. mirrors of
+ read-only pages are read-only. ranges of whole host pages are aliased,
+ others copied
+*/
+
+void MirrorPages8080(Map8080* map, uint16_t first, uint16_t last, uint16_t source){
+
+	long host = hostpage();
+	int alias = host > 0 && first % host == 0 && (last + 1) % host == 0 && source % host == 0;
+
+	for (int p = first >> 8, s = source >> 8; p <= last >> 8; p++, s++){
+		map->next[p] = map->next[s];
+		map->next[s] = p;
+		map->flags[p] = map->flags[s];
+		if (!alias){
+			map->flags[p] |= MAP_MIRROR;
+			map->flags[s] |= MAP_MIRROR;
+		}
+	}
+	map->alias |= alias;
+
+}
+
+/* the lowest page of the ring holding page p */
+static int firstmirror(const Map8080* map, int p){
+
+	int first = p;
+	for (int q = map->next[p]; q != p; q = map->next[q]){
+		first = q < first ? q : first;
+	}
+	return first;
+
+}
+
+/* copies the first page of every ring over the others, after loading memory directly */
+void SyncMirrors8080(const Map8080* map, uint8_t* memory){
+
+	for (int p = 0; p < 256; p++){
+		int s = firstmirror(map, p);
+		if (s != p){
+			memmove(&memory[p << 8], &memory[s << 8], 256);
+		}
+	}
+
+}
+
+/*
+ zeroed memory for a machine with map, which may be NULL, with 2 bytes
+ past the end. NULL if the mirrors of map cannot be aliased. free it
+ with FreeMemory8080
+*/
+
+uint8_t* NewMemory8080(const Map8080* map){
+
+	if (map == NULL || !map->alias){
+		return calloc(0x10000 + 2, 1);
+	}
+
+#ifdef ALIAS_MEMORY
+	long host = hostpage();
+	int per = host / 256;
+	uint8_t *memory = mmap(NULL, 0x10000 + host, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	int fd = syscall(SYS_memfd_create, "8080", 0);
+	int failed = memory == MAP_FAILED || fd < 0 || ftruncate(fd, 0x10000) != 0;
+
+	/* every host page shows the one holding the first pages of its rings */
+	for (int h = 0; h < 0x10000 / host && !failed; h++){
+		int first = firstmirror(map, h * per);
+		for (int k = 1; k < per; k++){
+			failed |= firstmirror(map, h * per + k) != first + k;
+		}
+		failed = failed || mmap(&memory[h * host], host, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+			fd, (off_t)(first / per) * host) == MAP_FAILED;
+	}
+	if (fd >= 0){
+		close(fd);
+	}
+	if (!failed){
+		return memory;
+	}
+	if (memory != MAP_FAILED){
+		munmap(memory, 0x10000 + host);
+	}
+#endif
+	return NULL;
+
+}
+
+void FreeMemory8080(uint8_t* memory, const Map8080* map){
+
+	if (map == NULL || !map->alias){
+		free(memory);
+		return;
+	}
+#ifdef ALIAS_MEMORY
+	if (memory != NULL){
+		munmap(memory, 0x10000 + hostpage());
+	}
+#endif
+
+}
+
+/*
+ Space Invaders: ROM at $0000-$1fff, work RAM at $2000-$23ff and video
+ RAM at $2400-$3fff. address lines 14 and 15 are not decoded, so
+ $4000-$ffff repeats the first 16K. IN 0-2 are the switches, with their
+ always set bits, IN 3 and OUT 2/4 the shift register. OUT 3 and 5
+ (sound) and 6 (watchdog) are only counted
+*/
+
+void MapInvaders8080(Map8080* map){
+
+	InitMap8080(map);
+	SetPages8080(map, 0x0000, 0x1fff, MAP_ROM);
+	for (int base = 0x4000; base < 0x10000; base += 0x4000){
+		MirrorPages8080(map, base, base + 0x3fff, 0x0000);
+	}
+	map->inputs[0] = 0x0e;
+	map->inputs[1] = 0x08;
+	map->shifter = 1;
+
+}
+
+static inline void store8(State8080* state, uint16_t addr, uint8_t value){
+
+	state->memory[addr] = value;
+	if (state->dirty != NULL){
+		state->dirty[addr >> 8] = DIRTY_ALL;
+	}
+	if (state->blocks != NULL && state->blocks->code[addr >> 8]){
+		InvalidateBlocks8080(state->blocks, addr);
+	}
+
+}
+
+/* a store to a page with map flags */
+static void mapwrite(State8080* state, uint16_t addr, uint8_t value){
+
+	Map8080 *map = state->map;
+	int page = addr >> 8, p = page;
+
+	if (map->flags[page] & MAP_MMIO){
+		map->mmio(state, addr, value);
+	}else if (map->flags[page] & MAP_ROM){
+		map->dropped++;
+	}else{
+		do{
+			store8(state, (p << 8) | (addr & 0xff), value);
+			p = map->next[p];
+		}while(p != page);
+	}
+
+}
+
+/* every guest store goes through here */
+static inline void write8(State8080* state, uint16_t addr, uint8_t value){
+
+	if (state->map != NULL && state->map->flags[addr >> 8]){
+		mapwrite(state, addr, value);
+	}else{
+		store8(state, addr, value);
+	}
+
+}
+
+/*
+ IN port: the shift register inline, then the port's handler or its
+ inputs byte. without a map A keeps its value
+*/
+static inline uint8_t input(State8080* state, uint8_t port){
+
+	Map8080 *map = state->map;
+
+	if (map == NULL){
+		return state->a;
+	}
+	map->reads[port]++;
+	if (port == 3 && map->shifter){
+		return map->shift >> (8 - map->shift_offset);
+	}
+	if (map->in[port] != NULL){
+		return map->in[port](state, port);
+	}
+	return map->inputs[port];
+
+}
+
+static inline void output(State8080* state, uint8_t port, uint8_t value){
+
+	Map8080 *map = state->map;
+
+	if (map == NULL){
+		return;
+	}
+	map->writes[port]++;
+	if (port == 2 && map->shifter){
+		map->shift_offset = value & 7;
+	}else if (port == 4 && map->shifter){
+		map->shift = (value << 8) | (map->shift >> 8);
+	}else if (map->out[port] != NULL){
+		map->out[port](state, port, value);
+	}
+
+}
 
-	uint16_t ret = state->pc + 2;
-	state->memory[state->sp-1] = (ret >> 8) & 0xff;
-	state->memory[state->sp-2] = (ret & 0xff);
-	state->sp = state->sp - 2;
-	state->pc = (opcode[2] << 8) | opcode[1];
+static inline int push(State8080* state, uint16_t value){
+
+	write8(state, (uint16_t)(state->sp - 1), (value >> 8) & 0xff);
+	write8(state, (uint16_t)(state->sp - 2), value & 0xff);
+	state->sp -= 2;
 	return 0;
 
 }
 
-int ret(State8080* state){
+static inline uint16_t pop(State8080* state){
 
-	state->pc = state->memory[state->sp] | (state->memory[state->sp+1] << 8);
+	uint16_t value = state->memory[state->sp] | (state->memory[(uint16_t)(state->sp + 1)] << 8);
 	state->sp += 2;
+	return value;
+
+}
+
+static inline int call(State8080* state, uint16_t addr){
+
+	push(state, state->pc);
+	state->pc = addr;
 	return 0;
 
 }
 
-int cmp(State8080* state, uint8_t value){
+static inline int ret(State8080* state){
 
-	uint8_t x = state->a - value;
-	zspflag(state, x);
-	state->cc.cy = (state->a < value);
+	state->pc = pop(state);
 	return 0;
 
 }
 
 uint16_t hl(State8080* state){
 
-	return (state->h << 8) | state->l;
+	return state->hl;
 
 }
-		
-void Emulate8080Op(State8080* state){
 
-	unsigned char *opcode = &state->memory[state->pc];
+/* register r including M */
+static inline uint8_t getreg(State8080* state, uint8_t r){
 
-	switch(*opcode){
-		case 0x00:{
-			break;
-		}
-		case 0x01:{
-			state->c = opcode[1];
-			state->b = opcode[2];
-			state->pc += 2;
-			break;
-		}
-		case 0x04:{
-			state->b = inr(state, state->b);
-			break;
-		}
-		case 0x05:{
-			state->b = dcr(state, state->b);
-			break;
-		}
-		case 0x06:
-			state->b = opcode[1];
-			state->pc += 1;
-			break;
-		case 0x07:{
-			uint8_t x = state->a;
-			state->cc.cy = state->a >> 7;
-			state->a = (x << 1) | (state->cc.cy);
-			break;
-		}	
-		case 0x0c:{
-			state->c = inr(state, state->c);
-			break;
+	if ((r & 7) == 6){
+		return state->memory[state->hl];
+	}
+	return REG(state, r);
+
+}
+
+static inline void setreg(State8080* state, uint8_t r, uint8_t value){
+
+	if ((r & 7) == 6){
+		write8(state, state->hl, value);
+	}else{
+		REG(state, r) = value;
+	}
+
+}
+
+/* register pair with 2 bit field rp, 3 is SP */
+static inline uint16_t* regpair(State8080* state, uint8_t rp){
+
+	rp &= 3;
+	return rp == 3 ? &state->sp : &state->pair[rp];
+
+}
+
+/*
+ condition field of Jcc/Ccc/Rcc: NZ Z NC C PO PE P M. bits 1-2 pick
+ the flag, bit 0 whether it has to be set
+*/
+static inline int cond(State8080* state, uint8_t c){
+
+	static const uint8_t flag[4] = {FLAG_Z, FLAG_CY, FLAG_P, FLAG_S};
+	return getflag(state, flag[(c >> 1) & 3]) == (c & 1);
+
+}
+		
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define USE_COMPUTED_GOTO
+#endif
+
+/*
+ cycles taken by each opcode. conditional calls and returns are
+ counted as not taken here, their bodies add the 6 extra cycles
+ when the condition holds
+*/
+
+const uint8_t cycles8080[256] = {
+	4, 10, 7, 5, 5, 5, 7, 4, 4, 10, 7, 5, 5, 5, 7, 4,
+	4, 10, 7, 5, 5, 5, 7, 4, 4, 10, 7, 5, 5, 5, 7, 4,
+	4, 10, 16, 5, 5, 5, 7, 4, 4, 10, 16, 5, 5, 5, 7, 4,
+	4, 10, 13, 5, 10, 10, 10, 4, 4, 10, 13, 5, 5, 5, 7, 4,
+	5, 5, 5, 5, 5, 5, 7, 5, 5, 5, 5, 5, 5, 5, 7, 5,
+	5, 5, 5, 5, 5, 5, 7, 5, 5, 5, 5, 5, 5, 5, 7, 5,
+	5, 5, 5, 5, 5, 5, 7, 5, 5, 5, 5, 5, 5, 5, 7, 5,
+	7, 7, 7, 7, 7, 7, 7, 7, 5, 5, 5, 5, 5, 5, 7, 5,
+	4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
+	4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
+	4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
+	4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
+	5, 10, 10, 10, 11, 11, 7, 11, 5, 10, 10, 10, 11, 17, 7, 11,
+	5, 10, 10, 10, 11, 11, 7, 11, 5, 10, 10, 10, 11, 17, 7, 11,
+	5, 10, 10, 18, 11, 11, 7, 11, 5, 5, 10, 4, 11, 17, 7, 11,
+	5, 10, 10, 4, 11, 11, 7, 11, 5, 5, 10, 4, 11, 17, 7, 11
+};
+
+/* executes one instruction and returns the cycles it took */
+
+int Emulate8080Op(State8080* state){
+
+	uint64_t start = state->cycles;
+	unsigned char *opcode = &state->memory[state->pc];
+	state->pc += 1;
+	state->cycles += cycles8080[*opcode];
+	state->ei_shadow = 0;
+
+	switch(*opcode){
+#define OP(n) case n:
+#define NEXT break
+#define STOP break
+#define IMM8 opcode[1]
+#define IMM16 ((opcode[2] << 8) | opcode[1])
+#define SKIP(n) (state->pc += (n))
+#include "opcodes8080.h"
+#undef OP
+#undef NEXT
+#undef STOP
+#undef IMM8
+#undef IMM16
+#undef SKIP
+	}
+
+	return state->cycles - start;
+
+}
+
+/*
+ runs instructions until at least cycles cycles have been used or the
+ cpu halts, counting them in state->cycles. the registers live in a
+ local copy for the whole batch and are written back to state once at
+ the end.
+
+ each handler jumps straight to the next one through a 256 entry table
+ of labels (direct threading). compilers without labels as values get
+ a switch in a loop instead, build with -DNO_COMPUTED_GOTO to force it
+*/
+
+RunResult8080 Run8080(State8080* machine, long cycles){
+
+	RunResult8080 result = {0, 0, RUN_BUDGET};
+	State8080 local = *machine;
+	State8080 *state = &local;
+	unsigned char *opcode;
+	uint64_t start = state->cycles;
+	uint64_t end = start + cycles;
+	long executed = 0;
+
+	if (state->halted){
+		result.status = RUN_HALT;
+		return result;
+	}
+
+#define IMM8 opcode[1]
+#define IMM16 ((opcode[2] << 8) | opcode[1])
+#define SKIP(n) (state->pc += (n))
+
+#ifdef USE_COMPUTED_GOTO
+#define ROW(h) &&op_0x##h##0, &&op_0x##h##1, &&op_0x##h##2, &&op_0x##h##3, \
+	&&op_0x##h##4, &&op_0x##h##5, &&op_0x##h##6, &&op_0x##h##7, \
+	&&op_0x##h##8, &&op_0x##h##9, &&op_0x##h##a, &&op_0x##h##b, \
+	&&op_0x##h##c, &&op_0x##h##d, &&op_0x##h##e, &&op_0x##h##f
+	static void *dispatch[256] = {
+		ROW(0), ROW(1), ROW(2), ROW(3), ROW(4), ROW(5), ROW(6), ROW(7),
+		ROW(8), ROW(9), ROW(a), ROW(b), ROW(c), ROW(d), ROW(e), ROW(f)
+	};
+#undef ROW
+#define OP(n) op_##n:
+#define NEXT do{ \
+		executed++; \
+		if (state->cycles >= end){ \
+			goto out; \
+		} \
+		opcode = &state->memory[state->pc]; \
+		state->pc += 1; \
+		state->cycles += cycles8080[*opcode]; \
+		goto *dispatch[*opcode]; \
+	}while(0)
+#define STOP do{ \
+		executed++; \
+		goto out; \
+	}while(0)
+
+	if (cycles <= 0){
+		goto out;
+	}
+	opcode = &state->memory[state->pc];
+	state->pc += 1;
+	state->cycles += cycles8080[*opcode];
+	goto *dispatch[*opcode];
+
+#include "opcodes8080.h"
+#undef OP
+#undef NEXT
+#undef STOP
+#else
+	while(state->cycles < end && !state->halted){
+		opcode = &state->memory[state->pc];
+		state->pc += 1;
+		state->cycles += cycles8080[*opcode];
+		switch(*opcode){
+#define OP(n) case n:
+#define NEXT break
+#define STOP break
+#include "opcodes8080.h"
+#undef OP
+#undef NEXT
+#undef STOP
 		}
-		case 0x0d:{
-			state->c = dcr(state, state->c);
-			break;
+		executed++;
+	}
+	goto out;
+#endif
+
+#undef IMM8
+#undef IMM16
+#undef SKIP
+
+out:
+	/* the instruction after EI runs before the engine stops, see Interrupt8080 */
+	if (executed > 0){
+		state->ei_shadow = *opcode == 0xfb;
+		while(state->ei_shadow && !state->halted){
+			Emulate8080Op(state);
+			executed++;
 		}
-		case 0x0e:
-			state->c = opcode[1];
-			state->pc += 1;
-			break;
-		case 0x0f:{
-			uint8_t x = state->a;
-			state->a = (x >> 1) | ((x & 1) << 7);
-			state->cc.cy = ((x & 1) == 1);
-			break;
+	}
+	*machine = local;
+	result.cycles = state->cycles - start;
+	result.instructions = executed;
+	if (state->halted){
+		result.status = RUN_HALT;
+	}
+	return result;
+
+}
+
+/* instruction length of each opcode */
+
+const uint8_t length8080[256] = {
+	1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,
+	1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,
+	1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1,
+	1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 3, 3, 3, 2, 1,
+	1, 1, 3, 2, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1,
+	1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1,
+	1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1
+};
+
+/* instructions that can change pc, HLT and PCHL included */
+static inline int endsblock(uint8_t op){
+
+	if (op == 0x76 || op == 0xe9){
+		return 1;
+	}
+	if (op < 0xc0){
+		return 0;
+	}
+	switch(op & 7){
+		case 0: case 2: case 4: case 7:
+			return 1;
+		case 1:
+			return op == 0xc9 || op == 0xd9;
+		case 3:
+			return op == 0xc3 || op == 0xcb;
+		case 5:
+			return (op & 0x0f) == 0x0d;
+	}
+	return 0;
+
+}
+
+/*
+ IN ends a block as well, after the block's cycles are charged, so a
+ port handler sees the same cycle count in every engine
+*/
+static inline int cutsblock(uint8_t op){
+
+	return endsblock(op) || op == 0xdb;
+
+}
+
+/*
+ whether a block of count instructions goes on to the one at addr. the
+ instruction after EI runs before any interrupt, so a block that would
+ fill up on EI ends before it, and EI starts the next one
+*/
+static inline int blockroom(const uint8_t* memory, uint32_t addr, int count){
+
+	return addr <= 0xffff && count < BLOCK_MAX - (memory[addr] == 0xfb);
+
+}
+
+void FlushBlocks8080(BlockCache8080* cache){
+
+	memset(cache->entry, 0, sizeof(cache->entry));
+	memset(cache->code, 0, sizeof(cache->code));
+	cache->nuops = 1;
+#ifdef USE_JIT
+	if (cache->jit != NULL){
+		FlushJit8080(cache->jit);
+	}
+#endif
+
+}
+
+BlockCache8080* NewBlockCache8080(void){
+
+	BlockCache8080 *cache = calloc(1, sizeof(BlockCache8080));
+	if (cache != NULL){
+		cache->fuse = 1;
+		FlushBlocks8080(cache);
+	}
+	return cache;
+
+}
+
+/* superinstructions in handler order, with the number of records each covers */
+const struct{
+	const char *name;
+	uint8_t length;
+} fusions[FUSIONS] = {
+	{"DCR r; JNZ", 2},
+	{"CPI; Jcc", 2},
+	{"LXI H; MOV r,M", 2},
+	{"INX rp; DCR r; JNZ", 3},
+	{"LDA; ANA A; Jcc", 3},
+	{"PUSH; PUSH", 2},
+	{"POP; POP", 2},
+	{"EI; RET", 2}
+};
+
+/*
+ handler for the record u, out of left records still in the block.
+ sequences that store to memory are only fused where the first store
+ comes last or the body checks for a dropped block after it
+*/
+static uint16_t fusion(const Uop8080* u, int left){
+
+	uint8_t a = u[0].op;
+	uint8_t b = left > 1 ? u[1].op : 0;
+	uint8_t c = left > 2 ? u[2].op : 0;
+
+	if ((a & 0xcf) == 0x03 && (b & 0xc7) == 0x05 && b != 0x35 && c == 0xc2){
+		return FUSE_INX_DCR_JNZ;
+	}
+	if (a == 0x3a && b == 0xa7 && (c & 0xc7) == 0xc2){
+		return FUSE_LDA_ANA_JCC;
+	}
+	if ((a & 0xc7) == 0x05 && a != 0x35 && b == 0xc2){
+		return FUSE_DCR_JNZ;
+	}
+	if (a == 0xfe && (b & 0xc7) == 0xc2){
+		return FUSE_CPI_JCC;
+	}
+	if (a == 0x21 && (b & 0xc7) == 0x46 && b != 0x76){
+		return FUSE_LXI_MOV;
+	}
+	if ((a & 0xcf) == 0xc5 && (b & 0xcf) == 0xc5){
+		return FUSE_PUSH_PUSH;
+	}
+	if ((a & 0xcf) == 0xc1 && (b & 0xcf) == 0xc1){
+		return FUSE_POP_POP;
+	}
+	if (a == 0xfb && (b == 0xc9 || b == 0xd9)){
+		return FUSE_EI_RET;
+	}
+	return a;
+
+}
+
+/* word pushed by PUSH op, PSW included */
+static inline uint16_t pushed(State8080* state, uint8_t op){
+
+	if (op == 0xf5){
+		return (state->a << 8) | flags(state)->psw;
+	}
+	return *regpair(state, op >> 4);
+
+}
+
+/* stores a word popped by POP op */
+static inline void popped(State8080* state, uint8_t op, uint16_t value){
+
+	if (op == 0xf1){
+		flags(state)->psw = (value & FLAG_MASK) | FLAG_1;
+		state->a = value >> 8;
+	}else{
+		*regpair(state, op >> 4) = value;
+	}
+
+}
+
+/* decodes the block starting at pc, flushing the cache when it is full */
+static uint32_t decodeblock(BlockCache8080* cache, uint8_t* memory, uint16_t pc){
+
+	if (cache->nuops + BLOCK_MAX + 2 > BLOCK_UOPS){
+		FlushBlocks8080(cache);
+	}
+
+	uint32_t first = cache->nuops++;
+	Uop8080 *head = &cache->uop[first];
+	uint32_t addr = pc;
+	uint8_t op;
+	Uop8080 *u;
+
+	memset(head, 0, sizeof(Uop8080));
+	do{
+		u = &cache->uop[cache->nuops++];
+		op = memory[addr];
+		u->op = op;
+		u->cycles = cycles8080[op];
+		u->handler = op;
+		u->imm = memory[addr + 1];
+		if (length8080[op] == 3){
+			u->imm |= memory[addr + 2] << 8;
 		}
-		case 0x11:
-			state->d = opcode[2];
-			state->e = opcode[1];
-			state->pc += 2;
-			break;
-		case 0x14:
-			state->d = inr(state, state->d);
-			break;
-		case 0x15:
-			state->d = dcr(state, state->d);
-			break;
-		case 0x16:
-			state->d = opcode[1];
-			state->pc += 1;
-			break;
-		case 0x17:{
-			uint8_t x = state->a;
-			state->a = (state->a << 1) | state->cc.cy;
-			state->cc.cy = (x >> 7);
-			break;
+		addr += length8080[op];
+		u->next = addr;
+		head->count++;
+		head->total += u->cycles;
+	}while(!cutsblock(op) && blockroom(memory, addr, head->count));
+	head->size = addr - pc;
+
+	if (cache->fuse){
+		Uop8080 *v = head + 1;
+		for (int left = head->count; left > 0; ){
+			v->handler = fusion(v, left);
+			int length = v->handler >= UOP_FUSED ? fusions[v->handler - UOP_FUSED].length : 1;
+			v += length;
+			left -= length;
 		}
-		case 0x1c:
-			state->e = inr(state, state->e);
-			break;
-		case 0x1d:
-			state->e = dcr(state, state->e);
-			break;
-		case 0x1e:
-			state->e = opcode[1];
-			state->pc += 1;
-			break;
-		case 0x1f:{
-			uint8_t x = state->a;
-			state->a = (x >> 1) | (state->cc.cy << 7);
-			state->cc.cy = ((x & 1) == 1);
-			break;
+	}
+
+	u = &cache->uop[cache->nuops++];
+	memset(u, 0, sizeof(Uop8080));
+	u->handler = UOP_END;
+
+	for (uint32_t page = pc >> 8; page <= (addr - 1) >> 8 && page < 256; page++){
+		int p = page;
+		do{
+			cache->code[p] = 1;
+			p = cache->ring != NULL ? cache->ring[p] : (int)page;
+		}while(p != (int)page);
+	}
+	cache->entry[pc] = first;
+	return first;
+
+}
+
+/*
+ same contract as Run8080, running from the block cache in
+ state->blocks. the budget is checked between blocks, so a run can
+ overshoot it by up to one block. a store that invalidates cached code
+ ends the current block right after the storing instruction
+*/
+
+RunResult8080 RunBlocks8080(State8080* machine, long cycles){
+
+	RunResult8080 result = {0, 0, RUN_BUDGET};
+	State8080 local = *machine;
+	State8080 *state = &local;
+	BlockCache8080 *cache = state->blocks;
+	uint64_t start = state->cycles;
+	uint64_t end = start + cycles;
+	long executed = 0;
+	Uop8080 *u;
+	unsigned char *opcode;
+
+	if (state->halted){
+		result.status = RUN_HALT;
+		return result;
+	}
+	cache->ring = state->map != NULL ? state->map->next : NULL;
+
+#define IMM8 ((uint8_t)u->imm)
+#define IMM16 (u->imm)
+#define SKIP(n)
+
+/*
+ a block is charged in full when it is entered, and pc is set to the
+ address after it. only the instruction ending the block reads pc.
+ leaves u on the first instruction
+*/
+#define ENTER() do{ \
+		uint32_t first = cache->entry[state->pc]; \
+		if (first == 0){ \
+			first = decodeblock(cache, state->memory, state->pc); \
+		} \
+		u = &cache->uop[first]; \
+		state->cycles += u->total; \
+		executed += u->count; \
+		state->pc += u->size; \
+		u++; \
+	}while(0)
+
+/* u is the first record of a dropped block that did not run */
+#define UNWIND() do{ \
+		state->pc = u[-1].next; \
+		for (; u->handler != UOP_END; u++){ \
+			state->cycles -= u->cycles; \
+			executed--; \
+		} \
+	}while(0)
+
+#ifdef USE_COMPUTED_GOTO
+#define ROW(h) &&op_0x##h##0, &&op_0x##h##1, &&op_0x##h##2, &&op_0x##h##3, \
+	&&op_0x##h##4, &&op_0x##h##5, &&op_0x##h##6, &&op_0x##h##7, \
+	&&op_0x##h##8, &&op_0x##h##9, &&op_0x##h##a, &&op_0x##h##b, \
+	&&op_0x##h##c, &&op_0x##h##d, &&op_0x##h##e, &&op_0x##h##f
+	static void *dispatch[UOP_HANDLERS] = {
+		ROW(0), ROW(1), ROW(2), ROW(3), ROW(4), ROW(5), ROW(6), ROW(7),
+		ROW(8), ROW(9), ROW(a), ROW(b), ROW(c), ROW(d), ROW(e), ROW(f),
+		&&enter, &&stale,
+		&&fuse_DCR_JNZ, &&fuse_CPI_JCC, &&fuse_LXI_MOV, &&fuse_INX_DCR_JNZ,
+		&&fuse_LDA_ANA_JCC, &&fuse_PUSH_PUSH, &&fuse_POP_POP, &&fuse_EI_RET
+	};
+#undef ROW
+#define OP(n) op_##n:
+#define NEXT do{ \
+		u++; \
+		opcode = &u->op; \
+		goto *dispatch[u->handler]; \
+	}while(0)
+#define STOP goto out
+
+	if (cycles <= 0){
+		goto out;
+	}
+	goto enter;
+
+#define FUSED(name) fuse_##name: cache->fired[FUSE_##name - UOP_FUSED]++;
+#include "opcodes8080.h"
+#include "fused8080.h"
+#undef OP
+#undef NEXT
+#undef STOP
+#undef FUSED
+
+stale:
+	UNWIND();
+enter:
+	if (state->cycles >= end){
+		goto out;
+	}
+	ENTER();
+	opcode = &u->op;
+	goto *dispatch[u->handler];
+#else
+	while(state->cycles < end && !state->halted){
+		ENTER();
+		for (; u->handler != UOP_END && u->handler != UOP_STALE; u++){
+			opcode = &u->op;
+			switch(u->handler){
+#define OP(n) case n:
+#define NEXT break
+#define STOP break
+#define FUSED(name) case FUSE_##name: cache->fired[FUSE_##name - UOP_FUSED]++;
+#include "opcodes8080.h"
+#include "fused8080.h"
+#undef OP
+#undef NEXT
+#undef STOP
+#undef FUSED
+			}
 		}
-		case 0x21:
-			state->h = opcode[2];
-			state->l = opcode[1];
-			state->pc += 2;
-			break;
-		case 0x24:
-			state->h = inr(state, state->h);
-			break;
-		case 0x25:
-			state->h = dcr(state, state->h);
-			break;
-		case 0x26:
-			state->h = opcode[1];
-			state->pc += 1;
-			break;
-		case 0x2c:
-			state->l = inr(state, state->l);
-			break;
-		case 0x2d:
-			state->l = dcr(state, state->l);
-			break;
-		case 0x2e:
-			state->l = opcode[1];
-			state->pc += 1;
-			break;
-		case 0x2f:
-			state->a = ~(state->a);
-			break;
-		case 0x33:
-			state->sp = state->sp + 1;
-			break;
-		case 0x37:
-			state->cc.cy = 1;
-			break;
-		case 0x3b:
-			state->sp = state->sp - 1;
-			break;
-		case 0x3c:
-			state->a = inr(state, state->a);
-			break;
-		case 0x3d:
-			state->a = dcr(state, state->a);
-			break;
-		case 0x3e:
-			state->a = opcode[1];
-			state->pc += 1;
-			break;
-		case 0x3f:
-			state->cc.cy = ~(state->cc.cy);
-			break;
-		case 0x40:
-			state->b = state->b;
-			break;
-		case 0x41:
-			state->b = state->c;
-			break;
-		case 0x42:
-			state->b = state->d;
-			break;
-		case 0x43:
-			state->b = state->e;
-			break;
-		case 0x44:
-			state->b = state->h;
-			break;
-		case 0x45:
-			state->b = state->l;
-			break;
-		case 0x47:
-			state->b = state->a;
-			break;
-		case 0x48:
-			state->c = state->b;
-			break;
-		case 0x49:
-			state->c = state->c;
-			break;
-		case 0x4a:
-			state->c = state->d;
-			break;
-		case 0x4b:
-			state->c = state->e;
-			break;
-		case 0x4c:
-			state->c = state->h;
-			break;
-		case 0x4d:
-			state->c = state->l;
-			break;
-		case 0x4f:
-			state->c = state->a;
-			break;
-		case 0x50:
-			state->d = state->b;
-			break;
-		case 0x51:
-			state->d = state->c;
-			break;
-		case 0x52:
-			state->d = state->d;
-			break;
-		case 0x53:
-			state->d = state->e;
-			break;
-		case 0x54:
-			state->d = state->h;
-			break;
-		case 0x55:
-			state->d = state->l;
-			break;
-		case 0x57:
-			state->d = state->a;
-			break;
-		case 0x58:
-			state->e = state->b;
-			break;
-		case 0x59:
-			state->e = state->c;
-			break;
-		case 0x5a:
-			state->e = state->d;
-			break;
-		case 0x5b:
-			state->e = state->e;
-			break;
-		case 0x5c:
-			state->e = state->h;
-			break;
-		case 0x5d:
-			state->e = state->l;
-			break;
-		case 0x5f:
-			state->e = state->a;
-			break;
-		case 0x60:
-			state->h = state->b;
-			break;
-		case 0x61:
-			state->h = state->c;
-			break;
-		case 0x62:
-			state->h = state->d;
-			break;
-		case 0x63:
-			state->h = state->e;
-			break;
-		case 0x64:
-			state->h = state->h;
-			break;
-		case 0x65:
-			state->h = state->l;
-			break;
-		case 0x67:
-			state->h = state->a;
-			break;
-		case 0x68:
-			state->l = state->b;
-			break;
-		case 0x69:
-			state->l = state->c;
-			break;
-		case 0x6a:
-			state->l = state->d;
-			break;
-		case 0x6b:
-			state->l = state->e;
-			break;
-		case 0x6c:
-			state->l = state->h;
-			break;
-		case 0x6d:
-			state->l = state->l;
-			break;
-		case 0x6f:
-			state->l = state->a;
-			break;
-		case 0x76:
-			exit(0);
-			break;
-		case 0x78:
-			state->a = state->b;
-			break;
-		case 0x79:
-			state->a = state->c;
-			break;
-		case 0x7a:
-			state->a = state->d;
-			break;
-		case 0x7b:
-			state->a = state->e;
-			break;
-		case 0x7c:
-			state->a = state->h;
-			break;
-		case 0x7d:
-			state->a = state->l;
-			break;
-		case 0x7f:
-			state->a = state->a;
-			break;
-		case 0x80:
-			state->a = add(state, state->b);
-			break;
-		case 0x81:
-			state->a = add(state, state->c);
-			break;
-		case 0x82:
-			state->a = add(state, state->d);
-			break;
-		case 0x83:
-			state->a = add(state, state->e);
-			break;
-		case 0x84:
-			state->a = add(state, state->h);
-			break;
-		case 0x85:
-			state->a = add(state, state->l);
-			break;
-		case 0x87:
-			state->a = add(state, state->a);
-			break;
-		case 0x88:
-			state->a = adc(state, state->b);
-			break;
-		case 0x89:
-			state->a = adc(state, state->c);
-			break;
-		case 0x8a:
-			state->a = adc(state, state->d);
-			break;
-		case 0x8b:
-			state->a = adc(state, state->e);
-			break;
-		case 0x8c:
-			state->a = adc(state, state->h);
-			break;
-		case 0x8d:
-			state->a = adc(state, state->l);
-			break;
-		case 0x8f:
-			state->a = adc(state, state->a);
-			break;
-		case 0x90:
-			state->a = sub(state, state->b);
-			break;
-		case 0x91:
-			state->a = sub(state, state->c);
-			break;
-		case 0x92:
-			state->a = sub(state, state->d);
-			break;
-		case 0x93:
-			state->a = sub(state, state->e);
-			break;
-		case 0x94:
-			state->a = sub(state, state->h);
-			break;
-		case 0x95:
-			state->a = sub(state, state->l);
-			break;
-		case 0x97:
-			state->a = sub(state, state->a);
-			break;
-		case 0x98:
-			state->a = sbb(state, state->b);
-			break;
-		case 0x99:
-			state->a = sbb(state, state->c);
-			break;
-		case 0x9a:
-			state->a = sbb(state, state->d);
-			break;
-		case 0x9b:
-			state->a = sbb(state, state->e);
-			break;
-		case 0x9c:
-			state->a = sbb(state, state->h);
-			break;
-		case 0x9d:
-			state->a = sbb(state, state->l);
-			break;
-		case 0x9f:
-			state->a = sbb(state, state->a);
-			break;
-		case 0xa0:
-			state->a = ana(state, state->b);
-			break;
-		case 0xa1:
-			state->a = ana(state, state->c);
-			break;
-		case 0xa2:
-			state->a = ana(state, state->d);
-			break;
-		case 0xa3:
-			state->a = ana(state, state->e);
-			break;
-		case 0xa4:
-			state->a = ana(state, state->h);
-			break;
-		case 0xa5:
-			state->a = ana(state, state->l);
-			break;
-		case 0xa7:
-			state->a = ana(state, state->a);
-			break;
-		case 0xa8:
-			state->a = xra(state, state->b);
-			break;
-		case 0xa9:
-			state->a = xra(state, state->c);
-			break;
-		case 0xaa:
-			state->a = xra(state, state->d);
-			break;
-		case 0xab:
-			state->a = xra(state, state->e);
-			break;
-		case 0xac:
-			state->a = xra(state, state->h);
-			break;
-		case 0xad:
-			state->a = xra(state, state->l);
-			break;
-		case 0xaf:
-			state->a = xra(state, state->a);
-			break;
-		case 0xb0:
-			state->a = ora(state, state->b);
-			break;
-		case 0xb1:
-			state->a = ora(state, state->c);
-			break;
-		case 0xb2:
-			state->a = ora(state, state->d);
-			break;
-		case 0xb3:
-			state->a = ora(state, state->e);
-			break;
-		case 0xb4:
-			state->a = ora(state, state->h);
-			break;
-		case 0xb5:
-			state->a = ora(state, state->l);
-			break;
-		case 0xb7:
-			state->a = ora(state, state->a);
-			break;
-		case 0xb8:
-			cmp(state, state->b);
-			break;
-		case 0xb9:
-			cmp(state, state->c);
-			break;
-		case 0xba:
-			cmp(state, state->d);
-			break;
-		case 0xbb:
-			cmp(state, state->e);
-			break;
-		case 0xbc:
-			cmp(state, state->h);
+		if (u->handler == UOP_STALE){
+			UNWIND();
+		}
+	}
+	goto out;
+#endif
+
+#undef ENTER
+#undef UNWIND
+#undef IMM8
+#undef IMM16
+#undef SKIP
+
+out:
+	/* no block ends on EI, so whatever shadow there was is over */
+	if (executed > 0){
+		state->ei_shadow = 0;
+	}
+	*machine = local;
+	result.cycles = state->cycles - start;
+	result.instructions = executed;
+	if (state->halted){
+		result.status = RUN_HALT;
+	}
+	return result;
+
+}
+
+
+
+#ifdef USE_JIT
+
+/*
+ x86-64 translator for hot blocks of the block cache. guest registers
+ live in host registers while native code runs, laid out the way the
+ 8086 inherited them from the 8080:
+
+ A = al, F = ah (lahf/sahf use the 8080 PSW layout), BC = bx,
+ DE = dx, HL = cx. SP stays in state
+
+ rbp holds state, rsi the guest memory, r12 the code page map of the
+ block cache, r13 the Jit8080, r14 the cycle budget end and r15 the
+ cycle counter. rdi and r8-r11 are scratch. high byte registers cannot
+ be encoded next to a REX prefix, so scratch work that touches ah or
+ bh/ch/dh goes through edi
+
+ every block starts with the budget check and charges its cycles and
+ instructions up front. exits to a known pc go through a stub that
+ returns to RunJit8080, which patches the jump to go straight to the
+ target once it is translated. RET and PCHL look the target up in
+ native[] themselves. instructions without a native form call
+ Emulate8080Op through jitstep() with the registers spilled. with a map
+ that flags pages, each store checks the flags of its pages first: a
+ plain byte store to a read-only page is dropped in place, anything
+ else leaves for RunJit8080 to run the instruction through write8
+*/
+
+#define JIT_ARENA (8 << 20)
+#define JIT_BLOCK_BYTES 8192
+#define JIT_HOT 16
+
+typedef struct Jit8080{
+	void *native[0x10000];	/* translation of the block starting at pc */
+	uint64_t executed;	/* instructions retired by native code */
+	int32_t store;	/* code address stored to by native code, -1 if none */
+	uint8_t *codepages;	/* the block cache code map, for r12 */
+	uint8_t heat[0x10000];	/* times each block was interpreted */
+	uint8_t hot;	/* heat at which a block gets translated */
+	uint8_t dirty;	/* translations keep state->dirty, which was set */
+	uint8_t mapped;	/* translations check the page flags of state->map */
+	uint8_t interpret;	/* a STUB_MAP exit left the instruction at pc to write8 */
+	uint8_t *arena;
+	uint32_t used;
+	uint32_t base;	/* end of the enter/leave routines */
+	uint32_t generation;	/* bumped on every flush */
+	uint8_t *(*enter)(State8080* state, void* code, uint64_t end, struct Jit8080* jit);
+	uint8_t *leave0;	/* returns with nothing to patch */
+	uint8_t *leave;	/* returns the jump site in r8 */
+	BlockCache8080 *cache;
+} Jit8080;
+
+/* host byte register of each 8080 register field, M has none */
+static const int8_t jitreg8[8] = {7, 3, 6, 2, 5, 1, -1, 0};
+/* host word register of BC DE HL */
+static const int8_t jitreg16[3] = {3, 2, 1};
+
+#define OFF_BC offsetof(State8080, bc)
+#define OFF_DE offsetof(State8080, de)
+#define OFF_HL offsetof(State8080, hl)
+#define OFF_A offsetof(State8080, a)
+#define OFF_SP offsetof(State8080, sp)
+#define OFF_PC offsetof(State8080, pc)
+#define OFF_MEMORY offsetof(State8080, memory)
+#define OFF_DIRTY offsetof(State8080, dirty)
+#define OFF_MAP offsetof(State8080, map)
+#define OFF_CYCLES offsetof(State8080, cycles)
+#define OFF_PSW offsetof(State8080, cc.psw)
+#define OFF_IE offsetof(State8080, cc.interrupt_enabled)
+
+_Static_assert(sizeof(State8080) <= 128, "native code reaches state with 8 bit displacements");
+_Static_assert(offsetof(Map8080, flags) == 0, "store guards index the map by page");
+
+/* kinds of out of line stubs */
+#define STUB_EXIT 0	/* leave for a known pc, chainable */
+#define STUB_BUDGET 1	/* budget used up before the block */
+#define STUB_STORE 2	/* a store hit a code page */
+#define STUB_HELPER 3	/* jitstep dropped cached code */
+#define STUB_MAP 4	/* a store hit a page with map flags */
+
+typedef struct Emit8080{
+	uint8_t *p;
+	int nstubs;
+	struct{
+		uint8_t *site;	/* rel32 that jumps to the stub */
+		uint8_t kind;
+		uint16_t pc;
+		uint32_t cycles;	/* charged for instructions that did not run */
+		uint32_t count;
+	} stub[BLOCK_MAX * 4 + 4];
+	uint8_t dirty;	/* stores also mark the dirty page map */
+	uint8_t mapped;	/* stores check the page flags first */
+} Emit8080;
+
+static void emitbytes(Emit8080* e, const uint8_t* bytes, int n){
+
+	memcpy(e->p, bytes, n);
+	e->p += n;
+
+}
+
+#define EMIT(e, ...) emitbytes(e, (const uint8_t[]){__VA_ARGS__}, sizeof((const uint8_t[]){__VA_ARGS__}))
+
+static void emit16(Emit8080* e, uint16_t x){
+
+	memcpy(e->p, &x, 2);
+	e->p += 2;
+
+}
+
+static void emit32(Emit8080* e, uint32_t x){
+
+	memcpy(e->p, &x, 4);
+	e->p += 4;
+
+}
+
+static void emit64(Emit8080* e, uint64_t x){
+
+	memcpy(e->p, &x, 8);
+	e->p += 8;
+
+}
+
+/* rel32 field to a fixed address */
+static void emitrel(Emit8080* e, uint8_t* target){
+
+	emit32(e, (uint32_t)(target - (e->p + 4)));
+
+}
+
+/* rel32 field to a stub emitted after the block */
+static void emitstub(Emit8080* e, int kind, uint16_t pc, uint32_t cycles, uint32_t count){
+
+	e->stub[e->nstubs].site = e->p;
+	e->stub[e->nstubs].kind = kind;
+	e->stub[e->nstubs].pc = pc;
+	e->stub[e->nstubs].cycles = cycles;
+	e->stub[e->nstubs].count = count;
+	e->nstubs++;
+	emit32(e, 0);
+
+}
+
+static void emitspill(Emit8080* e){
+
+	EMIT(e, 0x66, 0x89, 0x5d, OFF_BC);	/* mov [rbp+bc], bx */
+	EMIT(e, 0x66, 0x89, 0x55, OFF_DE);	/* mov [rbp+de], dx */
+	EMIT(e, 0x66, 0x89, 0x4d, OFF_HL);	/* mov [rbp+hl], cx */
+	EMIT(e, 0x88, 0x45, OFF_A);	/* mov [rbp+a], al */
+	EMIT(e, 0x88, 0x65, OFF_PSW);	/* mov [rbp+psw], ah */
+	EMIT(e, 0x4c, 0x89, 0x7d, OFF_CYCLES);	/* mov [rbp+cycles], r15 */
+
+}
+
+static void emitload(Emit8080* e){
+
+	EMIT(e, 0x0f, 0xb7, 0x5d, OFF_BC);	/* movzx ebx, word [rbp+bc] */
+	EMIT(e, 0x0f, 0xb7, 0x55, OFF_DE);	/* movzx edx, word [rbp+de] */
+	EMIT(e, 0x0f, 0xb7, 0x4d, OFF_HL);	/* movzx ecx, word [rbp+hl] */
+	EMIT(e, 0x0f, 0xb6, 0x45, OFF_A);	/* movzx eax, byte [rbp+a] */
+	EMIT(e, 0x8a, 0x65, OFF_PSW);	/* mov ah, [rbp+psw] */
+	EMIT(e, 0x4c, 0x8b, 0x7d, OFF_CYCLES);	/* mov r15, [rbp+cycles] */
+	EMIT(e, 0x48, 0x8b, 0x75, OFF_MEMORY);	/* mov rsi, [rbp+memory] */
+
+}
+
+/* host CF into CY, leaves the other flags alone */
+static void emitsetcy(Emit8080* e){
+
+	EMIT(e, 0x19, 0xff);	/* sbb edi, edi */
+	EMIT(e, 0x81, 0xe7, 0x00, 0x01, 0x00, 0x00);	/* and edi, 0x100 */
+	EMIT(e, 0x25, 0xff, 0xfe, 0xff, 0xff);	/* and eax, ~0x100 */
+	EMIT(e, 0x09, 0xf8);	/* or eax, edi */
+
+}
+
+/* r10d = page of the address in r9d plus i */
+static void emitpage(Emit8080* e, int i){
+
+	if (i > 0){
+		EMIT(e, 0x45, 0x8d, 0x51, 0x01);	/* lea r10d, [r9+1] */
+		EMIT(e, 0x41, 0x81, 0xe2, 0xff, 0xff, 0x00, 0x00);	/* and r10d, 0xffff */
+	}else{
+		EMIT(e, 0x45, 0x89, 0xca);	/* mov r10d, r9d */
+	}
+	EMIT(e, 0x41, 0xc1, 0xea, 0x08);	/* shr r10d, 8 */
+
+}
+
+/*
+ follows every native store. marks the dirty map when it is kept, then
+ leaves through a STUB_STORE stub when the page of the address in word
+ register reg, or of the byte after it, holds cached code
+*/
+static void emitcheck(Emit8080* e, int reg, int bytes, uint16_t pc, uint32_t cycles, uint32_t count){
+
+	EMIT(e, 0x44, 0x0f, 0xb7, 0xc8 | reg);	/* movzx r9d, reg */
+	if (e->dirty){
+		EMIT(e, 0x4c, 0x8b, 0x5d, OFF_DIRTY);	/* mov r11, [rbp+dirty] */
+		for (int i = 0; i < bytes; i++){
+			emitpage(e, i);
+			EMIT(e, 0x43, 0xc6, 0x04, 0x13, DIRTY_ALL);	/* mov byte [r11+r10], DIRTY_ALL */
+		}
+	}
+	for (int i = 0; i < bytes; i++){
+		emitpage(e, i);
+		EMIT(e, 0x43, 0x80, 0x3c, 0x14, 0x00);	/* cmp byte [r12+r10], 0 */
+		EMIT(e, 0x0f, 0x85);	/* jne */
+		emitstub(e, STUB_STORE, pc, cycles, count);
+	}
+
+}
+
+/* same for a fixed address */
+static void emitcheckimm(Emit8080* e, uint16_t addr, int bytes, uint16_t pc, uint32_t cycles, uint32_t count){
+
+	EMIT(e, 0x41, 0xb9);	/* mov r9d, addr */
+	emit32(e, addr);
+	if (e->dirty){
+		EMIT(e, 0x4c, 0x8b, 0x5d, OFF_DIRTY);	/* mov r11, [rbp+dirty] */
+		for (int i = 0; i < bytes; i++){
+			EMIT(e, 0x41, 0xc6, 0x83);	/* mov byte [r11+page], DIRTY_ALL */
+			emit32(e, (uint16_t)(addr + i) >> 8);
+			EMIT(e, DIRTY_ALL);
+		}
+	}
+	for (int i = 0; i < bytes; i++){
+		EMIT(e, 0x41, 0x80, 0xbc, 0x24);	/* cmp byte [r12+page], 0 */
+		emit32(e, (uint16_t)(addr + i) >> 8);
+		EMIT(e, 0x00);
+		EMIT(e, 0x0f, 0x85);	/* jne */
+		emitstub(e, STUB_STORE, pc, cycles, count);
+	}
+
+}
+
+/*
+ ahead of a store when translations are mapped: leaves through a
+ STUB_MAP stub, before anything of the instruction at pc has run, when
+ the page of the address in r9d, or of the byte after it, has flags
+ other than allowed. leaves the map in r11, whose flags[] comes first
+*/
+static void emitguard(Emit8080* e, int bytes, uint8_t allowed, uint16_t pc, uint32_t cycles, uint32_t count){
+
+	EMIT(e, 0x4c, 0x8b, 0x5d, OFF_MAP);	/* mov r11, [rbp+map] */
+	for (int i = 0; i < bytes; i++){
+		emitpage(e, i);
+		EMIT(e, 0x43, 0xf6, 0x04, 0x13, (uint8_t)~allowed);	/* test byte [r11+r10], ~allowed */
+		EMIT(e, 0x0f, 0x85);	/* jnz */
+		emitstub(e, STUB_MAP, pc, cycles, count);
+	}
+
+}
+
+/* same with the address in word register reg */
+static void emitguardreg(Emit8080* e, int reg, int bytes, uint8_t allowed, uint16_t pc, uint32_t cycles, uint32_t count){
+
+	EMIT(e, 0x44, 0x0f, 0xb7, 0xc8 | reg);	/* movzx r9d, reg */
+	emitguard(e, bytes, allowed, pc, cycles, count);
+
+}
+
+/* same for the two bytes a push stores */
+static void emitguardpush(Emit8080* e, uint16_t pc, uint32_t cycles, uint32_t count){
+
+	EMIT(e, 0x44, 0x0f, 0xb7, 0x4d, OFF_SP);	/* movzx r9d, word [rbp+sp] */
+	EMIT(e, 0x41, 0x83, 0xe9, 0x02);	/* sub r9d, 2 */
+	EMIT(e, 0x41, 0x81, 0xe1, 0xff, 0xff, 0x00, 0x00);	/* and r9d, 0xffff */
+	emitguard(e, 2, 0, pc, cycles, count);
+
+}
+
+/*
+ after emitguard let a read-only page through: jumps over the one byte
+ store that follows when it goes to one. returns the jump for emitdrop
+*/
+static uint8_t* emitrom(Emit8080* e){
+
+	EMIT(e, 0x43, 0xf6, 0x04, 0x13, MAP_ROM);	/* test byte [r11+r10], ROM */
+	EMIT(e, 0x75, 0x00);	/* jnz drop */
+	return e->p - 1;
+
+}
+
+/* ends the store emitrom jumps over, where it is counted dropped instead */
+static void emitdrop(Emit8080* e, uint8_t* site){
+
+	EMIT(e, 0xeb, 0x07);	/* jmp over the drop */
+	*site = (uint8_t)(e->p - (site + 1));
+	EMIT(e, 0x49, 0xff, 0x83);	/* inc qword [r11+dropped] */
+	emit32(e, offsetof(Map8080, dropped));
+
+}
+
+/* pushes word register reg, or hi:lo byte registers when reg < 0 */
+static void emitpush(Emit8080* e, int hi, int lo){
+
+	EMIT(e, 0x0f, 0xb7, 0x7d, OFF_SP);	/* movzx edi, word [rbp+sp] */
+	EMIT(e, 0x66, 0xff, 0xcf);	/* dec di */
+	EMIT(e, 0x88, (hi << 3) | 4, 0x3e);	/* mov [rsi+rdi], hi */
+	EMIT(e, 0x66, 0xff, 0xcf);	/* dec di */
+	EMIT(e, 0x88, (lo << 3) | 4, 0x3e);	/* mov [rsi+rdi], lo */
+	EMIT(e, 0x66, 0x89, 0x7d, OFF_SP);	/* mov [rbp+sp], di */
+
+}
+
+static void emitpushimm(Emit8080* e, uint16_t value){
+
+	EMIT(e, 0x0f, 0xb7, 0x7d, OFF_SP);	/* movzx edi, word [rbp+sp] */
+	EMIT(e, 0x66, 0xff, 0xcf);	/* dec di */
+	EMIT(e, 0xc6, 0x04, 0x3e, value >> 8);	/* mov byte [rsi+rdi], hi */
+	EMIT(e, 0x66, 0xff, 0xcf);	/* dec di */
+	EMIT(e, 0xc6, 0x04, 0x3e, value & 0xff);	/* mov byte [rsi+rdi], lo */
+	EMIT(e, 0x66, 0x89, 0x7d, OFF_SP);	/* mov [rbp+sp], di */
+
+}
+
+/* pops into edi */
+static void emitpop(Emit8080* e){
+
+	EMIT(e, 0x0f, 0xb7, 0x7d, OFF_SP);	/* movzx edi, word [rbp+sp] */
+	EMIT(e, 0x44, 0x0f, 0xb6, 0x04, 0x3e);	/* movzx r8d, byte [rsi+rdi] */
+	EMIT(e, 0x66, 0xff, 0xc7);	/* inc di */
+	EMIT(e, 0x44, 0x0f, 0xb6, 0x0c, 0x3e);	/* movzx r9d, byte [rsi+rdi] */
+	EMIT(e, 0x66, 0xff, 0xc7);	/* inc di */
+	EMIT(e, 0x66, 0x89, 0x7d, OFF_SP);	/* mov [rbp+sp], di */
+	EMIT(e, 0x41, 0xc1, 0xe1, 0x08);	/* shl r9d, 8 */
+	EMIT(e, 0x45, 0x09, 0xc8);	/* or r8d, r9d */
+	EMIT(e, 0x44, 0x89, 0xc7);	/* mov edi, r8d */
+
+}
+
+/* continues at the pc in edi, through native[] when it is translated */
+static void emitdispatch(Emit8080* e, Jit8080* jit){
+
+	EMIT(e, 0x66, 0x89, 0x7d, OFF_PC);	/* mov [rbp+pc], di */
+	EMIT(e, 0x4d, 0x8b, 0x44, 0xfd, 0x00);	/* mov r8, [r13+rdi*8] */
+	EMIT(e, 0x4d, 0x85, 0xc0);	/* test r8, r8 */
+	EMIT(e, 0x0f, 0x84);	/* jz leave0 */
+	emitrel(e, jit->leave0);
+	EMIT(e, 0x41, 0xff, 0xe0);	/* jmp r8 */
+
+}
+
+/* jumps to the stub when condition field c of Jcc/Ccc/Rcc fails */
+static void emitcond(Emit8080* e, uint8_t c, uint16_t pc){
+
+	static const uint8_t flag[4] = {FLAG_Z, FLAG_CY, FLAG_P, FLAG_S};
+	EMIT(e, 0xf6, 0xc4, flag[(c >> 1) & 3]);	/* test ah, flag */
+	EMIT(e, 0x0f, c & 1 ? 0x84 : 0x85);	/* jz/jnz */
+	emitstub(e, STUB_EXIT, pc, 0, 0);
+
+}
+
+/* instructions left to jitstep() */
+static int jitnative(Uop8080* u){
+
+	switch(u->op){
+		case 0x27: case 0x76: case 0xd3: case 0xdb: case 0xe3:
+			return 0;
+		case 0x22: case 0x2a:
+			return u->imm != 0xffff;
+	}
+	return 1;
+
+}
+
+/* runs one instruction for native code, returns 1 if it dropped cached code */
+static int jitstep(State8080* state){
+
+	uint32_t before = state->blocks->invalidations;
+	Emulate8080Op(state);
+	(void)flags(state);
+	return state->blocks->invalidations != before;
+
+}
+
+/*
+ translates the block of the block cache starting at pc and returns
+ its entry point
+*/
+
+static void* compileblock(Jit8080* jit, uint16_t pc, uint8_t* memory){
+
+	BlockCache8080 *cache = jit->cache;
+	if (jit->used + JIT_BLOCK_BYTES > JIT_ARENA){
+		FlushBlocks8080(cache);
+	}
+	uint32_t first = cache->entry[pc];
+	if (first == 0){
+		first = decodeblock(cache, memory, pc);
+	}
+
+	Uop8080 *head = &cache->uop[first];
+	Uop8080 *uop = head + 1;
+	int n = head->count;
+	uint32_t rest[BLOCK_MAX + 1];
+	uint32_t total = 0;
+
+	rest[n] = 0;
+	for (int i = n - 1; i >= 0; i--){
+		rest[i] = rest[i + 1] + (jitnative(&uop[i]) ? uop[i].cycles : 0);
+	}
+	total = rest[0];
+
+	static Emit8080 emit;
+	Emit8080 *e = &emit;
+	uint8_t *entry = jit->arena + jit->used;
+	e->p = entry;
+	e->nstubs = 0;
+	e->dirty = jit->dirty;
+	e->mapped = jit->mapped;
+
+	EMIT(e, 0x4d, 0x39, 0xf7);	/* cmp r15, r14 */
+	EMIT(e, 0x0f, 0x83);	/* jae budget stub */
+	emitstub(e, STUB_BUDGET, pc, 0, 0);
+	if (total){
+		EMIT(e, 0x49, 0x81, 0xc7);	/* add r15, total */
+		emit32(e, total);
+	}
+	EMIT(e, 0x49, 0x81, 0x85);	/* add qword [r13+executed], n */
+	emit32(e, offsetof(Jit8080, executed));
+	emit32(e, n);
+
+	for (int i = 0; i < n; i++){
+		Uop8080 *u = &uop[i];
+		uint8_t op = u->op;
+		uint8_t d = (op >> 3) & 7, s = op & 7;
+		uint16_t next = u->next;
+		uint32_t left = rest[i + 1], count = n - 1 - i;
+		/* where a STUB_MAP exit hands this instruction to the interpreter */
+		uint16_t at = i == 0 ? pc : uop[i - 1].next;
+		uint8_t *drop = NULL;
+
+		if (!jitnative(u)){
+			emitspill(e);
+			EMIT(e, 0x66, 0xc7, 0x45, OFF_PC);	/* mov word [rbp+pc], addr */
+			emit16(e, at);
+			EMIT(e, 0x48, 0x89, 0xef);	/* mov rdi, rbp */
+			EMIT(e, 0x48, 0xb8);	/* mov rax, jitstep */
+			emit64(e, (uint64_t)(uintptr_t)jitstep);
+			EMIT(e, 0xff, 0xd0);	/* call rax */
+			EMIT(e, 0x41, 0x89, 0xc1);	/* mov r9d, eax */
+			emitload(e);
+			if (op == 0x76){
+				EMIT(e, 0xe9);	/* jmp leave0 */
+				emitrel(e, jit->leave0);
+			}else{
+				EMIT(e, 0x45, 0x85, 0xc9);	/* test r9d, r9d */
+				EMIT(e, 0x0f, 0x85);	/* jnz helper stub */
+				emitstub(e, STUB_HELPER, 0, left, count);
+			}
+			continue;
+		}
+
+		if (op >= 0x40 && op < 0x80){
+			/* MOV */
+			if (s == 6){
+				EMIT(e, 0x8a, (jitreg8[d] << 3) | 4, 0x0e);	/* mov r, [rsi+rcx] */
+			}else if (d == 6){
+				if (e->mapped){
+					emitguardreg(e, 1, 1, MAP_ROM, at, rest[i], count + 1);
+					drop = emitrom(e);
+				}
+				EMIT(e, 0x88, (jitreg8[s] << 3) | 4, 0x0e);	/* mov [rsi+rcx], r */
+				emitcheck(e, 1, 1, next, left, count);
+				if (drop != NULL){
+					emitdrop(e, drop);
+				}
+			}else{
+				EMIT(e, 0x88, 0xc0 | (jitreg8[s] << 3) | jitreg8[d]);	/* mov r, r */
+			}
+			continue;
+		}
+
+		if ((op >= 0x80 && op < 0xc0) || (op & 0xc7) == 0xc6){
+			/* ALU: add or adc sbb and sub xor cmp, in 8080 order */
+			static const uint8_t alu[8] = {0x00, 0x10, 0x28, 0x18, 0x20, 0x30, 0x08, 0x38};
+			uint8_t x = alu[d];
+			if (d == 1 || d == 3){
+				EMIT(e, 0x9e);	/* sahf */
+			}
+			if (d == 4){
+				/* edi = A | operand, for AC */
+				if (op >= 0xc0){
+					EMIT(e, 0xbf);	/* mov edi, imm */
+					emit32(e, u->imm & 0xff);
+				}else if (s == 6){
+					EMIT(e, 0x0f, 0xb6, 0x3c, 0x0e);	/* movzx edi, byte [rsi+rcx] */
+				}else{
+					EMIT(e, 0x0f, 0xb6, 0xf8 | jitreg8[s]);	/* movzx edi, r */
+				}
+				EMIT(e, 0x09, 0xc7);	/* or edi, eax */
+			}
+			if (op >= 0xc0){
+				EMIT(e, x + 4, u->imm & 0xff);	/* op al, imm */
+			}else if (s == 6){
+				EMIT(e, x + 2, 0x04, 0x0e);	/* op al, [rsi+rcx] */
+			}else{
+				EMIT(e, x + 2, 0xc0 | jitreg8[s]);	/* op al, r */
+			}
+			EMIT(e, 0x9f);	/* lahf */
+			if (d == 2 || d == 3 || d == 7){
+				EMIT(e, 0x80, 0xf4, FLAG_AC);	/* xor ah, AC, the 8080 borrow is inverted */
+			}else if (d == 5 || d == 6){
+				EMIT(e, 0x80, 0xe4, (uint8_t)~FLAG_AC);	/* and ah, ~AC */
+			}else if (d == 4){
+				EMIT(e, 0xc1, 0xe7, 0x09);	/* shl edi, 9 */
+				EMIT(e, 0x81, 0xe7, 0x00, 0x10, 0x00, 0x00);	/* and edi, 0x1000 */
+				EMIT(e, 0x25, 0xff, 0xef, 0xff, 0xff);	/* and eax, ~0x1000 */
+				EMIT(e, 0x09, 0xf8);	/* or eax, edi */
+			}
+			continue;
+		}
+
+		switch(op){
+			case 0x00: case 0x08: case 0x10: case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+				break;
+			case 0x01: case 0x11: case 0x21:
+				EMIT(e, 0x66, 0xb8 + jitreg16[op >> 4]);	/* mov rp, imm */
+				emit16(e, u->imm);
+				break;
+			case 0x31:
+				EMIT(e, 0x66, 0xc7, 0x45, OFF_SP);	/* mov word [rbp+sp], imm */
+				emit16(e, u->imm);
+				break;
+			case 0x02: case 0x12:
+				if (e->mapped){
+					emitguardreg(e, jitreg16[op >> 4], 1, MAP_ROM, at, rest[i], count + 1);
+					drop = emitrom(e);
+				}
+				EMIT(e, 0x88, 0x04, op == 0x02 ? 0x1e : 0x16);	/* mov [rsi+rp], al */
+				emitcheck(e, jitreg16[op >> 4], 1, next, left, count);
+				if (drop != NULL){
+					emitdrop(e, drop);
+				}
+				break;
+			case 0x0a: case 0x1a:
+				EMIT(e, 0x8a, 0x04, op == 0x0a ? 0x1e : 0x16);	/* mov al, [rsi+rp] */
+				break;
+			case 0x03: case 0x13: case 0x23:
+				EMIT(e, 0x66, 0xff, 0xc0 | jitreg16[op >> 4]);	/* inc rp */
+				break;
+			case 0x33:
+				EMIT(e, 0x66, 0xff, 0x45, OFF_SP);	/* inc word [rbp+sp] */
+				break;
+			case 0x0b: case 0x1b: case 0x2b:
+				EMIT(e, 0x66, 0xff, 0xc8 | jitreg16[op >> 4]);	/* dec rp */
+				break;
+			case 0x3b:
+				EMIT(e, 0x66, 0xff, 0x4d, OFF_SP);	/* dec word [rbp+sp] */
+				break;
+			case 0x04: case 0x0c: case 0x14: case 0x1c: case 0x24: case 0x2c: case 0x34: case 0x3c:
+			case 0x05: case 0x0d: case 0x15: case 0x1d: case 0x25: case 0x2d: case 0x35: case 0x3d:
+				/* INR/DCR keep CY, which inc/dec leave alone */
+				if (d == 6 && e->mapped){
+					emitguardreg(e, 1, 1, 0, at, rest[i], count + 1);
+				}
+				EMIT(e, 0x9e);	/* sahf */
+				if (d == 6){
+					EMIT(e, 0xfe, s == 4 ? 0x04 : 0x0c, 0x0e);	/* inc/dec byte [rsi+rcx] */
+				}else{
+					EMIT(e, 0xfe, (s == 4 ? 0xc0 : 0xc8) | jitreg8[d]);	/* inc/dec r */
+				}
+				EMIT(e, 0x9f);	/* lahf */
+				if (s == 5){
+					EMIT(e, 0x80, 0xf4, FLAG_AC);	/* xor ah, AC */
+				}
+				if (d == 6){
+					emitcheck(e, 1, 1, next, left, count);
+				}
+				break;
+			case 0x06: case 0x0e: case 0x16: case 0x1e: case 0x26: case 0x2e: case 0x36: case 0x3e:
+				if (d == 6){
+					if (e->mapped){
+						emitguardreg(e, 1, 1, MAP_ROM, at, rest[i], count + 1);
+						drop = emitrom(e);
+					}
+					EMIT(e, 0xc6, 0x04, 0x0e, u->imm & 0xff);	/* mov byte [rsi+rcx], imm */
+					emitcheck(e, 1, 1, next, left, count);
+					if (drop != NULL){
+						emitdrop(e, drop);
+					}
+				}else{
+					EMIT(e, 0xb0 + jitreg8[d], u->imm & 0xff);	/* mov r, imm */
+				}
+				break;
+			case 0x07:
+				EMIT(e, 0x80, 0xe4, 0xfe);	/* and ah, ~CY */
+				EMIT(e, 0xd0, 0xc0);	/* rol al, 1 */
+				EMIT(e, 0x80, 0xd4, 0x00);	/* adc ah, 0 */
+				break;
+			case 0x0f:
+				EMIT(e, 0x80, 0xe4, 0xfe);	/* and ah, ~CY */
+				EMIT(e, 0xd0, 0xc8);	/* ror al, 1 */
+				EMIT(e, 0x80, 0xd4, 0x00);	/* adc ah, 0 */
+				break;
+			case 0x17:
+				EMIT(e, 0x9e);	/* sahf */
+				EMIT(e, 0xd0, 0xd0);	/* rcl al, 1 */
+				emitsetcy(e);
+				break;
+			case 0x1f:
+				EMIT(e, 0x9e);	/* sahf */
+				EMIT(e, 0xd0, 0xd8);	/* rcr al, 1 */
+				emitsetcy(e);
+				break;
+			case 0x09: case 0x19: case 0x29:
+				EMIT(e, 0x66, 0x01, 0xc1 | (jitreg16[op >> 4] << 3));	/* add cx, rp */
+				emitsetcy(e);
+				break;
+			case 0x39:
+				EMIT(e, 0x66, 0x03, 0x4d, OFF_SP);	/* add cx, [rbp+sp] */
+				emitsetcy(e);
+				break;
+			case 0x22:
+				if (e->mapped){
+					EMIT(e, 0x41, 0xb9);	/* mov r9d, addr */
+					emit32(e, u->imm);
+					emitguard(e, 2, 0, at, rest[i], count + 1);
+				}
+				EMIT(e, 0x88, 0x8e);	/* mov [rsi+addr], cl */
+				emit32(e, u->imm);
+				EMIT(e, 0x88, 0xae);	/* mov [rsi+addr+1], ch */
+				emit32(e, u->imm + 1);
+				emitcheckimm(e, u->imm, 2, next, left, count);
+				break;
+			case 0x2a:
+				EMIT(e, 0x8a, 0x8e);	/* mov cl, [rsi+addr] */
+				emit32(e, u->imm);
+				EMIT(e, 0x8a, 0xae);	/* mov ch, [rsi+addr+1] */
+				emit32(e, u->imm + 1);
+				break;
+			case 0x2f:
+				EMIT(e, 0xf6, 0xd0);	/* not al */
+				break;
+			case 0x32:
+				if (e->mapped){
+					EMIT(e, 0x41, 0xb9);	/* mov r9d, addr */
+					emit32(e, u->imm);
+					emitguard(e, 1, MAP_ROM, at, rest[i], count + 1);
+					drop = emitrom(e);
+				}
+				EMIT(e, 0x88, 0x86);	/* mov [rsi+addr], al */
+				emit32(e, u->imm);
+				emitcheckimm(e, u->imm, 1, next, left, count);
+				if (drop != NULL){
+					emitdrop(e, drop);
+				}
+				break;
+			case 0x3a:
+				EMIT(e, 0x8a, 0x86);	/* mov al, [rsi+addr] */
+				emit32(e, u->imm);
+				break;
+			case 0x37:
+				EMIT(e, 0x80, 0xcc, FLAG_CY);	/* or ah, CY */
+				break;
+			case 0x3f:
+				EMIT(e, 0x80, 0xf4, FLAG_CY);	/* xor ah, CY */
+				break;
+			case 0xc1: case 0xd1: case 0xe1: case 0xf1:
+				EMIT(e, 0x0f, 0xb7, 0x7d, OFF_SP);	/* movzx edi, word [rbp+sp] */
+				if (op == 0xf1){
+					EMIT(e, 0x8a, 0x24, 0x3e);	/* mov ah, [rsi+rdi] */
+					EMIT(e, 0x66, 0xff, 0xc7);	/* inc di */
+					EMIT(e, 0x8a, 0x04, 0x3e);	/* mov al, [rsi+rdi] */
+					EMIT(e, 0x80, 0xe4, FLAG_MASK);	/* and ah, FLAG_MASK */
+					EMIT(e, 0x80, 0xcc, FLAG_1);	/* or ah, FLAG_1 */
+				}else{
+					int r = jitreg16[(op >> 4) & 3];
+					EMIT(e, 0x8a, (r << 3) | 4, 0x3e);	/* mov low, [rsi+rdi] */
+					EMIT(e, 0x66, 0xff, 0xc7);	/* inc di */
+					EMIT(e, 0x8a, ((r | 4) << 3) | 4, 0x3e);	/* mov high, [rsi+rdi] */
+				}
+				EMIT(e, 0x66, 0xff, 0xc7);	/* inc di */
+				EMIT(e, 0x66, 0x89, 0x7d, OFF_SP);	/* mov [rbp+sp], di */
+				break;
+			case 0xc5: case 0xd5: case 0xe5:{
+				int r = jitreg16[(op >> 4) & 3];
+				if (e->mapped){
+					emitguardpush(e, at, rest[i], count + 1);
+				}
+				emitpush(e, r | 4, r);
+				emitcheck(e, 7, 2, next, left, count);
+				break;
+			}
+			case 0xf5:
+				if (e->mapped){
+					emitguardpush(e, at, rest[i], count + 1);
+				}
+				emitpush(e, 0, 4);
+				emitcheck(e, 7, 2, next, left, count);
+				break;
+			case 0xeb:
+				EMIT(e, 0x66, 0x87, 0xd1);	/* xchg cx, dx */
+				break;
+			case 0xf9:
+				EMIT(e, 0x66, 0x89, 0x4d, OFF_SP);	/* mov [rbp+sp], cx */
+				break;
+			case 0xf3: case 0xfb:
+				EMIT(e, 0xc6, 0x45, OFF_IE, op == 0xfb);	/* mov byte [rbp+ie], 0/1 */
+				break;
+
+			/* block enders */
+			case 0xc3: case 0xcb:
+				EMIT(e, 0xe9);
+				emitstub(e, STUB_EXIT, u->imm, 0, 0);
+				break;
+			case 0xc2: case 0xca: case 0xd2: case 0xda: case 0xe2: case 0xea: case 0xf2: case 0xfa:
+				emitcond(e, d ^ 1, u->imm);
+				EMIT(e, 0xe9);
+				emitstub(e, STUB_EXIT, next, 0, 0);
+				break;
+			case 0xc4: case 0xcc: case 0xd4: case 0xdc: case 0xe4: case 0xec: case 0xf4: case 0xfc:
+				emitcond(e, d, next);
+				if (e->mapped){
+					emitguardpush(e, at, rest[i], count + 1);
+				}
+				EMIT(e, 0x49, 0x83, 0xc7, 0x06);	/* add r15, 6 */
+				emitpushimm(e, next);
+				emitcheck(e, 7, 2, u->imm, 0, 0);
+				EMIT(e, 0xe9);
+				emitstub(e, STUB_EXIT, u->imm, 0, 0);
+				break;
+			case 0xcd: case 0xdd: case 0xed: case 0xfd:
+				if (e->mapped){
+					emitguardpush(e, at, rest[i], count + 1);
+				}
+				emitpushimm(e, next);
+				emitcheck(e, 7, 2, u->imm, 0, 0);
+				EMIT(e, 0xe9);
+				emitstub(e, STUB_EXIT, u->imm, 0, 0);
+				break;
+			case 0xc7: case 0xcf: case 0xd7: case 0xdf: case 0xe7: case 0xef: case 0xf7: case 0xff:
+				if (e->mapped){
+					emitguardpush(e, at, rest[i], count + 1);
+				}
+				emitpushimm(e, next);
+				emitcheck(e, 7, 2, op & 0x38, 0, 0);
+				EMIT(e, 0xe9);
+				emitstub(e, STUB_EXIT, op & 0x38, 0, 0);
+				break;
+			case 0xc0: case 0xc8: case 0xd0: case 0xd8: case 0xe0: case 0xe8: case 0xf0: case 0xf8:
+				emitcond(e, d, next);
+				EMIT(e, 0x49, 0x83, 0xc7, 0x06);	/* add r15, 6 */
+				/* fall through */
+			case 0xc9: case 0xd9:
+				emitpop(e);
+				emitdispatch(e, jit);
+				break;
+			case 0xe9:
+				EMIT(e, 0x0f, 0xb7, 0xf9);	/* movzx edi, cx */
+				emitdispatch(e, jit);
+				break;
+		}
+	}
+
+	/* blocks cut at BLOCK_MAX fall through to the next one */
+	if (!endsblock(uop[n - 1].op)){
+		EMIT(e, 0xe9);
+		emitstub(e, STUB_EXIT, uop[n - 1].next, 0, 0);
+	}
+
+	for (int i = 0; i < e->nstubs; i++){
+		uint8_t *site = e->stub[i].site;
+		uint32_t rel = (uint32_t)(e->p - (site + 4));
+		memcpy(site, &rel, 4);
+
+		if (e->stub[i].kind != STUB_HELPER){
+			EMIT(e, 0x66, 0xc7, 0x45, OFF_PC);	/* mov word [rbp+pc], pc */
+			emit16(e, e->stub[i].pc);
+		}
+		if (e->stub[i].cycles){
+			EMIT(e, 0x49, 0x81, 0xef);	/* sub r15, cycles */
+			emit32(e, e->stub[i].cycles);
+		}
+		if (e->stub[i].count){
+			EMIT(e, 0x49, 0x81, 0xad);	/* sub qword [r13+executed], count */
+			emit32(e, offsetof(Jit8080, executed));
+			emit32(e, e->stub[i].count);
+		}
+		if (e->stub[i].kind == STUB_STORE){
+			EMIT(e, 0x45, 0x89, 0x8d);	/* mov [r13+store], r9d */
+			emit32(e, offsetof(Jit8080, store));
+		}
+		if (e->stub[i].kind == STUB_MAP){
+			EMIT(e, 0x41, 0xc6, 0x85);	/* mov byte [r13+interpret], 1 */
+			emit32(e, offsetof(Jit8080, interpret));
+			EMIT(e, 0x01);
+		}
+		if (e->stub[i].kind == STUB_EXIT){
+			EMIT(e, 0x49, 0xb8);	/* mov r8, site */
+			emit64(e, (uint64_t)(uintptr_t)site);
+			EMIT(e, 0xe9);
+			emitrel(e, jit->leave);
+		}else{
+			EMIT(e, 0xe9);
+			emitrel(e, jit->leave0);
+		}
+	}
+
+	jit->used = e->p - jit->arena;
+	jit->native[pc] = entry;
+	return entry;
+
+}
+
+/* makes the translation of the block at pc leave through its budget stub */
+void KillJit8080(Jit8080* jit, uint16_t pc){
+
+	uint8_t *entry = jit->native[pc];
+	if (entry == NULL){
+		return;
+	}
+	int32_t rel;
+	memcpy(&rel, entry + 5, 4);
+	uint8_t *stub = entry + 9 + rel;
+	rel = (int32_t)(stub - (entry + 5));
+	entry[0] = 0xe9;
+	memcpy(entry + 1, &rel, 4);
+	jit->native[pc] = NULL;
+
+}
+
+void FlushJit8080(Jit8080* jit){
+
+	memset(jit->native, 0, sizeof(jit->native));
+	jit->used = jit->base;
+	jit->generation++;
+
+}
+
+/* enter and leave routines at the start of the arena */
+static void emitroutines(Jit8080* jit){
+
+	Emit8080 e = {.p = jit->arena};
+
+	jit->enter = (void*)e.p;
+	EMIT(&e, 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);	/* push rbx rbp r12-r15 */
+	EMIT(&e, 0x48, 0x83, 0xec, 0x08);	/* sub rsp, 8 */
+	EMIT(&e, 0x48, 0x89, 0xfd);	/* mov rbp, rdi */
+	EMIT(&e, 0x49, 0x89, 0xd6);	/* mov r14, rdx */
+	EMIT(&e, 0x49, 0x89, 0xcd);	/* mov r13, rcx */
+	EMIT(&e, 0x4d, 0x8b, 0xa5);	/* mov r12, [r13+codepages] */
+	emit32(&e, offsetof(Jit8080, codepages));
+	EMIT(&e, 0x49, 0x89, 0xf0);	/* mov r8, rsi */
+	emitload(&e);
+	EMIT(&e, 0x41, 0xff, 0xe0);	/* jmp r8 */
+
+	jit->leave0 = e.p;
+	EMIT(&e, 0x45, 0x31, 0xc0);	/* xor r8d, r8d */
+	jit->leave = e.p;
+	emitspill(&e);
+	EMIT(&e, 0x4c, 0x89, 0xc0);	/* mov rax, r8 */
+	EMIT(&e, 0x48, 0x83, 0xc4, 0x08);	/* add rsp, 8 */
+	EMIT(&e, 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d, 0x5b);	/* pop r15-r12 rbp rbx */
+	EMIT(&e, 0xc3);	/* ret */
+
+	jit->base = (e.p - jit->arena + 63) & ~63;
+	jit->used = jit->base;
+
+}
+
+/* a translator with its own block cache, NULL if no executable memory */
+Jit8080* NewJit8080(void){
+
+	Jit8080 *jit = calloc(1, sizeof(Jit8080));
+	if (jit == NULL){
+		return NULL;
+	}
+	jit->arena = mmap(NULL, JIT_ARENA, PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	jit->cache = NewBlockCache8080();
+	if (jit->arena == MAP_FAILED || jit->cache == NULL){
+		if (jit->arena != MAP_FAILED){
+			munmap(jit->arena, JIT_ARENA);
+		}
+		free(jit->cache);
+		free(jit);
+		return NULL;
+	}
+	jit->cache->jit = jit;
+	jit->codepages = jit->cache->code;
+	jit->store = -1;
+	jit->hot = JIT_HOT;
+	emitroutines(jit);
+	return jit;
+
+}
+
+void FreeJit8080(Jit8080* jit){
+
+	munmap(jit->arena, JIT_ARENA);
+	free(jit->cache);
+	free(jit);
+
+}
+
+/* nonzero if a store to some page needs write8 */
+static int mapflagged(const Map8080* map){
+
+	for (int p = 0; p < 256; p++){
+		if (map->flags[p]){
+			return 1;
+		}
+	}
+	return 0;
+
+}
+
+/*
+ same contract as Run8080, for a state whose blocks belong to a
+ Jit8080 (state->blocks = jit->cache). blocks run through
+ Emulate8080Op until they have been entered jit->hot times, then they
+ are translated
+*/
+
+RunResult8080 RunJit8080(State8080* state, long cycles){
+
+	RunResult8080 result = {0, 0, RUN_BUDGET};
+	Jit8080 *jit = state->blocks != NULL ? state->blocks->jit : NULL;
+	uint64_t start = state->cycles;
+	uint64_t end = start + cycles;
+	uint64_t native = jit != NULL ? jit->executed : 0;
+	uint8_t *patch = NULL;
+	uint32_t generation = 0;
+
+	if (jit == NULL){
+		return Run8080(state, cycles);
+	}
+	/*
+	 translations either keep the dirty map or leave it out, and either
+	 check page flags before every store or store straight to memory
+	*/
+	int mapped = state->map != NULL && mapflagged(state->map);
+	if (jit->dirty != (state->dirty != NULL) || jit->mapped != mapped){
+		FlushJit8080(jit);
+		jit->dirty = state->dirty != NULL;
+		jit->mapped = mapped;
+	}
+
+	while(state->cycles < end && !state->halted){
+		uint16_t pc = state->pc;
+		void *code = jit->native[pc];
+
+		if (code == NULL && jit->heat[pc] >= jit->hot){
+			code = compileblock(jit, pc, state->memory);
+		}
+		if (code == NULL){
+			uint8_t op;
+			int n = 0;
+			jit->heat[pc]++;
+			/* a block as decodeblock cuts it, so the overshoot stays under BLOCK_CYCLES */
+			do{
+				op = state->memory[state->pc];
+				Emulate8080Op(state);
+				result.instructions++;
+			}while(!cutsblock(op) && blockroom(state->memory, state->pc, ++n) && !state->halted);
+			patch = NULL;
+			continue;
+		}
+
+		/* the previous exit jumped here through a stub, go direct next time */
+		if (patch != NULL && generation == jit->generation){
+			int32_t rel = (int32_t)((uint8_t*)code - (patch + 4));
+			memcpy(patch, &rel, 4);
+		}
+
+		(void)flags(state);
+		generation = jit->generation;
+		patch = jit->enter(state, code, end, jit);
+		if (jit->interpret){
+			Emulate8080Op(state);
+			result.instructions++;
+			jit->interpret = 0;
+			patch = NULL;
+		}
+		if (jit->store >= 0){
+			InvalidateBlocks8080(jit->cache, jit->store);
+			InvalidateBlocks8080(jit->cache, jit->store + 1);
+			jit->store = -1;
+			patch = NULL;
+		}
+	}
+
+	result.instructions += jit->executed - native;
+	result.cycles = state->cycles - start;
+	/* no block ends on EI, so whatever shadow there was is over */
+	if (result.cycles > 0){
+		state->ei_shadow = 0;
+	}
+	if (state->halted){
+		result.status = RUN_HALT;
+	}
+	return result;
+
+}
+
+#endif
+
+double now(void){
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+/*
+ interrupts: a min-heap of pending events keyed on the cycle they are
+ due at. RunScheduled8080 runs an engine with its budget cut at the
+ next event, so the engines' inner loops never look at the heap. an
+ event is delivered at the first instruction boundary at or after its
+ cycle, the same place a real 8080 samples its INT line. with
+ interrupts disabled it is counted as missed and dropped
+*/
+
+#define EVENTS 16
+#define CLOCK_HZ 2000000
+#define FRAME_CYCLES (CLOCK_HZ / 60)
+
+typedef struct Event8080{
+	uint64_t at;	/* cycle the event is due */
+	uint32_t period;	/* cycles until it repeats, 0 for once */
+	uint8_t vector;	/* RST number */
+} Event8080;
+
+/* an idle loop fastforward() found, by its lowest address */
+typedef struct IdleLoop8080{
+	uint16_t pc;
+	uint8_t length;	/* instructions per pass */
+	uint16_t cycles;	/* cycles per pass, up to IDLE_MAX * 18 */
+	uint64_t skips;
+	uint64_t skipped;	/* cycles jumped over */
+} IdleLoop8080;
+
+#define IDLE_LOOPS 16
+
+typedef struct Scheduler8080{
+	Event8080 heap[EVENTS];
+	int count;
+	uint64_t delivered;
+	uint64_t missed;	/* due while interrupts were disabled */
+	uint8_t fastforward;	/* look for idle loops every IDLE_SLICE cycles */
+	int loops;
+	IdleLoop8080 loop[IDLE_LOOPS];
+} Scheduler8080;
+
+/*
+ RST vector as an interrupting device would. returns 0 if interrupts
+ are disabled or the last instruction run was EI, whose shadow lasts
+ for one more instruction
+*/
+int Interrupt8080(State8080* state, uint8_t vector){
+
+	if (!state->cc.interrupt_enabled || state->ei_shadow){
+		return 0;
+	}
+	state->cc.interrupt_enabled = 0;
+	state->halted = 0;
+	call(state, (vector & 7) * 8);
+	state->cycles += cycles8080[0xc7];
+	return 1;
+
+}
+
+/* returns -1 if the heap is full */
+int Schedule8080(Scheduler8080* s, uint64_t at, uint32_t period, uint8_t vector){
+
+	if (s->count == EVENTS){
+		return -1;
+	}
+	int i = s->count++;
+	while(i > 0 && s->heap[(i - 1) / 2].at > at){
+		s->heap[i] = s->heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	s->heap[i] = (Event8080){at, period, vector};
+	return 0;
+
+}
+
+static Event8080 unschedule(Scheduler8080* s){
+
+	Event8080 top = s->heap[0], last = s->heap[--s->count];
+	int i = 0;
+	for (;;){
+		int child = 2 * i + 1;
+		if (child >= s->count){
 			break;
-		case 0xbd:
-			cmp(state, state->l);
+		}
+		if (child + 1 < s->count && s->heap[child + 1].at < s->heap[child].at){
+			child++;
+		}
+		if (s->heap[child].at >= last.at){
 			break;
-		case 0xbf:
-			cmp(state, state->a);
+		}
+		s->heap[i] = s->heap[child];
+		i = child;
+	}
+	s->heap[i] = last;
+	return top;
+
+}
+
+/* the Space Invaders video interrupts: RST 1 mid screen, RST 2 at the end */
+void ScheduleInvaders8080(Scheduler8080* s, uint64_t now){
+
+	Schedule8080(s, now + FRAME_CYCLES / 2, FRAME_CYCLES, 1);
+	Schedule8080(s, now + FRAME_CYCLES, FRAME_CYCLES, 2);
+
+}
+
+/* delivers every event due by state->cycles */
+static void deliver(State8080* state, Scheduler8080* s){
+
+	/* only after a single step can the machine still be in EI's shadow */
+	if (state->ei_shadow && s->count > 0 && s->heap[0].at <= state->cycles){
+		Emulate8080Op(state);
+	}
+	while(s->count > 0 && s->heap[0].at <= state->cycles){
+		Event8080 e = unschedule(s);
+		if (Interrupt8080(state, e.vector)){
+			s->delivered++;
+		}else{
+			s->missed++;
+		}
+		if (e.period){
+			e.at += e.period;
+			Schedule8080(s, e.at, e.period, e.vector);
+		}
+	}
+
+}
+
+/*
+ idle loops: a short loop ending in a backward jump, whose body only
+ reads memory and changes registers, that comes back to where it began
+ with every register and flag as it was. nothing but an interrupt can
+ change what it does next, so the passes up to the next event can be
+ skipped in one step
+*/
+
+#define IDLE_MAX 16	/* instructions in one pass */
+#define IDLE_SPAN 64	/* bytes back to the loop's start */
+#define IDLE_SLICE 2000	/* cycles run between looks */
+
+/* does not store, do I/O, touch the interrupt flag or halt */
+static int idlesafe(uint8_t op){
+
+	switch(op){
+		case 0x02: case 0x12: case 0x22: case 0x32:
+		case 0x34: case 0x35: case 0x36: case 0x76:
+		case 0xd3: case 0xdb: case 0xe3: case 0xf3: case 0xfb:
+			return 0;
+	}
+	if (op >= 0x70 && op < 0x78){
+		return 0;
+	}
+	/* Ccc, CALL, PUSH and RST */
+	return op < 0xc0 || ((op & 7) != 4 && (op & 7) != 7 && (op & 0xcf) != 0xc5 && (op & 0xcf) != 0xcd);
+
+}
+
+/* straight from pc to a short backward jump over it, through safe instructions only */
+static int idlecandidate(const uint8_t* memory, uint16_t pc){
+
+	uint16_t addr = pc;
+
+	for (int n = 0; n < IDLE_MAX; n++){
+		uint8_t op = memory[addr];
+		if (!idlesafe(op)){
+			return 0;
+		}
+		if (op == 0xc3 || op == 0xcb || (op & 0xc7) == 0xc2){
+			uint16_t target = memory[(uint16_t)(addr + 1)] | (memory[(uint16_t)(addr + 2)] << 8);
+			if (target <= pc && pc - target < IDLE_SPAN){
+				return 1;
+			}
+			if (op == 0xc3 || op == 0xcb){
+				return 0;
+			}
+		}else if (endsblock(op)){
+			return 0;
+		}
+		addr += length8080[op];
+	}
+	return 0;
+
+}
+
+/*
+ if pc is in an idle loop, runs one pass of it and moves state->cycles
+ over the whole passes that fit before target. returns the
+ instructions run or skipped, 0 if pc is not in one
+*/
+static uint64_t fastforward(State8080* state, Scheduler8080* s, uint64_t target){
+
+	uint16_t pc = state->pc, low = pc;
+	uint64_t start = state->cycles;
+	int n = 0;
+
+	if (target - start <= IDLE_MAX * 18 || !idlecandidate(state->memory, pc)){
+		return 0;
+	}
+	State8080 before = *state;
+	uint8_t psw = flags(state)->psw;
+	do{
+		if (!idlesafe(state->memory[state->pc])){
+			return n;
+		}
+		Emulate8080Op(state);
+		n++;
+		low = state->pc < low ? state->pc : low;
+	}while(state->pc != pc && n < IDLE_MAX && !state->halted);
+	if (state->pc != pc || state->bc != before.bc || state->de != before.de ||
+		state->hl != before.hl || state->a != before.a || state->sp != before.sp ||
+		flags(state)->psw != psw){
+		return n;
+	}
+
+	uint64_t pass = state->cycles - start;
+	uint64_t passes = (target - state->cycles) / pass;
+	state->cycles += passes * pass;
+
+	int i = 0;
+	while(i < s->loops && s->loop[i].pc != low){
+		i++;
+	}
+	if (i == s->loops && i < IDLE_LOOPS){
+		s->loop[s->loops++] = (IdleLoop8080){.pc = low, .length = n, .cycles = pass};
+	}
+	if (i < s->loops){
+		s->loop[i].skips++;
+		s->loop[i].skipped += passes * pass;
+	}
+	return n * (passes + 1);
+
+}
+
+/*
+ same contract as Run8080, delivering the events in s as it goes,
+ including any due when it returns. a cpu halted with interrupts
+ enabled moves straight to the next event, so RUN_HALT means nothing
+ can wake it. engine is any of the Run functions. the block engines can
+ overshoot a budget by a block, so they are stopped BLOCK_CYCLES short
+ of the next event and Run8080 runs the rest of the way to it. with
+ s->fastforward set the engine stops every IDLE_SLICE cycles to look
+ for an idle loop
+*/
+
+RunResult8080 RunScheduled8080(State8080* state, Scheduler8080* s, long cycles,
+	RunResult8080 (*engine)(State8080*, long)){
+
+	RunResult8080 result = {0, 0, RUN_BUDGET};
+	uint64_t start = state->cycles;
+	uint64_t end = start + cycles;
+
+	deliver(state, s);
+	while(state->cycles < end){
+		if (state->halted){
+			/* HLT waits for an interrupt, so sleep to the next event */
+			if (!state->cc.interrupt_enabled || s->count == 0){
+				break;
+			}
+			state->cycles = s->heap[0].at < end ? s->heap[0].at : end;
+			deliver(state, s);
+			continue;
+		}
+		uint64_t due = s->count > 0 ? s->heap[0].at : UINT64_MAX;
+		if (s->fastforward){
+			uint64_t n = fastforward(state, s, due < end ? due : end);
+			if (n > 0){
+				result.instructions += n;
+				deliver(state, s);
+				continue;
+			}
+		}
+		uint64_t near = due - state->cycles;
+		long left = (due < end ? due : end) - state->cycles;
+		if (s->fastforward && left > IDLE_SLICE){
+			left = IDLE_SLICE;
+		}
+		RunResult8080 r;
+		if (engine == Run8080 || near <= BLOCK_CYCLES){
+			r = Run8080(state, left);
+		}else if (near < (uint64_t)left + BLOCK_CYCLES){
+			r = engine(state, near - BLOCK_CYCLES);
+		}else{
+			r = engine(state, left);
+		}
+		result.instructions += r.instructions;
+		deliver(state, s);
+	}
+
+	result.cycles = state->cycles - start;
+	if (state->halted && (!state->cc.interrupt_enabled || s->count == 0)){
+		result.status = RUN_HALT;
+	}
+	return result;
+
+}
+
+static void sleepuntil(double t){
+
+	struct timespec ts;
+	ts.tv_sec = (time_t)t;
+	ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0){
+	}
+
+}
+
+/*
+ RunScheduled8080 at the 8080's own speed of CLOCK_HZ. after each event
+ the thread sleeps until the wall clock catches up with the guest, so
+ the host cpu used is only what emulating the guest costs. a guest
+ halted until its next interrupt costs nothing more, one spinning costs
+ the instructions of its loop
+*/
+
+RunResult8080 RunRealtime8080(State8080* state, Scheduler8080* s, long cycles,
+	RunResult8080 (*engine)(State8080*, long)){
+
+	RunResult8080 result = {0, 0, RUN_BUDGET};
+	uint64_t start = state->cycles;
+	uint64_t end = start + cycles;
+	double wall = now();
+
+	while(state->cycles < end){
+		uint64_t due = s->count > 0 && s->heap[0].at < end ? s->heap[0].at : end;
+		RunResult8080 r = RunScheduled8080(state, s, due > state->cycles ? due - state->cycles : 0, engine);
+		result.instructions += r.instructions;
+		if (r.status == RUN_HALT){
+			result.status = RUN_HALT;
 			break;
-		case 0xc0:
-			if (state->cc.z == 0){
-				ret(state);
+		}
+		sleepuntil(wall + (double)(state->cycles - start) / CLOCK_HZ);
+	}
+
+	result.cycles = state->cycles - start;
+	return result;
+
+}
+
+/*
+ video: Space Invaders has a 1 bit per pixel frame buffer at
+ $2400-$3fff, 224 scanlines of 32 bytes with the leftmost pixel of each
+ byte in bit 0. the monitor is turned on its side, so scanline y is
+ column y of the picture and pixel x of it is row 255 - x. frames are
+ 224x256, either RGBA bytes or one byte per pixel holding palette
+ index 0 (black) or 1 (white)
+*/
+
+#define VRAM 0x2400
+#define FRAME_W 224
+#define FRAME_H 256
+
+typedef uint32_t pixel32 __attribute__((vector_size(32)));
+typedef uint8_t pixel8 __attribute__((vector_size(32)));
+
+/* opaque black as a host uint32 holding RGBA bytes */
+#define BLACK (REG_SWAP ? 0xff000000u : 0x000000ffu)
+
+/* the per pixel loop the vector kernels must match, draws only the groups set in groups */
+static void renderscalar(const uint8_t* memory, uint8_t* out, int indexed, uint32_t groups){
+
+	for (int y = 0; y < FRAME_W; y++){
+		if (!(groups >> (y / 8) & 1)){
+			continue;
+		}
+		for (int x = 0; x < FRAME_H; x++){
+			uint8_t on = (memory[VRAM + y * 32 + x / 8] >> (x & 7)) & 1;
+			int i = (FRAME_H - 1 - x) * FRAME_W + y;
+			if (indexed){
+				out[i] = on;
+			}else{
+				out[i * 4] = out[i * 4 + 1] = out[i * 4 + 2] = on ? 0xff : 0;
+				out[i * 4 + 3] = 0xff;
+			}
+		}
+	}
+
+}
+
+/* groups of 8 frame columns, which are the 8 scanlines of one 256 byte page */
+#define GROUPS (FRAME_W / 8)
+#define ALL_GROUPS ((1u << GROUPS) - 1)
+
+/*
+ the frame is drawn in strips of 32 columns, the scanlines of 4 pages.
+ a byte column of a strip holds 8 rows of it, so it is gathered once
+ and each row is then one shift and mask per 32 indexed pixels, or per
+ 8 RGBA pixels with the mask widened to whole pixels. only the groups
+ set in groups are drawn, indexed frames whole strips at a time
+*/
+static inline __attribute__((always_inline)) void renderkernel(const uint8_t* memory, uint8_t* out, int indexed, uint32_t groups){
+
+	for (int y0 = 0; y0 < FRAME_W; y0 += 32){
+		uint32_t strip = groups >> (y0 / 8) & 0xf;
+		if (strip == 0){
+			continue;
+		}
+		for (int column = 0; column < 32; column++){
+			_Alignas(32) uint8_t bytes[32];
+			_Alignas(32) uint32_t words[32];
+			for (int y = 0; y < 32; y++){
+				bytes[y] = memory[VRAM + (y0 + y) * 32 + column];
+				words[y] = bytes[y];
+			}
+			for (int bit = 0; bit < 8; bit++){
+				int row = (FRAME_H - 1 - column * 8 - bit) * FRAME_W + y0;
+				if (indexed){
+					pixel8 v;
+					memcpy(&v, bytes, 32);
+					v = (v >> bit) & 1;
+					memcpy(&out[row], &v, 32);
+					continue;
+				}
+				for (int g = 0; g < 4; g++){
+					if (strip >> g & 1){
+						pixel32 v;
+						memcpy(&v, &words[g * 8], 32);
+						v = -((v >> bit) & 1) | BLACK;
+						memcpy(&out[(row + g * 8) * 4], &v, 32);
+					}
+				}
+			}
+		}
+	}
+
+}
+
+/* the build's own vector width, SSE2 on x86-64 */
+static void rendervector(const uint8_t* memory, uint8_t* out, int indexed, uint32_t groups){
+
+	renderkernel(memory, out, indexed, groups);
+
+}
+
+#ifdef USE_AVX2
+__attribute__((target("avx2"))) static void renderavx2(const uint8_t* memory, uint8_t* out, int indexed, uint32_t groups){
+
+	renderkernel(memory, out, indexed, groups);
+
+}
+#endif
+
+static void rendergroups(const uint8_t* memory, uint8_t* out, int indexed, uint32_t groups){
+
+#ifdef USE_AVX2
+	if (__builtin_cpu_supports("avx2")){
+		renderavx2(memory, out, indexed, groups);
+		return;
+	}
+#endif
+	rendervector(memory, out, indexed, groups);
+
+}
+
+/* renders the frame buffer in memory, out takes FRAME_W * FRAME_H pixels */
+void RenderFrame8080(const uint8_t* memory, uint8_t* out, int indexed){
+
+	rendergroups(memory, out, indexed, ALL_GROUPS);
+
+}
+
+/* what RenderDelta8080 last drew, zero it before the first frame */
+typedef struct Video8080{
+	uint8_t vram[FRAME_W * 32];
+	uint64_t frames;
+	uint64_t empty;	/* frames with nothing to redraw */
+	uint64_t compared;	/* pages compared */
+	uint64_t scanlines;	/* scanlines found changed */
+	uint64_t groups;	/* column groups redrawn */
+} Video8080;
+
+/*
+ brings out, which holds the frame v last drew, up to date with the
+ frame buffer. with a dirty map, only pages whose DIRTY_VIDEO bit is
+ set on some page of their mirror ring are compared with the copy in
+ v, and the bits are cleared. the groups of 8 columns over pages that
+ changed are redrawn. returns the number of groups, 0 for an empty
+ delta
+*/
+
+int RenderDelta8080(Video8080* v, State8080* state, uint8_t* out, int indexed){
+
+	uint32_t groups = 0;
+	uint8_t *dirty = state->dirty;
+	const uint8_t *ring = state->map != NULL ? state->map->next : NULL;
+
+	for (int g = 0; g < GROUPS; g++){
+		int page = (VRAM >> 8) + g, stored = dirty == NULL;
+		for (int p = page; dirty != NULL; ){
+			stored |= dirty[p] & DIRTY_VIDEO;
+			dirty[p] &= ~DIRTY_VIDEO;
+			p = ring != NULL ? ring[p] : p;
+			if (p == page){
+				break;
+			}
+		}
+		if (!stored && v->frames > 0){
+			continue;
+		}
+		uint8_t *copy = &v->vram[g * 256], *now = &state->memory[page << 8];
+		v->compared++;
+		if (v->frames > 0 && memcmp(copy, now, 256) == 0){
+			continue;
+		}
+		for (int s = 0; s < 256; s += 32){
+			v->scanlines += memcmp(&copy[s], &now[s], 32) != 0 || v->frames == 0;
+		}
+		memcpy(copy, now, 256);
+		groups |= 1u << g;
+	}
+
+	if (groups){
+		rendergroups(state->memory, out, indexed, groups);
+	}
+	v->empty += groups == 0;
+	v->groups += __builtin_popcount(groups);
+	v->frames++;
+	return __builtin_popcount(groups);
+
+}
+
+/* writes an RGBA frame as binary PAM, or as PPM without the alpha. -1 on a write error */
+int WriteFrame8080(FILE* f, const uint8_t* rgba, int pam){
+
+	if (pam){
+		fprintf(f, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n",
+			FRAME_W, FRAME_H);
+		fwrite(rgba, 4, FRAME_W * FRAME_H, f);
+	}else{
+		uint8_t rgb[FRAME_W * 3];
+		fprintf(f, "P6\n%d %d\n255\n", FRAME_W, FRAME_H);
+		for (int y = 0; y < FRAME_H; y++){
+			for (int x = 0; x < FRAME_W; x++){
+				memcpy(&rgb[x * 3], &rgba[(y * FRAME_W + x) * 4], 3);
+			}
+			fwrite(rgb, 3, FRAME_W, f);
+		}
+	}
+	return ferror(f) ? -1 : 0;
+
+}
+
+/*
+ regression hashes: one 64 bit hash per frame of the registers, the
+ cycle count, the shift register, and the work and video RAM at
+ $2000-$3fff. a golden file is HASH_MAGIC and then the hash of each
+ frame as 8 little endian bytes, so it is the same on every host
+*/
+
+#define HASH_RAM 0x2000
+#define HASH_END 0x4000
+#define HASH_MAGIC "8080hsh1"
+
+static inline uint64_t hashmix(uint64_t h, uint64_t x){
+
+	h = (h ^ x) * 0x9e3779b97f4a7c15ull;
+	return h ^ (h >> 32);
+
+}
+
+typedef uint32_t hash32 __attribute__((vector_size(32)));
+
+/*
+ four chains of 8 words each over $2000-$3fff, so the multiplies
+ overlap and vectorise. the same sums on every vector width
+*/
+static inline __attribute__((always_inline)) uint64_t hashkernel(const uint8_t* memory){
+
+	hash32 lane[4];
+	uint64_t h = 0;
+
+	for (int k = 0; k < 4; k++){
+		for (int j = 0; j < 8; j++){
+			lane[k][j] = k * 8 + j + 1;
+		}
+	}
+	for (int addr = HASH_RAM; addr < HASH_END; addr += 128){
+		for (int k = 0; k < 4; k++){
+			hash32 x;
+			memcpy(&x, &memory[addr + k * 32], 32);
+			if (!REG_SWAP){
+				for (int j = 0; j < 8; j++){
+					x[j] = __builtin_bswap32(x[j]);
+				}
+			}
+			lane[k] = (lane[k] ^ x) * 0x9e3779b1u;
+			lane[k] ^= lane[k] >> 15;
+		}
+	}
+	hash32 all = lane[0] ^ lane[1] * 3 ^ lane[2] * 5 ^ lane[3] * 7;
+	for (int j = 0; j < 8; j++){
+		h = hashmix(h, all[j]);
+	}
+	return h;
+
+}
+
+static uint64_t hashvector(const uint8_t* memory){
+
+	return hashkernel(memory);
+
+}
+
+#ifdef USE_AVX2
+__attribute__((target("avx2"))) static uint64_t hashavx2(const uint8_t* memory){
+
+	return hashkernel(memory);
+
+}
+#endif
+
+static uint64_t hashmemory(const uint8_t* memory){
+
+#ifdef USE_AVX2
+	if (__builtin_cpu_supports("avx2")){
+		return hashavx2(memory);
+	}
+#endif
+	return hashvector(memory);
+
+}
+
+/* mixes the registers, the cycle count and the shift register into h */
+static uint64_t hashregs(uint64_t h, State8080* state){
+
+	Map8080 *map = state->map;
+
+	h = hashmix(h, state->bc | (uint64_t)state->de << 16 | (uint64_t)state->hl << 32 | (uint64_t)state->sp << 48);
+	h = hashmix(h, state->pc | state->a << 16 | (uint64_t)flags(state)->psw << 24 |
+		(uint64_t)state->cc.interrupt_enabled << 32 | (uint64_t)state->halted << 40);
+	h = hashmix(h, state->cycles);
+	if (map != NULL){
+		h = hashmix(h, map->shift | map->shift_offset << 16);
+	}
+	return hashmix(h, 0);
+
+}
+
+uint64_t HashFrame8080(State8080* state){
+
+	return hashregs(hashmemory(state->memory), state);
+
+}
+
+/* -1 on a write error */
+int WriteHashes8080(FILE* f, const uint64_t* hashes, int count){
+
+	fwrite(HASH_MAGIC, 1, 8, f);
+	for (int i = 0; i < count; i++){
+		uint8_t bytes[8];
+		for (int b = 0; b < 8; b++){
+			bytes[b] = hashes[i] >> (b * 8);
+		}
+		fwrite(bytes, 1, 8, f);
+	}
+	return ferror(f) ? -1 : 0;
+
+}
+
+/* reads up to max hashes and returns how many, -1 if f is not a golden file */
+int ReadHashes8080(FILE* f, uint64_t* hashes, int max){
+
+	uint8_t bytes[8];
+	int count = 0;
+
+	if (fread(bytes, 1, 8, f) != 8 || memcmp(bytes, HASH_MAGIC, 8) != 0){
+		return -1;
+	}
+	while(count < max && fread(bytes, 1, 8, f) == 8){
+		hashes[count] = 0;
+		for (int b = 0; b < 8; b++){
+			hashes[count] |= (uint64_t)bytes[b] << (b * 8);
+		}
+		count++;
+	}
+	return count;
+
+}
+
+/*
+ a hash of all guest memory kept up to date through the dirty map, so a
+ store costs nothing more than its dirty mark and a query only hashes
+ the pages stored to since the last one. each page is hashed from its
+ own number, and the memory hash is the XOR of the page hashes, so a
+ page is swapped in and out of it in O(1). a mirror page is left to the
+ lowest page of its ring
+*/
+
+typedef struct RamHash8080{
+	uint64_t page[256];	/* 0 for a page that mirrors a lower one */
+	uint64_t sum;	/* XOR of page[] */
+	uint64_t rehashed;	/* pages hashed by queries */
+} RamHash8080;
+
+static uint64_t hashpage(const uint8_t* memory, int page){
+
+	uint64_t lane[4];
+	const uint8_t *m = &memory[page << 8];
+
+	for (int k = 0; k < 4; k++){
+		lane[k] = page * 4 + k + 1;
+	}
+	for (int i = 0; i < 256; i += 32){
+		for (int k = 0; k < 4; k++){
+			uint64_t x;
+			memcpy(&x, &m[i + k * 8], 8);
+			lane[k] = hashmix(lane[k], REG_SWAP ? x : __builtin_bswap64(x));
+		}
+	}
+	return hashmix(hashmix(lane[0], lane[1]), hashmix(lane[2], lane[3]));
+
+}
+
+/* hashes every page and clears the dirty map's bit */
+static void ramhashinit(RamHash8080* h, State8080* state, uint8_t bit){
+
+	h->sum = 0;
+	for (int p = 0; p < 256; p++){
+		int first = state->map == NULL || firstmirror(state->map, p) == p;
+		h->page[p] = first ? hashpage(state->memory, p) : 0;
+		h->sum ^= h->page[p];
+		if (state->dirty != NULL){
+			state->dirty[p] &= ~bit;
+		}
+	}
+
+}
+
+/* hashes again the pages with bit set in the dirty map, clearing it */
+static uint64_t ramhash(RamHash8080* h, State8080* state, uint8_t bit){
+
+	uint8_t *dirty = state->dirty;
+
+	if (dirty == NULL){
+		ramhashinit(h, state, bit);
+		h->rehashed += 256;
+		return h->sum;
+	}
+	for (int base = 0; base < 256; base += 8){
+		uint64_t bits;
+		memcpy(&bits, &dirty[base], 8);
+		if ((bits & bit * 0x0101010101010101ull) == 0){
+			continue;
+		}
+		for (int p = base; p < base + 8; p++){
+			if (!(dirty[p] & bit)){
+				continue;
+			}
+			dirty[p] &= ~bit;
+			int first = state->map != NULL ? firstmirror(state->map, p) : p;
+			uint64_t fresh = hashpage(state->memory, first);
+			h->sum ^= h->page[first] ^ fresh;
+			h->page[first] = fresh;
+			h->rehashed++;
+		}
+	}
+	return h->sum;
+
+}
+
+/* hashes every page and clears the DIRTY_HASH bits */
+void InitRamHash8080(RamHash8080* h, State8080* state){
+
+	ramhashinit(h, state, DIRTY_HASH);
+
+}
+
+/*
+ the hash of all memory, after hashing again the pages whose DIRTY_HASH
+ bit is set and clearing the bits. with no dirty map every page is
+ hashed
+*/
+uint64_t HashRam8080(RamHash8080* h, State8080* state){
+
+	return ramhash(h, state, DIRTY_HASH);
+
+}
+
+/* HashFrame8080 over all memory, from HashRam8080 */
+uint64_t HashState8080(RamHash8080* h, State8080* state){
+
+	return hashregs(HashRam8080(h, state), state);
+
+}
+
+/*
+ input record and replay. recording wraps the IN handler of every port
+ and logs only the reads that return something other than the port's
+ last value, stamped with the cycle count. replay hands the logged
+ values back to the same reads, so nothing but the log feeds the
+ guest. CheckReplay8080 logs a state hash when recording and compares
+ it when replaying, and must be called at the same cycles both times.
+
+ the log is a stream of records, each a varint of the cycles since the
+ previous record shifted left once, with the record's kind in the low
+ bit. a REPLAY_INPUT record goes on with the port and the value, a
+ REPLAY_CHECK record with the state hash in 8 little endian bytes
+*/
+
+#define REPLAY_INPUT 0
+#define REPLAY_CHECK 1
+#define REPLAY_MAGIC "8080rpl1"
+
+typedef struct Replay8080{
+	uint8_t *log;
+	size_t length, size;	/* bytes logged and allocated */
+	size_t cursor;	/* next byte to replay */
+	int replaying;
+	uint64_t last;	/* cycle of the last record logged or read */
+	uint8_t value[256];	/* what each port last read */
+	uint8_t (*source[256])(struct State8080* state, uint8_t port);	/* the handlers replaced */
+	void *device;	/* the map's device, for them */
+
+	/* the next record when replaying, at is UINT64_MAX past the end */
+	uint64_t at;
+	uint8_t kind, port, input;
+	uint64_t hash;
+
+	uint64_t reads, inputs, checks;
+	uint64_t diverged;	/* cycle the replay first differed at, UINT64_MAX if it has not */
+	int full;	/* the log could not grow, so the recording is lost */
+	RamHash8080 ram;	/* kept through the DIRTY_REPLAY bits */
+} Replay8080;
+
+/* grows the log to hold n more bytes, -1 if out of memory */
+static int logroom(Replay8080* r, size_t n){
+
+	size_t size = r->size ? r->size : 4096;
+
+	while(size - r->length < n){
+		size *= 2;
+	}
+	if (size != r->size){
+		uint8_t *log = realloc(r->log, size);
+		if (log == NULL){
+			return -1;
+		}
+		r->log = log;
+		r->size = size;
+	}
+	return 0;
+
+}
+
+static void logbyte(Replay8080* r, uint8_t b){
+
+	if (r->full || logroom(r, 1) < 0){
+		r->full = 1;
+		return;
+	}
+	r->log[r->length++] = b;
+
+}
+
+static void logrecord(Replay8080* r, uint64_t cycles, int kind){
+
+	uint64_t v = (cycles - r->last) << 1 | kind;
+	r->last = cycles;
+	do{
+		logbyte(r, (v & 0x7f) | (v >= 0x80 ? 0x80 : 0));
+		v >>= 7;
+	}while(v);
+
+}
+
+/* decodes the record at the cursor into r->at and the fields after it */
+static void nextrecord(Replay8080* r){
+
+	uint64_t v = 0;
+	int shift = 0, tail;
+
+	r->at = UINT64_MAX;
+	do{
+		if (r->cursor >= r->length || shift > 63){
+			return;
+		}
+		v |= (uint64_t)(r->log[r->cursor] & 0x7f) << shift;
+		shift += 7;
+	}while(r->log[r->cursor++] & 0x80);
+	r->kind = v & 1;
+	tail = r->kind == REPLAY_INPUT ? 2 : 8;
+	if (r->length - r->cursor < (size_t)tail){
+		return;
+	}
+	if (r->kind == REPLAY_INPUT){
+		r->port = r->log[r->cursor];
+		r->input = r->log[r->cursor + 1];
+	}else{
+		r->hash = 0;
+		for (int b = 0; b < 8; b++){
+			r->hash |= (uint64_t)r->log[r->cursor + b] << (b * 8);
+		}
+	}
+	r->cursor += tail;
+	r->last += v >> 1;
+	r->at = r->last;
+
+}
+
+static uint8_t recordin(State8080* state, uint8_t port){
+
+	Map8080 *map = state->map;
+	Replay8080 *r = map->device;
+	uint8_t value = map->inputs[port];
+
+	if (r->source[port] != NULL){
+		map->device = r->device;
+		value = r->source[port](state, port);
+		map->device = r;
+	}
+	r->reads++;
+	if (value != r->value[port]){
+		logrecord(r, state->cycles, REPLAY_INPUT);
+		logbyte(r, port);
+		logbyte(r, value);
+		r->value[port] = value;
+		r->inputs++;
+	}
+	return value;
+
+}
+
+static uint8_t replayin(State8080* state, uint8_t port){
+
+	Replay8080 *r = state->map->device;
+
+	r->reads++;
+	while(r->kind == REPLAY_INPUT && r->at <= state->cycles){
+		if ((r->at != state->cycles || r->port != port) && r->diverged == UINT64_MAX){
+			r->diverged = state->cycles;
+		}
+		r->value[r->port] = r->input;
+		r->inputs++;
+		nextrecord(r);
+	}
+	return r->value[port];
+
+}
+
+/* takes over the IN handlers of map, keeping them to restore */
+static void hookinputs(Replay8080* r, Map8080* map, State8080* state,
+	uint8_t (*handler)(State8080*, uint8_t)){
+
+	for (int p = 0; p < 256; p++){
+		r->source[p] = map->in[p];
+		map->in[p] = handler;
+	}
+	r->device = map->device;
+	map->device = r;
+	memset(r->value, 0, sizeof(r->value));
+	r->last = state->cycles;
+	r->cursor = 0;
+	r->reads = r->inputs = r->checks = 0;
+	r->diverged = UINT64_MAX;
+	r->full = 0;
+	ramhashinit(&r->ram, state, DIRTY_REPLAY);
+
+}
+
+/* starts a new log from state, zero r the first time */
+void RecordInputs8080(Replay8080* r, Map8080* map, State8080* state){
+
+	r->length = 0;
+	r->replaying = 0;
+	hookinputs(r, map, state, recordin);
+
+}
+
+/* replays the log from state, which must be where the recording started */
+void ReplayInputs8080(Replay8080* r, Map8080* map, State8080* state){
+
+	r->replaying = 1;
+	hookinputs(r, map, state, replayin);
+	nextrecord(r);
+
+}
+
+/* gives map its own IN handlers back */
+void StopReplay8080(Replay8080* r, Map8080* map){
+
+	for (int p = 0; p < 256; p++){
+		map->in[p] = r->source[p];
+	}
+	map->device = r->device;
+
+}
+
+/*
+ logs or compares a state hash, returns -1 if the replay has diverged
+ or the recording ran out of memory
+*/
+int CheckReplay8080(Replay8080* r, State8080* state){
+
+	uint64_t hash = hashregs(ramhash(&r->ram, state, DIRTY_REPLAY), state);
+
+	r->checks++;
+	if (!r->replaying){
+		logrecord(r, state->cycles, REPLAY_CHECK);
+		for (int b = 0; b < 8; b++){
+			logbyte(r, hash >> (b * 8));
+		}
+		return r->full ? -1 : 0;
+	}
+	int same = r->kind == REPLAY_CHECK && r->at == state->cycles && r->hash == hash;
+	if (r->kind == REPLAY_CHECK && r->at == state->cycles){
+		nextrecord(r);
+	}
+	if (!same && r->diverged == UINT64_MAX){
+		r->diverged = state->cycles;
+	}
+	return r->diverged == UINT64_MAX ? 0 : -1;
+
+}
+
+/* -1 on a write error or a recording that ran out of memory */
+int SaveReplay8080(FILE* f, const Replay8080* r){
+
+	if (r->full){
+		return -1;
+	}
+	fwrite(REPLAY_MAGIC, 1, 8, f);
+	fwrite(r->log, 1, r->length, f);
+	return ferror(f) ? -1 : 0;
+
+}
+
+/*
+ reads a saved log into r, zero r the first time. -1 if f does not hold
+ one or it does not fit in memory
+*/
+int LoadReplay8080(FILE* f, Replay8080* r){
+
+	char magic[8];
+	size_t n;
+
+	if (fread(magic, 1, 8, f) != 8 || memcmp(magic, REPLAY_MAGIC, 8) != 0){
+		return -1;
+	}
+	r->length = 0;
+	do{
+		if (logroom(r, 1) < 0){
+			return -1;
+		}
+		n = fread(&r->log[r->length], 1, r->size - r->length, f);
+		r->length += n;
+	}while(n > 0);
+	return ferror(f) ? -1 : 0;
+
+}
+
+void FreeReplay8080(Replay8080* r){
+
+	free(r->log);
+	r->log = NULL;
+	r->length = r->size = 0;
+
+}
+
+/*
+ batch engine: many independent machines in one process, spread over
+ worker threads. every worker owns a deque of jobs. it runs the job at
+ the bottom for one quantum with Run8080 and pushes it back, and when
+ its deque is empty it steals from the top of another worker's. a job
+ is finished when its machine halts or has used its cycle budget. each
+ deque is a ring under a mutex that the owner takes too, once per
+ quantum, which is noise next to the quantum itself
+*/
+
+typedef struct BatchJob8080{
+	State8080 state;
+	uint64_t budget;	/* total cycles to run, state->cycles included */
+	long quantum;	/* cycles per turn on a worker */
+	uint64_t instructions;
+	int status;	/* RUN_HALT or RUN_BUDGET once finished */
+} BatchJob8080;
+
+typedef struct BatchStats8080{
+	_Alignas(64) uint64_t instructions;
+	uint64_t cycles;
+	uint64_t quanta;
+	uint64_t steals;
+	uint64_t misses;	/* steal attempts that found nothing */
+	double busy;	/* seconds spent running jobs */
+} BatchStats8080;
+
+typedef struct Deque8080{
+	pthread_mutex_t lock;
+	int *job;	/* ring of job indices */
+	int top, bottom;	/* thieves take at top, the owner at bottom */
+	int size;
+} Deque8080;
+
+typedef struct Batch8080{
+	BatchJob8080 *jobs;
+	Deque8080 *deques;
+	BatchStats8080 *stats;
+	int threads;
+	atomic_int remaining;
+} Batch8080;
+
+typedef struct Worker8080{
+	Batch8080 *batch;
+	int id;
+} Worker8080;
+
+static void dequepush(Deque8080* d, int job){
+
+	pthread_mutex_lock(&d->lock);
+	d->job[d->bottom] = job;
+	d->bottom = (d->bottom + 1) % d->size;
+	pthread_mutex_unlock(&d->lock);
+
+}
+
+/* -1 if empty */
+static int dequepop(Deque8080* d){
+
+	int job = -1;
+	pthread_mutex_lock(&d->lock);
+	if (d->top != d->bottom){
+		d->bottom = (d->bottom + d->size - 1) % d->size;
+		job = d->job[d->bottom];
+	}
+	pthread_mutex_unlock(&d->lock);
+	return job;
+
+}
+
+static int dequesteal(Deque8080* d){
+
+	int job = -1;
+	pthread_mutex_lock(&d->lock);
+	if (d->top != d->bottom){
+		job = d->job[d->top];
+		d->top = (d->top + 1) % d->size;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return job;
+
+}
+
+static void* batchworker(void* arg){
+
+	Worker8080 *worker = arg;
+	Batch8080 *batch = worker->batch;
+	BatchStats8080 *stats = &batch->stats[worker->id];
+	Deque8080 *own = &batch->deques[worker->id];
+	unsigned seed = worker->id * 2654435761u + 1;
+
+	while(atomic_load(&batch->remaining) > 0){
+		int i = dequepop(own);
+		if (i < 0){
+			for (int tries = 1; tries < batch->threads && i < 0; tries++){
+				seed = seed * 1103515245 + 12345;
+				int victim = (worker->id + 1 + (seed >> 16) % (batch->threads - 1)) % batch->threads;
+				i = dequesteal(&batch->deques[victim]);
 			}
-			break;
-		case 0xc1:
-			state->c = state->memory[state->sp];
-			state->b = state->memory[state->sp + 1];
-			state->sp += 2;
-			break;
-		case 0xc2:
-			if (0 == state->cc.z){
-				state->pc = (opcode[2] << 8) | opcode[1];
-			}else{
-				state->pc += 2;
+			if (i < 0){
+				stats->misses++;
+				sched_yield();
+				continue;
 			}
-			break;
-		case 0xc3:
-			state->pc = (opcode[2] << 8) | opcode[1];
-			break;
-		case 0xc4:
-			if (state->cc.z == 0){
-				call(state, opcode);				
-			}else{
-				state->pc += 2;
+			stats->steals++;
+		}
+
+		BatchJob8080 *job = &batch->jobs[i];
+		long slice = job->quantum;
+		if (job->budget - job->state.cycles < (uint64_t)slice){
+			slice = job->budget - job->state.cycles;
+		}
+		double start = now();
+		RunResult8080 r = Run8080(&job->state, slice);
+		stats->busy += now() - start;
+		stats->instructions += r.instructions;
+		stats->cycles += r.cycles;
+		stats->quanta++;
+		job->instructions += r.instructions;
+
+		if (r.status == RUN_HALT || job->state.cycles >= job->budget){
+			job->status = r.status;
+			atomic_fetch_sub(&batch->remaining, 1);
+		}else{
+			dequepush(own, i);
+		}
+	}
+	return NULL;
+
+}
+
+/*
+ runs count jobs on threads workers until every one has finished.
+ stats gets one entry per thread. returns 0, or -1 if the workers could
+ not be started
+*/
+
+int RunBatch8080(BatchJob8080* jobs, int count, int threads, BatchStats8080* stats){
+
+	Batch8080 batch = {.jobs = jobs, .stats = stats, .threads = threads};
+	Worker8080 *workers = calloc(threads, sizeof(Worker8080));
+	pthread_t *tids = calloc(threads, sizeof(pthread_t));
+	int *rings = calloc((size_t)threads * (count + 1), sizeof(int));
+	batch.deques = calloc(threads, sizeof(Deque8080));
+	int started = 0;
+
+	if (workers == NULL || tids == NULL || rings == NULL || batch.deques == NULL){
+		free(batch.deques);
+		free(rings);
+		free(tids);
+		free(workers);
+		return -1;
+	}
+
+	memset(stats, 0, threads * sizeof(BatchStats8080));
+	for (int t = 0; t < threads; t++){
+		pthread_mutex_init(&batch.deques[t].lock, NULL);
+		batch.deques[t].job = &rings[t * (count + 1)];
+		batch.deques[t].size = count + 1;
+	}
+	atomic_init(&batch.remaining, 0);
+	for (int i = 0; i < count; i++){
+		if (jobs[i].state.halted || jobs[i].state.cycles >= jobs[i].budget){
+			jobs[i].status = jobs[i].state.halted ? RUN_HALT : RUN_BUDGET;
+			continue;
+		}
+		dequepush(&batch.deques[i % threads], i);
+		atomic_fetch_add(&batch.remaining, 1);
+	}
+
+	/* workers steal from every deque, so a thread that failed to start costs nothing */
+	for (int t = 0; t < threads; t++){
+		workers[t].batch = &batch;
+		workers[t].id = t;
+		if (pthread_create(&tids[started], NULL, batchworker, &workers[t]) == 0){
+			started++;
+		}
+	}
+	for (int t = 0; t < started; t++){
+		pthread_join(tids[t], NULL);
+	}
+
+	for (int t = 0; t < threads; t++){
+		pthread_mutex_destroy(&batch.deques[t].lock);
+	}
+	free(batch.deques);
+	free(rings);
+	free(tids);
+	free(workers);
+	return started > 0 ? 0 : -1;
+
+}
+
+/*
+ lockstep lanes: LANES machines in structure of arrays form, one vector
+ element per machine. each step takes the pc of the running lane that
+ has retired the fewest cycles, so no lane is left waiting on the rest,
+ and runs the instruction there on every lane at that pc whose code
+ bytes match. register and ALU instructions run on all of those lanes
+ at once through GCC vector extensions, which become SSE, AVX2 or
+ AVX-512 as -march allows and plain loops elsewhere. memory, stack and
+ I/O instructions go lane by lane through Emulate8080Op, and a lane
+ alone at its pc runs on through it until it meets another lane.
+ build with -DLANES=8, 16 or 32
+*/
+
+#ifndef LANES
+#define LANES 16
+#endif
+
+/* how far a lane running alone gets ahead of the others before it yields */
+#define LANE_SLICE 2000
+
+typedef uint8_t lane8 __attribute__((vector_size(LANES)));
+typedef int8_t lanemask8 __attribute__((vector_size(LANES)));
+typedef uint16_t lane16 __attribute__((vector_size(LANES * 2)));
+typedef int16_t lanemask16 __attribute__((vector_size(LANES * 2)));
+
+#define WIDEN(x) __builtin_convertvector((x), lane16)
+
+/*
+ vectors go in and out of functions by pointer, never by value, so
+ their ABI does not depend on the target's vector registers
+*/
+
+/* x where mask m is set, old elsewhere. m has the type of x */
+#define BLEND(m, x, old) (((x) & (m)) | ((old) & ~(m)))
+#define NARROW(x) __builtin_convertvector((x), lane8)
+
+typedef struct Lanes8080{
+	lane8 reg[8];	/* by register field, 6 (M) unused */
+	lane8 psw;
+	lane16 sp;
+	lane16 pc;
+	uint64_t cycles[LANES];
+	uint8_t *memory[LANES];
+	uint8_t *dirty[LANES];
+	Map8080 *map[LANES];
+	uint8_t interrupt_enabled[LANES];
+	uint8_t ei_shadow[LANES];
+	uint8_t halted[LANES];
+} Lanes8080;
+
+typedef struct LaneStats8080{
+	uint64_t vector;	/* steps run in vector form */
+	uint64_t vectorlanes;	/* lanes summed over those steps */
+	uint64_t scalar;	/* instructions run one lane at a time */
+} LaneStats8080;
+
+void GetLane8080(const Lanes8080* lanes, int i, State8080* state){
+
+	memset(state, 0, sizeof(State8080));
+	for (int r = 0; r < 8; r++){
+		if (r != 6){
+			REG(state, r) = lanes->reg[r][i];
+		}
+	}
+	state->cc.psw = lanes->psw[i];
+	state->cc.interrupt_enabled = lanes->interrupt_enabled[i];
+	state->ei_shadow = lanes->ei_shadow[i];
+	state->sp = lanes->sp[i];
+	state->pc = lanes->pc[i];
+	state->cycles = lanes->cycles[i];
+	state->memory = lanes->memory[i];
+	state->dirty = lanes->dirty[i];
+	state->map = lanes->map[i];
+	state->halted = lanes->halted[i];
+
+}
+
+void SetLane8080(Lanes8080* lanes, int i, State8080* state){
+
+	for (int r = 0; r < 8; r++){
+		if (r != 6){
+			lanes->reg[r][i] = REG(state, r);
+		}
+	}
+	lanes->psw[i] = flags(state)->psw;
+	lanes->interrupt_enabled[i] = state->cc.interrupt_enabled;
+	lanes->ei_shadow[i] = state->ei_shadow;
+	lanes->sp[i] = state->sp;
+	lanes->pc[i] = state->pc;
+	lanes->cycles[i] = state->cycles;
+	lanes->memory[i] = state->memory;
+	lanes->dirty[i] = state->dirty;
+	lanes->map[i] = state->map;
+	lanes->halted[i] = state->halted;
+
+}
+
+static inline void lanezsp(const lane8* v, lane8* zsp){
+
+	lane8 x = *v;
+	lane8 p = x ^ (x >> 4);
+	p ^= p >> 2;
+	p ^= p >> 1;
+	*zsp = (x & FLAG_S) | ((lane8)(x == 0) & FLAG_Z) | ((~p & 1) << 2) | FLAG_1;
+
+}
+
+/* ADD ADC SUB SBB ANA XRA ORA CMP, in opcode order, on A and v */
+static void lanealu(Lanes8080* l, const lane8* mask, int op, const lane8* operand){
+
+	lane8 m = *mask, v = *operand;
+	lane8 a = l->reg[7], ans, f;
+	lane16 carry = WIDEN(l->psw & FLAG_CY);
+	lane16 sum;
+
+	switch(op){
+		case 0: case 1:
+			sum = WIDEN(a) + WIDEN(v);
+			if (op == 1){
+				sum += carry;
 			}
+			ans = NARROW(sum);
+			lanezsp(&ans, &f);
+			f |= (NARROW(sum >> 8) & FLAG_CY) | ((a ^ v ^ ans) & FLAG_AC);
+			break;
+		case 2: case 3: case 7:
+			sum = WIDEN(a) - WIDEN(v);
+			if (op == 3){
+				sum -= carry;
+			}
+			ans = NARROW(sum);
+			lanezsp(&ans, &f);
+			f |= (NARROW(sum >> 8) & FLAG_CY) | (~(a ^ v ^ ans) & FLAG_AC);
 			break;
-		case 0xc5:
-			state->memory[state->sp - 2] = state->c;
-			state->memory[state->sp - 1] = state->b;
-			state->sp -= 2;
+		case 4:
+			ans = a & v;
+			lanezsp(&ans, &f);
+			f |= ((a | v) << 1) & FLAG_AC;
 			break;
-		case 0xc8:
-			if (state->cc.z){
-				ret(state);
-			}
+		case 5:
+			ans = a ^ v;
+			lanezsp(&ans, &f);
 			break;
-		case 0xc9:
-			ret(state);
+		default:
+			ans = a | v;
+			lanezsp(&ans, &f);
 			break;
-		case 0xca:
-			if (state->cc.z){
-				state->pc = (opcode[2] << 8) | opcode[1];
-			}else{
-				state->pc += 2;
+	}
+	l->psw = BLEND(m, f, l->psw);
+	if (op != 7){
+		l->reg[7] = BLEND(m, ans, a);
+	}
+
+}
+
+/* register pair rp of 0 BC, 1 DE, 2 HL */
+static inline void lanepair(Lanes8080* l, int rp, lane16* x){
+
+	*x = (WIDEN(l->reg[rp * 2]) << 8) | WIDEN(l->reg[rp * 2 + 1]);
+
+}
+
+static inline void setlanepair(Lanes8080* l, const lane8* m, int rp, const lane16* x){
+
+	l->reg[rp * 2] = BLEND(*m, NARROW(*x >> 8), l->reg[rp * 2]);
+	l->reg[rp * 2 + 1] = BLEND(*m, NARROW(*x), l->reg[rp * 2 + 1]);
+
+}
+
+/* lanes in the step's mask, for the parts that touch each lane's own memory */
+#define EACHLANE(i) for (int i = 0; i < LANES; i++) if ((*mask)[i])
+
+/* condition field c of Jcc/Ccc/Rcc as a lane mask */
+static inline void lanecond(const lane8* psw, uint8_t c, lane8* taken){
+
+	static const uint8_t flag[4] = {FLAG_Z, FLAG_CY, FLAG_P, FLAG_S};
+	lane8 set = (lane8)((*psw & flag[(c >> 1) & 3]) != 0);
+	*taken = c & 1 ? set : ~set;
+
+}
+
+/* register field r of the lanes in mask, M read from each lane's memory */
+static inline void lanesrc(Lanes8080* l, const lanemask8* mask, uint8_t r, lane8* x){
+
+	lane16 hl;
+
+	if (r != 6){
+		*x = l->reg[r];
+		return;
+	}
+	*x = (lane8){0};
+	lanepair(l, 2, &hl);
+	EACHLANE(i){
+		(*x)[i] = l->memory[i][hl[i]];
+	}
+
+}
+
+/*
+ the only store into a lane's memory, keeps its dirty and memory maps.
+ an MMIO hook gets the lane as a State8080 and what it changes there
+ goes back into the lane
+*/
+static inline void lanewrite(Lanes8080* l, int i, uint16_t addr, uint8_t value){
+
+	if (l->map[i] != NULL && l->map[i]->flags[addr >> 8]){
+		State8080 state;
+		GetLane8080(l, i, &state);
+		mapwrite(&state, addr, value);
+		SetLane8080(l, i, &state);
+		return;
+	}
+	l->memory[i][addr] = value;
+	if (l->dirty[i] != NULL){
+		l->dirty[i][addr >> 8] = DIRTY_ALL;
+	}
+
+}
+
+static inline void lanepush(Lanes8080* l, const lanemask8* mask, const lane16* value){
+
+	EACHLANE(i){
+		uint16_t sp = l->sp[i];
+		lanewrite(l, i, (uint16_t)(sp - 1), (*value)[i] >> 8);
+		lanewrite(l, i, (uint16_t)(sp - 2), (*value)[i]);
+		l->sp[i] = sp - 2;
+	}
+
+}
+
+static inline void lanepop(Lanes8080* l, const lanemask8* mask, lane16* value){
+
+	*value = (lane16){0};
+	EACHLANE(i){
+		uint16_t sp = l->sp[i];
+		(*value)[i] = l->memory[i][sp] | (l->memory[i][(uint16_t)(sp + 1)] << 8);
+		l->sp[i] = sp + 2;
+	}
+
+}
+
+/*
+ runs the instruction in code on the lanes in mask, which are all at
+ the same pc, and adds the extra cycles of taken Ccc/Rcc. returns 0
+ without touching them for HLT and DAA, which have no lane form, and
+ for IN and OUT, whose ports belong to each lane's map
+*/
+static int lanestep(Lanes8080* l, const lanemask8* mask, const uint8_t* code){
+
+	uint8_t op = code[0];
+	uint8_t d = (op >> 3) & 7, s = op & 7;
+	uint16_t imm = code[1] | (length8080[op] == 3 ? code[2] << 8 : 0);
+	lane8 m = (lane8)*mask;
+	lane16 m16 = (lane16)__builtin_convertvector(*mask, lanemask16);
+	lane16 next = l->pc + length8080[op];
+	lane8 zero = {0};
+	lane8 x;
+	lane16 w;
+
+	if (op == 0x76 || op == 0x27 || op == 0xd3 || op == 0xdb){
+		return 0;
+	}
+
+	if (op >= 0x40 && op < 0x80){
+		if (d == 6){
+			lanepair(l, 2, &w);
+			EACHLANE(i){
+				lanewrite(l, i, w[i], l->reg[s][i]);
 			}
-			break;
-		case 0xcc:
-			if (state->cc.z){
-				call(state, opcode);
-			}else{
-				state->pc += 2;
+		}else{
+			lanesrc(l, mask, s, &x);
+			l->reg[d] = BLEND(m, x, l->reg[d]);
+		}
+	}else if (op >= 0x80 && op < 0xc0){
+		lanesrc(l, mask, s, &x);
+		lanealu(l, &m, d, &x);
+	}else if ((op & 0xc7) == 0xc6){
+		x = zero + (uint8_t)imm;
+		lanealu(l, &m, d, &x);
+	}else if ((op & 0xc7) == 0x04 || (op & 0xc7) == 0x05){
+		lane8 f, zsp;
+		lanesrc(l, mask, d, &x);
+		if (s == 4){
+			x += 1;
+			f = (lane8)((x & 0xf) == 0) & FLAG_AC;
+		}else{
+			x -= 1;
+			f = (lane8)((x & 0xf) != 0xf) & FLAG_AC;
+		}
+		if (d == 6){
+			lanepair(l, 2, &w);
+			EACHLANE(i){
+				lanewrite(l, i, w[i], x[i]);
 			}
-			break;
-		case 0xcd:
-			call(state, opcode);
-			break;
-		case 0xd0:
-			if (state->cc.cy == 0){
-				ret(state);
+		}else{
+			l->reg[d] = BLEND(m, x, l->reg[d]);
+		}
+		lanezsp(&x, &zsp);
+		l->psw = BLEND(m, (l->psw & FLAG_CY) | zsp | f, l->psw);
+	}else if ((op & 0xc7) == 0x06){
+		if (d == 6){
+			lanepair(l, 2, &w);
+			EACHLANE(i){
+				lanewrite(l, i, w[i], imm);
 			}
-			break;
-		case 0xd1:
-			state->e = state->memory[state->sp];
-			state->d = state->memory[state->sp + 1];
-			state->sp += 2;
-			break;
-		case 0xd2:
-			if (0 == state->cc.cy){
-				state->pc = (opcode[2] << 8) | opcode[1];
-			}else{
-				state->pc += 2;
+		}else{
+			l->reg[d] = BLEND(m, zero + (uint8_t)imm, l->reg[d]);
+		}
+	}else if ((op & 0xc7) == 0x00){
+		/* NOP and its aliases */
+	}else if ((op & 0xcf) == 0x01){
+		if (op == 0x31){
+			l->sp = BLEND(m16, WIDEN(zero) + imm, l->sp);
+		}else{
+			w = WIDEN(zero) + imm;
+			setlanepair(l, &m, op >> 4, &w);
+		}
+	}else if ((op & 0xc7) == 0x03){
+		/* INX, DCX */
+		uint16_t step = op & 8 ? 0xffff : 1;
+		if ((op >> 4) == 3){
+			l->sp = BLEND(m16, l->sp + step, l->sp);
+		}else{
+			lanepair(l, op >> 4, &w);
+			w += step;
+			setlanepair(l, &m, op >> 4, &w);
+		}
+	}else if ((op & 0xcf) == 0x09){
+		lane16 hl, rp = l->sp;
+		lanepair(l, 2, &hl);
+		if ((op >> 4) != 3){
+			lanepair(l, op >> 4, &rp);
+		}
+		lane16 sum = hl + rp;
+		setlanepair(l, &m, 2, &sum);
+		l->psw = BLEND(m, (l->psw & ~FLAG_CY) | ((lane8)NARROW(sum < hl) & FLAG_CY), l->psw);
+	}else if ((op & 0xcf) == 0xc5){
+		/* PUSH */
+		if (op == 0xf5){
+			w = (WIDEN(l->reg[7]) << 8) | WIDEN(l->psw);
+		}else{
+			lanepair(l, (op >> 4) & 3, &w);
+		}
+		lanepush(l, mask, &w);
+	}else if ((op & 0xcf) == 0xc1){
+		/* POP */
+		lanepop(l, mask, &w);
+		if (op == 0xf1){
+			l->psw = BLEND(m, (NARROW(w) & FLAG_MASK) | FLAG_1, l->psw);
+			l->reg[7] = BLEND(m, NARROW(w >> 8), l->reg[7]);
+		}else{
+			setlanepair(l, &m, (op >> 4) & 3, &w);
+		}
+	}else if ((op & 0xc7) == 0xc4 || (op & 0xcf) == 0xcd){
+		/* Ccc, CALL */
+		lane8 taken = m;
+		if ((op & 0xcf) != 0xcd){
+			lanecond(&l->psw, d, &taken);
+			taken &= m;
+		}
+		lanemask8 calls = (lanemask8)taken;
+		lanepush(l, &calls, &next);
+		w = (lane16)__builtin_convertvector(calls, lanemask16);
+		next = BLEND(w, WIDEN(zero) + imm, next);
+		if ((op & 0xcf) != 0xcd){
+			for (int i = 0; i < LANES; i++){
+				l->cycles[i] += taken[i] & 6;
 			}
-			break;
-		case 0xd3:
-			state->pc += 1;
-			break;
-		case 0xd4:
-			if (0 == state->cc.cy){
-				call(state, opcode);
-			}else{
-				state->pc += 2;
+		}
+	}else if ((op & 0xc7) == 0xc7){
+		/* RST */
+		lanepush(l, mask, &next);
+		next = WIDEN(zero) + (op & 0x38);
+	}else if ((op & 0xc7) == 0xc0 || op == 0xc9 || op == 0xd9){
+		/* Rcc, RET */
+		lane8 taken = m;
+		if (!(op & 1)){
+			lanecond(&l->psw, d, &taken);
+			taken &= m;
+		}
+		lanemask8 returns = (lanemask8)taken;
+		lanepop(l, &returns, &w);
+		next = BLEND((lane16)__builtin_convertvector(returns, lanemask16), w, next);
+		if (!(op & 1)){
+			for (int i = 0; i < LANES; i++){
+				l->cycles[i] += taken[i] & 6;
 			}
-			break;
-		case 0xd5:
-			state->memory[state->sp - 2] = state->e;
-			state->memory[state->sp - 1] = state->d;
-			state->sp -= 2;
-			break;
-		case 0xd8:
-			if (state->cc.cy){
-				ret(state);
+		}
+	}else{
+		lane8 a = l->reg[7], psw = l->psw;
+		switch(op){
+			case 0x02: case 0x12:
+				lanepair(l, op >> 4, &w);
+				EACHLANE(i){
+					lanewrite(l, i, w[i], a[i]);
+				}
+				break;
+			case 0x0a: case 0x1a:
+				lanepair(l, op >> 4, &w);
+				EACHLANE(i){
+					l->reg[7][i] = l->memory[i][w[i]];
+				}
+				break;
+			case 0x22:
+				EACHLANE(i){
+					lanewrite(l, i, imm, l->reg[5][i]);
+					lanewrite(l, i, (uint16_t)(imm + 1), l->reg[4][i]);
+				}
+				break;
+			case 0x2a:
+				EACHLANE(i){
+					l->reg[5][i] = l->memory[i][imm];
+					l->reg[4][i] = l->memory[i][(uint16_t)(imm + 1)];
+				}
+				break;
+			case 0x32:
+				EACHLANE(i){
+					lanewrite(l, i, imm, a[i]);
+				}
+				break;
+			case 0x3a:
+				EACHLANE(i){
+					l->reg[7][i] = l->memory[i][imm];
+				}
+				break;
+			case 0x07:
+				l->reg[7] = BLEND(m, (a << 1) | (a >> 7), a);
+				l->psw = BLEND(m, (psw & ~FLAG_CY) | (a >> 7), psw);
+				break;
+			case 0x0f:
+				l->reg[7] = BLEND(m, (a >> 1) | (a << 7), a);
+				l->psw = BLEND(m, (psw & ~FLAG_CY) | (a & 1), psw);
+				break;
+			case 0x17:
+				l->reg[7] = BLEND(m, (a << 1) | (psw & FLAG_CY), a);
+				l->psw = BLEND(m, (psw & ~FLAG_CY) | (a >> 7), psw);
+				break;
+			case 0x1f:
+				l->reg[7] = BLEND(m, (a >> 1) | ((psw & FLAG_CY) << 7), a);
+				l->psw = BLEND(m, (psw & ~FLAG_CY) | (a & 1), psw);
+				break;
+			case 0x2f:
+				l->reg[7] = BLEND(m, ~a, a);
+				break;
+			case 0x37:
+				l->psw = BLEND(m, psw | FLAG_CY, psw);
+				break;
+			case 0x3f:
+				l->psw = BLEND(m, psw ^ FLAG_CY, psw);
+				break;
+			case 0xeb:{
+				lane16 de;
+				lanepair(l, 2, &w);
+				lanepair(l, 1, &de);
+				setlanepair(l, &m, 1, &w);
+				setlanepair(l, &m, 2, &de);
+				break;
 			}
-			break;
-		case 0xda:
-			if (state->cc.cy){
-				state->pc = (opcode[2] << 8) | opcode[1];
-			}else{
-				state->pc += 2;
+			case 0xe3:
+				EACHLANE(i){
+					uint16_t sp = l->sp[i];
+					uint8_t lo = l->memory[i][sp], hi = l->memory[i][(uint16_t)(sp + 1)];
+					lanewrite(l, i, sp, l->reg[5][i]);
+					lanewrite(l, i, (uint16_t)(sp + 1), l->reg[4][i]);
+					l->reg[5][i] = lo;
+					l->reg[4][i] = hi;
+				}
+				break;
+			case 0xe9:
+				lanepair(l, 2, &next);
+				break;
+			case 0xf9:
+				lanepair(l, 2, &w);
+				l->sp = BLEND(m16, w, l->sp);
+				break;
+			case 0xf3: case 0xfb:
+				EACHLANE(i){
+					l->interrupt_enabled[i] = op == 0xfb;
+				}
+				break;
+			case 0xc3: case 0xcb:
+				next = WIDEN(zero) + imm;
+				break;
+			case 0xc2: case 0xca: case 0xd2: case 0xda: case 0xe2: case 0xea: case 0xf2: case 0xfa:
+				lanecond(&psw, d, &x);
+				w = (lane16)__builtin_convertvector((lanemask8)x, lanemask16);
+				next = BLEND(w, WIDEN(zero) + imm, next);
+				break;
+			default:
+				return 0;
+		}
+	}
+
+	l->pc = BLEND(m16, next, l->pc);
+	return 1;
+
+}
+
+/*
+ runs every lane until it halts or has used cycles more cycles and
+ returns the instructions run. each lane stops at the same instruction
+ Run8080 would stop it at
+*/
+
+uint64_t RunLanes8080(Lanes8080* l, long cycles, LaneStats8080* stats){
+
+	uint64_t end[LANES];
+	uint64_t executed = 0;
+	State8080 state;
+
+	for (int i = 0; i < LANES; i++){
+		end[i] = l->cycles[i] + cycles;
+	}
+
+	for (;;){
+		uint8_t live[LANES];
+		int leader = -1;
+		for (int i = 0; i < LANES; i++){
+			live[i] = !l->halted[i] && (l->cycles[i] < end[i] || l->ei_shadow[i]);
+			if (live[i] && (leader < 0 || l->cycles[i] < l->cycles[leader])){
+				leader = i;
 			}
+		}
+		if (leader < 0){
 			break;
-		case 0xdb:
-			state->pc += 1;
-			break;
-		case 0xdc:
-			if (state->cc.cy){
-				call(state, opcode);
-			}else{
-				state->pc += 2;
+		}
+
+		/* lanes at the leader's pc whose code bytes match its own */
+		uint16_t pc = l->pc[leader];
+		const uint8_t *code = &l->memory[leader][pc];
+		uint8_t op = code[0];
+		uint32_t bytes = code[0] | code[1] << 8 | code[2] << 16;
+		uint32_t used = 0xffffff >> (8 * (3 - length8080[op]));
+		lanemask8 m = {0};
+		int active = 0;
+		for (int i = 0; i < LANES; i++){
+			const uint8_t *c = &l->memory[i][pc];
+			if (live[i] && l->pc[i] == pc && (((c[0] | c[1] << 8 | c[2] << 16) ^ bytes) & used) == 0){
+				m[i] = -1;
+				active++;
 			}
-			break;
-		case 0xe0:
-			if (state->cc.p == 0){
-				ret(state);
+		}
+
+		if (active > 1 && lanestep(l, &m, code)){
+			stats->vector++;
+			stats->vectorlanes += active;
+			executed += active;
+			for (int i = 0; i < LANES; i++){
+				l->cycles[i] += m[i] & cycles8080[op];
+				l->ei_shadow[i] = m[i] ? op == 0xfb : l->ei_shadow[i];
 			}
-			break;
-		case 0xe1:
-			state->l = state->memory[state->sp];
-			state->h = state->memory[state->sp + 1];
-			state->sp += 2;
-			break;
-		case 0xe2:
-			if (state->cc.p == 0){
-				state->pc = (opcode[2] << 8) | opcode[1];
-			}else{
-				state->pc += 2;
+		}else if (active > 1){
+			for (int i = 0; i < LANES; i++){
+				if (m[i]){
+					GetLane8080(l, i, &state);
+					Emulate8080Op(&state);
+					SetLane8080(l, i, &state);
+					executed++;
+					stats->scalar++;
+				}
+			}
+		}else{
+			/*
+			 alone: run it scalar until it reaches a pc another lane is at, or
+			 is LANE_SLICE cycles ahead of the next furthest behind. the low
+			 bits of their pcs filter the check down to the rare hit
+			*/
+			uint64_t near[4] = {0};
+			uint64_t ahead = end[leader];
+			for (int i = 0; i < LANES; i++){
+				if (i != leader && live[i]){
+					near[l->pc[i] >> 6 & 3] |= 1ull << (l->pc[i] & 63);
+					ahead = l->cycles[i] + LANE_SLICE < ahead ? l->cycles[i] + LANE_SLICE : ahead;
+				}
+			}
+			GetLane8080(l, leader, &state);
+			int met = 0;
+			do{
+				Emulate8080Op(&state);
+				executed++;
+				stats->scalar++;
+				if (near[state.pc >> 6 & 3] >> (state.pc & 63) & 1){
+					for (int i = 0; i < LANES; i++){
+						met |= i != leader && live[i] && l->pc[i] == state.pc;
+					}
+				}
+			}while(!state.halted && (state.cycles < ahead || state.ei_shadow) && !met);
+			SetLane8080(l, leader, &state);
+		}
+	}
+	return executed;
+
+}
+
+/*
+ snapshots: a machine's memory as 256 reference counted pages of 256
+ bytes. a snapshot taken against an earlier one shares every page that
+ has not changed since, so a long run of snapshots costs only the pages
+ written between them. with a dirty map, taking one compares only the
+ pages stored to since the last. running machines keep their flat
+ buffer, so no engine pays for the paging. Fork8080 copies the pages
+ into a new one, and RestoreSnapshot8080 into a machine's own, where
+ it copies only the pages stored to or not shared with the snapshot
+ the machine was at. the pages of a line of snapshots are counted
+ without locks, keep each line on one thread
+*/
+
+#define SNAP_PAGE 256
+#define SNAP_PAGES (0x10000 / SNAP_PAGE)
+
+typedef struct Page8080{
+	uint8_t data[SNAP_PAGE];	/* first, so it is as aligned as malloc */
+	uint32_t refs;
+} Page8080;
+
+typedef struct Snapshot8080{
+	State8080 state;	/* registers and map, memory, blocks and dirty are NULL */
+	Page8080 *page[SNAP_PAGES];
+	uint16_t shift;	/* the map's shift register as it was */
+	uint8_t shift_offset;
+} Snapshot8080;
+
+/* pages alive over all snapshots in the process */
+atomic_long snapshot_pages;
+
+void FreeSnapshot8080(Snapshot8080* snap){
+
+	if (snap == NULL){
+		return;
+	}
+	for (int p = 0; p < SNAP_PAGES; p++){
+		if (snap->page[p] != NULL && --snap->page[p]->refs == 0){
+			free(snap->page[p]);
+			atomic_fetch_sub(&snapshot_pages, 1);
+		}
+	}
+	free(snap);
+
+}
+
+/*
+ since may be NULL, or an earlier snapshot to share unchanged pages
+ with. with a dirty map, since must be the last snapshot taken of
+ state: only pages with their DIRTY_SNAP bit set are compared, the rest
+ are shared as they are, and the bits are cleared
+*/
+Snapshot8080* TakeSnapshot8080(State8080* state, const Snapshot8080* since){
+
+	Snapshot8080 *snap = aligned_alloc(64, sizeof(Snapshot8080));
+	if (snap == NULL){
+		return NULL;
+	}
+	memset(snap, 0, sizeof(Snapshot8080));
+	snap->state = *state;
+	snap->state.memory = NULL;
+	snap->state.blocks = NULL;
+	snap->state.dirty = NULL;
+	if (state->map != NULL){
+		snap->shift = state->map->shift;
+		snap->shift_offset = state->map->shift_offset;
+	}
+
+	for (int p = 0; p < SNAP_PAGES; p++){
+		const uint8_t *data = &state->memory[p * SNAP_PAGE];
+		Page8080 *page = since != NULL ? since->page[p] : NULL;
+		int clean = state->dirty != NULL && !(state->dirty[p] & DIRTY_SNAP);
+		if (page != NULL && (clean || memcmp(page->data, data, SNAP_PAGE) == 0)){
+			page->refs++;
+		}else{
+			page = malloc(sizeof(Page8080));
+			if (page == NULL){
+				FreeSnapshot8080(snap);
+				return NULL;
 			}
-			break;
-		case 0xe3:{
-			uint8_t l = state->l;
-			uint8_t h = state->h;
-			state->l = state->memory[state->sp];
-			state->h = state->memory[state->sp + 1];
-			state->memory[state->sp] = l;
-			state->memory[state->sp + 1] = h;
-			break;
+			page->refs = 1;
+			memcpy(page->data, data, SNAP_PAGE);
+			atomic_fetch_add(&snapshot_pages, 1);
 		}
-		case 0xe4:
-			if (state->cc.p == 0){
-				call(state, opcode);
-			}else{
-				state->pc += 2;
-			}
-			break;
-		case 0xe5:
-			state->memory[state->sp - 2] = state->l;
-			state->memory[state->sp - 1] = state->h;
-			state->sp -= 2;
-			break;
-		case 0xe6:{
-			uint8_t answer = state->a & opcode[1];
-			state->cc.z = (answer == 0);
-			state->cc.s = (0x80 == (answer & 0x80));
-			if (answer % 2 == 0){
-				state->cc.p = 1;
-			}else{
-				state->cc.p = 0;
-			}
-			state->cc.cy = 0;
-			state->a = answer;
-			state->pc += 1;
-			break;		
+		snap->page[p] = page;
+	}
+	for (int p = 0; p < SNAP_PAGES && state->dirty != NULL; p++){
+		state->dirty[p] &= ~DIRTY_SNAP;
+	}
+	return snap;
+
+}
+
+/*
+ puts state back as it was in snap, in its own memory. only pages that
+ differ are copied, and cached blocks over them are dropped. from may be
+ NULL, or the snapshot last taken of state or restored to it: then with
+ a dirty map a page is only looked at if its DIRTY_SNAP bit is set or
+ snap does not share it with from. the DIRTY_SNAP bits are cleared, so
+ snap is the since of the next TakeSnapshot8080
+*/
+
+void RestoreSnapshot8080(State8080* state, const Snapshot8080* snap, const Snapshot8080* from){
+
+	uint8_t *memory = state->memory, *dirty = state->dirty;
+	BlockCache8080 *blocks = state->blocks;
+	Map8080 *map = state->map;
+
+	*state = snap->state;
+	state->memory = memory;
+	state->blocks = blocks;
+	state->dirty = dirty;
+	state->map = map;
+	if (map != NULL){
+		map->shift = snap->shift;
+		map->shift_offset = snap->shift_offset;
+	}
+	for (int p = 0; p < SNAP_PAGES; p++){
+		uint8_t *data = &memory[p * SNAP_PAGE];
+		if (from != NULL && dirty != NULL && !(dirty[p] & DIRTY_SNAP) && from->page[p] == snap->page[p]){
+			continue;
 		}
-		case 0xe8:
-			if (state->cc.p){
-				ret(state);
-			}
-			break;
-		case 0xea:
-			if (state->cc.p){
-				state->pc = (opcode[2] << 8) | opcode[1];
-			}else{
-				state->pc += 2;
-			}
-			break;
-		case 0xec:
-			if (state->cc.p){
-				call(state, opcode);
-			}else{
-				state->pc += 2;
+		if (memcmp(data, snap->page[p]->data, SNAP_PAGE) != 0){
+			memcpy(data, snap->page[p]->data, SNAP_PAGE);
+			if (blocks != NULL && blocks->code[p]){
+				InvalidateBlocks8080(blocks, p * SNAP_PAGE);
 			}
-			break;
-		case 0xf0:
-			if (state->cc.p){
-				ret(state);
+			if (dirty != NULL){
+				dirty[p] = DIRTY_ALL;
 			}
-			break;
-		case 0xf1:{
-			uint8_t psw = state->memory[state->sp];
-			state->cc.z = ((psw & 0x01) == 0x01);
-			state->cc.s = ((psw & 0x02) == 0x02);
-			state->cc.p = ((psw & 0x04) == 0x04);
-			state->cc.cy = ((psw & 0x08) == 0x05);
-			state->cc.ac = ((psw & 0x10) == 0x10);
-			state->a = state->memory[state->sp + 1];
-			state->sp += 2;
-			break;
 		}
-		case 0xf2:
-			if (state->cc.s == 0){
-				state->pc = (opcode[2] << 8) | opcode[1];
-			}else{
-				state->pc += 2;
-			}
-			break;
-		case 0xf3:
-			state->cc.interrupt_enabled = 0;
-			break;
-		case 0xf5:{
-			uint8_t psw = (state->cc.z << 1 | state->cc.p << 2 | state->cc.cy << 3 | state->cc.ac << 4);
-			state->memory[state->sp - 2] = psw;
-			state->memory[state->sp - 1] = state->a;
-			state->sp -= 2;
-			break;
+		if (dirty != NULL){
+			dirty[p] &= ~DIRTY_SNAP;
 		}
-		case 0xf6:
-			state->a = ora(state, opcode[1]);
-			break;
-		case 0xf8:
-			if (state->cc.s){
-				ret(state);
-			}
-			break;
-		case 0xf9:
-			state->sp = (state->h << 8 | state->l);
-			break;
-		case 0xfa:
-			if (state->cc.s){
-				state->pc = (opcode[2] << 8) | opcode[1];
-			}else{
-				state->pc += 2;
-			}
-			break;
-		case 0xfb:
-			state->cc.interrupt_enabled = 1;
-			break;
-		case 0xfc:
-			if (state->cc.s){
-				call(state, opcode);
-			}else{
-				state->pc += 2;
+	}
+
+}
+
+/*
+ puts state back to baseline, a snapshot taken while the DIRTY_RESET
+ bits of its dirty map were clear, copying only the pages stored to
+ since. the copies clear DIRTY_RESET and count as stores for the other
+ bits. state->dirty must be set
+*/
+
+void Reset8080ToBaseline(State8080* state, const Snapshot8080* baseline){
+
+	uint8_t *memory = state->memory, *dirty = state->dirty;
+	BlockCache8080 *blocks = state->blocks;
+	Map8080 *map = state->map;
+
+	*state = baseline->state;
+	state->memory = memory;
+	state->blocks = blocks;
+	state->dirty = dirty;
+	state->map = map;
+	if (map != NULL){
+		map->shift = baseline->shift;
+		map->shift_offset = baseline->shift_offset;
+	}
+	for (int p = 0; p < SNAP_PAGES; p++){
+		if (dirty[p] & DIRTY_RESET){
+			memcpy(&memory[p * SNAP_PAGE], baseline->page[p]->data, SNAP_PAGE);
+			if (blocks != NULL && blocks->code[p]){
+				InvalidateBlocks8080(blocks, p * SNAP_PAGE);
 			}
+			dirty[p] = DIRTY_ALL & ~DIRTY_RESET;
+		}
+	}
+
+}
+
+/*
+ a new machine in state as snap left it, with its own memory from
+ NewMemory8080 for the snapshot's map. if snap has a map, map becomes
+ the fork's copy of it, with the snapshot's shift register and its
+ counters cleared, so forks never share device state. map may be NULL
+ when snap has none. -1 if out of memory
+*/
+
+int Fork8080(State8080* state, Map8080* map, const Snapshot8080* snap){
+
+	const Map8080 *from = snap->state.map;
+	uint8_t *memory;
+
+	if (from != NULL && map == NULL){
+		return -1;
+	}
+	/* every byte is written below, so only aliased memory needs NewMemory8080 */
+	if (from != NULL && from->alias){
+		memory = NewMemory8080(from);
+	}else if ((memory = malloc(0x10000 + 2)) != NULL){
+		memory[0x10000] = memory[0x10001] = 0;
+	}
+	if (memory == NULL){
+		return -1;
+	}
+	for (int p = 0; p < SNAP_PAGES; p++){
+		memcpy(&memory[p * SNAP_PAGE], snap->page[p]->data, SNAP_PAGE);
+	}
+	*state = snap->state;
+	state->memory = memory;
+	if (from != NULL){
+		*map = *from;
+		map->dropped = 0;
+		memset(map->reads, 0, sizeof(map->reads));
+		memset(map->writes, 0, sizeof(map->writes));
+		map->shift = snap->shift;
+		map->shift_offset = snap->shift_offset;
+		state->map = map;
+	}
+	return 0;
+
+}
+
+/*
+ rewind: the last frames of a machine in a fixed budget of bytes. every
+ keyevery frames a keyframe holds all of memory, and the frames between
+ hold only the pages that changed since the frame before, XORed with
+ what they were and run length coded. the pages come from the
+ DIRTY_REWIND bits of the dirty map, so pushing a frame costs the pages
+ stored to and the engines run as they always do. stepping back undoes
+ one delta, or, from a keyframe, replays the group before it. when the
+ budget is full, whole groups are dropped from the oldest end.
+
+ a record is the registers and then, for each page it holds, the page
+ number and its bytes as pairs of a count of zero bytes to skip and a
+ count of bytes to XOR in, ended by a 0, 0 pair. a keyframe is coded as
+ a delta from zeroed memory. a mirror page is kept by the lowest page
+ of its ring
+*/
+
+#define REWIND_PAGE_MAX (1 + 264)	/* page number and the longest coding of a page */
+#define REWIND_MIN (sizeof(RewindRegs8080) + SNAP_PAGES * REWIND_PAGE_MAX)
+
+typedef struct RewindRegs8080{
+	uint64_t cycles;
+	uint16_t bc, de, hl, sp, pc;
+	uint16_t shift;
+	uint8_t a, psw, interrupt_enabled, int_enable, halted, shift_offset;
+	uint8_t key;
+	uint16_t pages;	/* pages coded after the registers */
+} RewindRegs8080;
+
+typedef struct RewindFrame8080{
+	size_t offset;	/* of its record in the arena */
+	uint32_t length;
+	uint8_t key;
+} RewindFrame8080;
+
+typedef struct Rewind8080{
+	uint8_t *arena;
+	size_t budget;	/* arena bytes */
+	size_t head;	/* where the next record goes */
+	size_t used;	/* bytes in the records held */
+	RewindFrame8080 *frame;	/* ring of the frames held, oldest first */
+	int capacity, first, frames;
+	int keyevery, sincekey;
+	uint8_t *record;	/* the record being coded */
+	uint8_t prev[0x10000];	/* memory as of the newest frame */
+	uint64_t pushed, keys, dropped;
+} Rewind8080;
+
+/* codes the 256 bytes at x, returns the bytes written to out */
+static int rlepage(const uint8_t* x, uint8_t* out){
+
+	int n = 0, pos = 0;
+
+	for (;;){
+		int skip = 0, start, count = 0;
+		while(pos < 256 && x[pos] == 0 && skip < 255){
+			pos++;
+			skip++;
+		}
+		if (pos == 256){
 			break;
-		case 0xfe:{
-			uint8_t x = state->a - opcode[1];
-			state->cc.z = (x == 0);
-			state->cc.s = ((x & 0x80) == 0x80);
-			if (x % 2 == 0){
-				state->cc.p = 1;
-			}else{
-				state->cc.p = 0;
+		}
+		/* runs of fewer than 3 zeros cost less inside the literal */
+		for (start = pos; pos < 256 && count < 255; pos++, count++){
+			if (x[pos] == 0 && (pos + 2 >= 256 || (x[pos + 1] == 0 && x[pos + 2] == 0))){
+				break;
 			}
-			state->cc.cy = (state->a < opcode[1]);
-			state->pc += 1;
-			break;
 		}
+		out[n++] = skip;
+		out[n++] = count;
+		memcpy(&out[n], &x[start], count);
+		n += count;
 	}
-	
-	state->pc += 1;
+	out[n++] = 0;
+	out[n++] = 0;
+	return n;
+
+}
+
+/* XORs a coded page into page, returns the end of the coding */
+static const uint8_t* unrlepage(const uint8_t* in, uint8_t* page){
+
+	int pos = 0;
+
+	for (;;){
+		int skip = *in++, count = *in++;
+		if (skip == 0 && count == 0){
+			return in;
+		}
+		pos += skip;
+		while(count-- > 0){
+			page[pos++] ^= *in++;
+		}
+	}
+
+}
+
+/* NULL if out of memory or budget is under REWIND_MIN */
+Rewind8080* NewRewind8080(size_t budget, int capacity, int keyevery){
+
+	Rewind8080 *rw = calloc(1, sizeof(Rewind8080));
+
+	if (rw == NULL || budget < REWIND_MIN || capacity < 2 || keyevery < 1){
+		free(rw);
+		return NULL;
+	}
+	rw->arena = malloc(budget);
+	rw->frame = malloc(capacity * sizeof(RewindFrame8080));
+	rw->record = malloc(REWIND_MIN);
+	if (rw->arena == NULL || rw->frame == NULL || rw->record == NULL){
+		free(rw->record);
+		free(rw->frame);
+		free(rw->arena);
+		free(rw);
+		return NULL;
+	}
+	rw->budget = budget;
+	rw->capacity = capacity;
+	rw->keyevery = keyevery;
+	return rw;
+
+}
+
+void FreeRewind8080(Rewind8080* rw){
+
+	if (rw != NULL){
+		free(rw->record);
+		free(rw->frame);
+		free(rw->arena);
+		free(rw);
+	}
+
+}
+
+static RewindFrame8080* rewindframe(Rewind8080* rw, int i){
+
+	return &rw->frame[(rw->first + i) % rw->capacity];
+
+}
+
+/* drops the oldest group, a keyframe and the deltas after it */
+static void dropgroup(Rewind8080* rw){
+
+	do{
+		rw->used -= rewindframe(rw, 0)->length;
+		rw->first = (rw->first + 1) % rw->capacity;
+		rw->frames--;
+		rw->dropped++;
+	}while(rw->frames > 0 && !rewindframe(rw, 0)->key);
+	if (rw->frames == 0){
+		rw->head = 0;
+	}
+
+}
+
+static int rewindfirst(const State8080* state, int p){
+
+	return state->map != NULL ? firstmirror(state->map, p) : p;
+
+}
+
+/*
+ codes state into rw->record, as a keyframe from memory or as a delta
+ from rw->prev over the pages in touched. brings rw->prev up to date
+ and returns the record's length
+*/
+static size_t rewindrecord(Rewind8080* rw, State8080* state, int key, const uint8_t* touched){
+
+	RewindRegs8080 regs = {
+		state->cycles, state->bc, state->de, state->hl, state->sp, state->pc,
+		state->map != NULL ? state->map->shift : 0,
+		state->a, flags(state)->psw, state->cc.interrupt_enabled, state->int_enable, state->halted,
+		state->map != NULL ? state->map->shift_offset : 0, key, 0
+	};
+	uint8_t x[SNAP_PAGE];
+	size_t n = sizeof(regs);
+
+	for (int p = 0; p < SNAP_PAGES; p++){
+		uint8_t *now = &state->memory[p * SNAP_PAGE], *was = &rw->prev[p * SNAP_PAGE];
+		uint64_t any = 0;
+		if (rewindfirst(state, p) != p || (!key && !touched[p])){
+			continue;
+		}
+		for (int i = 0; i < SNAP_PAGE; i += 8){
+			uint64_t a, b;
+			memcpy(&a, &now[i], 8);
+			memcpy(&b, &was[i], 8);
+			b = key ? a : a ^ b;
+			memcpy(&x[i], &b, 8);
+			any |= b;
+		}
+		memcpy(was, now, SNAP_PAGE);
+		if (any){
+			rw->record[n++] = p;
+			n += rlepage(x, &rw->record[n]);
+			regs.pages++;
+		}
+	}
+	memcpy(rw->record, &regs, sizeof(regs));
+	return n;
+
+}
+
+/*
+ adds state as the newest frame and clears the DIRTY_REWIND bits. with
+ no dirty map every page is compared. returns the record's length
+*/
+size_t PushRewind8080(Rewind8080* rw, State8080* state){
+
+	uint8_t touched[SNAP_PAGES];
+	int key = rw->frames == 0 || rw->sincekey + 1 >= rw->keyevery;
+
+	for (int p = 0; p < SNAP_PAGES; p++){
+		touched[p] = 0;
+	}
+	for (int p = 0; p < SNAP_PAGES; p++){
+		if (state->dirty == NULL || (state->dirty[p] & DIRTY_REWIND)){
+			touched[rewindfirst(state, p)] = 1;
+		}
+		if (state->dirty != NULL){
+			state->dirty[p] &= ~DIRTY_REWIND;
+		}
+	}
+	size_t n = rewindrecord(rw, state, key, touched);
+
+	if (rw->frames == rw->capacity){
+		dropgroup(rw);
+	}
+	if (rw->head + n > rw->budget){
+		/* the records past head are the oldest, drop them before wrapping */
+		while(rw->frames > 0 && rewindframe(rw, 0)->offset >= rw->head){
+			dropgroup(rw);
+		}
+		rw->head = 0;
+	}
+	while(rw->frames > 0 && rewindframe(rw, 0)->offset >= rw->head &&
+		rewindframe(rw, 0)->offset < rw->head + n){
+		dropgroup(rw);
+	}
+	if (rw->frames == 0 && !key){
+		/* the budget ran out inside a group, so this frame starts one */
+		key = 1;
+		n = rewindrecord(rw, state, key, touched);
+	}
+
+	memcpy(&rw->arena[rw->head], rw->record, n);
+	*rewindframe(rw, rw->frames++) = (RewindFrame8080){rw->head, n, key};
+	rw->head += n;
+	rw->used += n;
+	rw->sincekey = key ? 0 : rw->sincekey + 1;
+	rw->keys += key;
+	rw->pushed++;
+	return n;
+
+}
+
+/* XORs the pages of a record into rw->prev, returns its registers */
+static RewindRegs8080 applyrecord(Rewind8080* rw, int i){
+
+	RewindFrame8080 *f = rewindframe(rw, i);
+	const uint8_t *in = &rw->arena[f->offset];
+	RewindRegs8080 regs;
+
+	memcpy(&regs, in, sizeof(regs));
+	in += sizeof(regs);
+	if (regs.key){
+		memset(rw->prev, 0, sizeof(rw->prev));
+	}
+	for (int k = 0; k < regs.pages; k++){
+		int p = *in++;
+		in = unrlepage(in, &rw->prev[p * SNAP_PAGE]);
+	}
+	return regs;
+
 }
 
+/*
+ puts state back to the frame before the newest and drops the newest.
+ anything run since the newest frame is undone too. pages are copied
+ into memory only where they differ, dropping cached blocks over them
+ and counting as stores for every dirty bit but DIRTY_REWIND. -1 if
+ there is no earlier frame
+*/
+int StepBack8080(Rewind8080* rw, State8080* state){
+
+	uint8_t *memory = state->memory, *dirty = state->dirty;
+	RewindRegs8080 regs;
+
+	if (rw->frames < 2){
+		return -1;
+	}
+	if (!rewindframe(rw, rw->frames - 1)->key){
+		applyrecord(rw, rw->frames - 1);
+		memcpy(&regs, &rw->arena[rewindframe(rw, rw->frames - 2)->offset], sizeof(regs));
+	}else{
+		/* from the previous keyframe forward */
+		int k = rw->frames - 2;
+		while(!rewindframe(rw, k)->key){
+			k--;
+		}
+		for (int i = k; i < rw->frames - 1; i++){
+			regs = applyrecord(rw, i);
+		}
+	}
+
+	for (int p = 0; p < SNAP_PAGES; p++){
+		int first = rewindfirst(state, p);
+		uint8_t *data = &rw->prev[first * SNAP_PAGE];
+		if (memcmp(&memory[p * SNAP_PAGE], data, SNAP_PAGE) == 0){
+			continue;
+		}
+		memcpy(&memory[p * SNAP_PAGE], data, SNAP_PAGE);
+		if (state->blocks != NULL && state->blocks->code[p]){
+			InvalidateBlocks8080(state->blocks, p * SNAP_PAGE);
+		}
+		if (dirty != NULL){
+			dirty[p] = DIRTY_ALL & ~DIRTY_REWIND;
+		}
+	}
+	if (dirty != NULL){
+		for (int p = 0; p < SNAP_PAGES; p++){
+			dirty[p] &= ~DIRTY_REWIND;
+		}
+	}
+
+	state->cycles = regs.cycles;
+	state->bc = regs.bc;
+	state->de = regs.de;
+	state->hl = regs.hl;
+	state->sp = regs.sp;
+	state->pc = regs.pc;
+	state->a = regs.a;
+	state->cc.psw = regs.psw;
+	state->cc.interrupt_enabled = regs.interrupt_enabled;
+	state->int_enable = regs.int_enable;
+	state->halted = regs.halted;
+	if (state->map != NULL){
+		state->map->shift = regs.shift;
+		state->map->shift_offset = regs.shift_offset;
+	}
+
+	rw->frames--;
+	rw->used -= rewindframe(rw, rw->frames)->length;
+	rw->head = rewindframe(rw, rw->frames)->offset;
+	int k = rw->frames - 1;
+	while(!rewindframe(rw, k)->key){
+		k--;
+	}
+	rw->sincekey = rw->frames - 1 - k;
+	return 0;
 
+}
 
 /*
  *codebuffer is pointer to 8080 assembly code
@@ -1715,31 +5601,2380 @@ int disassemble8080Op(unsigned char *codebuffer, int pc){
 			printf("JM	$%02x%02X", code[2], code[1]);
 			opbytes = 3;
 			break;
-		case 0xfb:
-			printf("EI");
+		case 0xfb:
+			printf("EI");
+			break;
+		case 0xfc:
+			printf("CM	$%02x%02x", code[2], code[1]);
+			opbytes = 3;
+			break;
+		case 0xfd:
+			printf("NOP");
+			break;
+		case 0xfe:
+			printf("CPI	#$%02x", code[1]);
+			opbytes = 2;
+			break;
+		case 0xff:
+			printf("RST	7");
+			break;	
+	}
+	printf("\n");
+
+	return opbytes;
+}
+
+/*
+ loads a rom image at 0x0000 into a fresh 64K machine for benchmarking.
+ the rest of the rom space is filled with RET so calls out of the image
+ come straight back, and the reset entry at 0x18d4 gets a driver that
+ sets up the stack and calls both interrupt handlers forever, the way
+ the game's frame loop does
+
+ returns size of the image or -1
+*/
+
+int LoadBench8080(State8080* state, char* path){
+
+	FILE *f = fopen(path, "rb");
+	if (f == NULL){
+		return -1;
+	}
+
+	uint8_t *memory = state->memory;
+	memset(state, 0, sizeof(State8080));
+	state->memory = memory != NULL ? memory : calloc(0x10000 + 2, 1);
+	memset(state->memory, 0, 0x10000 + 2);
+	memset(state->memory, 0xc9, 0x2000);
+
+	int fsize = fread(state->memory, 1, 0x2000, f);
+	fclose(f);
+
+	static const uint8_t driver[] = {
+		0x31, 0x00, 0x24,	/* LXI SP, $2400 */
+		0xcd, 0x10, 0x00,	/* CALL $0010 */
+		0xcd, 0x08, 0x00,	/* CALL $0008 */
+		0xc3, 0xd4, 0x18	/* JMP $18d4 */
+	};
+	memcpy(&state->memory[0x18d4], driver, sizeof(driver));
+
+	return fsize;
+}
+
+#ifdef USE_JIT
+#define ENGINES 4
+#else
+#define ENGINES 3
+#endif
+
+int bench(char* path, long count){
+
+	static const char *engines[] = {"switch", "threaded", "blocks", "jit"};
+	State8080 state = {0};
+	unsigned char *memory = calloc(0x10000 + 2, 1);
+	BlockCache8080 *cache = NewBlockCache8080();
+
+	for (int engine = 0; engine < ENGINES; engine++){
+		state.memory = memory;
+		if (LoadBench8080(&state, path) < 0){
+			printf("error opening file");
+			exit(1);
+		}
+
+		long executed = 0;
+		double start = now();
+		if (engine == 0){
+			for (executed = 0; executed < count && !state.halted; executed++){
+				Emulate8080Op(&state);
+			}
+		}else if (engine == 1){
+			while(count - executed > 0){
+				RunResult8080 r = Run8080(&state, 1000000);
+				executed += r.instructions;
+				if (r.status == RUN_HALT){
+					break;
+				}
+			}
+		}else if (engine == 2){
+			FlushBlocks8080(cache);
+			state.blocks = cache;
+			while(count - executed > 0){
+				RunResult8080 r = RunBlocks8080(&state, 1000000);
+				executed += r.instructions;
+				if (r.status == RUN_HALT){
+					break;
+				}
+			}
+		}
+#ifdef USE_JIT
+		else{
+			Jit8080 *jit = NewJit8080();
+			if (jit == NULL){
+				printf("jit       no executable memory\n");
+				break;
+			}
+			state.blocks = jit->cache;
+			while(count - executed > 0){
+				RunResult8080 r = RunJit8080(&state, 1000000);
+				executed += r.instructions;
+				if (r.status == RUN_HALT){
+					break;
+				}
+			}
+			state.blocks = NULL;
+			FreeJit8080(jit);
+		}
+#endif
+		double elapsed = now() - start;
+
+		printf("%-9s %ld instructions %.3fs %.1f MIPS\n",
+			engines[engine], executed, elapsed,
+			executed / elapsed / 1e6);
+	}
+
+	free(cache);
+	free(memory);
+	return 0;
+}
+
+/* opcode triple and its count, for profile() */
+typedef struct{
+	uint32_t key;	/* ops packed as a << 16 | b << 8 | c, plus 1 so 0 is free */
+	uint64_t count;
+} Triple8080;
+
+#define TRIPLES 0x10000
+
+/* prints one profile line, with the superinstruction the decoder makes of it */
+static void profileline(const uint8_t* ops, int n, uint64_t count, uint64_t total){
+
+	Uop8080 u[3] = {{{{0}}}};
+	for (int i = 0; i < n; i++){
+		u[i].op = ops[i];
+		printf("%02x ", ops[i]);
+	}
+	uint16_t handler = fusion(u, n);
+	printf("%*s%10lu %5.2f%%  %s\n", (3 - n) * 3, "", (unsigned long)count,
+		100.0 * count / total,
+		handler >= UOP_FUSED && fusions[handler - UOP_FUSED].length == n ?
+		fusions[handler - UOP_FUSED].name : "");
+
+}
+
+/*
+ counts the opcode pairs and triples the switch interpreter runs
+ inside basic blocks, then times the block engine with and without
+ superinstructions and reports how often each one fired and how many
+ dispatches that saved
+*/
+
+int profile(char* path, long count){
+
+	State8080 state = {0};
+	uint64_t *pairs = calloc(0x10000, sizeof(uint64_t));
+	Triple8080 *triples = calloc(TRIPLES, sizeof(Triple8080));
+	if (LoadBench8080(&state, path) < 0){
+		printf("error opening file");
+		exit(1);
+	}
+
+	int a = -1, b = -1;
+	for (long i = 0; i < count; i++){
+		uint8_t op = state.memory[state.pc];
+		Emulate8080Op(&state);
+		if (b >= 0){
+			pairs[(b << 8) | op]++;
+		}
+		if (a >= 0){
+			uint32_t key = ((a << 16) | (b << 8) | op) + 1;
+			uint32_t slot = (key * 2654435761u) >> 16;
+			for (int probe = 0; probe < 64; probe++, slot = (slot + 1) & (TRIPLES - 1)){
+				if (triples[slot].key == key || triples[slot].key == 0){
+					triples[slot].key = key;
+					triples[slot].count++;
+					break;
+				}
+			}
+		}
+		a = b;
+		b = op;
+		if (endsblock(op)){
+			a = b = -1;
+		}else if (a >= 0 && endsblock(a)){
+			a = -1;
+		}
+	}
+
+	printf("top opcode pairs in %ld instructions\n", count);
+	for (int n = 0; n < 12; n++){
+		int best = 0;
+		for (int i = 1; i < 0x10000; i++){
+			if (pairs[i] > pairs[best]){
+				best = i;
+			}
+		}
+		if (pairs[best] == 0){
+			break;
+		}
+		profileline((uint8_t[]){best >> 8, best & 0xff}, 2, pairs[best], count);
+		pairs[best] = 0;
+	}
+	printf("top opcode triples\n");
+	for (int n = 0; n < 12; n++){
+		int best = 0;
+		for (int i = 1; i < TRIPLES; i++){
+			if (triples[i].count > triples[best].count){
+				best = i;
+			}
+		}
+		if (triples[best].count == 0){
 			break;
-		case 0xfc:
-			printf("CM	$%02x%02x", code[2], code[1]);
-			opbytes = 3;
+		}
+		uint32_t key = triples[best].key - 1;
+		profileline((uint8_t[]){key >> 16, (key >> 8) & 0xff, key & 0xff}, 3, triples[best].count, count);
+		triples[best].count = 0;
+	}
+
+	BlockCache8080 *cache = NewBlockCache8080();
+	double elapsed[2];
+	long executed = 0;
+	for (int fuse = 0; fuse < 2; fuse++){
+		LoadBench8080(&state, path);
+		cache->fuse = fuse;
+		memset(cache->fired, 0, sizeof(cache->fired));
+		FlushBlocks8080(cache);
+		state.blocks = cache;
+		executed = 0;
+		double start = now();
+		while(count - executed > 0){
+			RunResult8080 r = RunBlocks8080(&state, 1000000);
+			executed += r.instructions;
+			if (r.status == RUN_HALT){
+				break;
+			}
+		}
+		elapsed[fuse] = now() - start;
+		state.blocks = NULL;
+		printf("blocks %-8s %ld instructions %.3fs %.1f MIPS\n", fuse ? "fused" : "unfused",
+			executed, elapsed[fuse], executed / elapsed[fuse] / 1e6);
+	}
+
+	uint64_t saved = 0;
+	printf("superinstruction       fired  dispatches saved\n");
+	for (int i = 0; i < FUSIONS; i++){
+		uint64_t n = cache->fired[i] * (fusions[i].length - 1);
+		printf("%-20s %10lu %10lu\n", fusions[i].name, (unsigned long)cache->fired[i], (unsigned long)n);
+		saved += n;
+	}
+	printf("%lu of %ld dispatches saved (%.1f%%), %.3fs faster, %.2fns per saved dispatch\n",
+		(unsigned long)saved, executed, 100.0 * saved / executed,
+		elapsed[0] - elapsed[1], saved ? (elapsed[0] - elapsed[1]) * 1e9 / saved : 0.0);
+
+	free(cache);
+	free(triples);
+	free(pairs);
+	free(state.memory);
+	return 0;
+}
+
+#ifdef USE_JIT
+
+/*
+ runs the rom through RunJit8080 a block at a time and the switch
+ interpreter in lockstep, with every block translated on first sight.
+ stops at the first step where registers, flags, cycles or memory
+ differ
+*/
+
+int jitcheck(char* path, long steps){
+
+	State8080 ref = {0}, state = {0};
+	Jit8080 *jit = NewJit8080();
+	if (jit == NULL){
+		printf("no executable memory\n");
+		return 1;
+	}
+	jit->hot = 0;
+	if (LoadBench8080(&ref, path) < 0 || LoadBench8080(&state, path) < 0){
+		printf("error opening file");
+		exit(1);
+	}
+	state.blocks = jit->cache;
+
+	long instructions = 0, step;
+	for (step = 0; step < steps; step++){
+		uint16_t pc = state.pc;
+		RunResult8080 r = RunJit8080(&state, 1);
+		for (uint64_t i = 0; i < r.instructions; i++){
+			Emulate8080Op(&ref);
+		}
+		instructions += r.instructions;
+
+		int diverged = state.bc != ref.bc || state.de != ref.de ||
+			state.hl != ref.hl || state.a != ref.a ||
+			state.sp != ref.sp || state.pc != ref.pc ||
+			flags(&state)->psw != flags(&ref)->psw ||
+			state.cc.interrupt_enabled != ref.cc.interrupt_enabled ||
+			state.cycles != ref.cycles || state.halted != ref.halted;
+		if (!diverged && (step % 1024 == 0 || step == steps - 1)){
+			diverged = memcmp(state.memory, ref.memory, 0x10000) != 0;
+		}
+		if (diverged){
+			printf("diverged at step %ld, block $%04x, %ld instructions in\n", step, pc, instructions);
+			printf("      pc   sp   a  psw  bc   de   hl   cycles\n");
+			printf("jit   %04x %04x %02x %02x   %04x %04x %04x %lu\n",
+				state.pc, state.sp, state.a, flags(&state)->psw,
+				state.bc, state.de, state.hl, (unsigned long)state.cycles);
+			printf("ref   %04x %04x %02x %02x   %04x %04x %04x %lu\n",
+				ref.pc, ref.sp, ref.a, flags(&ref)->psw,
+				ref.bc, ref.de, ref.hl, (unsigned long)ref.cycles);
+			for (int addr = 0; addr < 0x10000; addr++){
+				if (state.memory[addr] != ref.memory[addr]){
+					printf("first memory difference at $%04x: jit %02x ref %02x\n",
+						addr, state.memory[addr], ref.memory[addr]);
+					break;
+				}
+			}
+			FreeJit8080(jit);
+			return 1;
+		}
+		if (state.halted){
 			break;
-		case 0xfd:
-			printf("NOP");
+		}
+	}
+
+	printf("%ld blocks, %ld instructions match, %u bytes of native code\n",
+		step, instructions, jit->used - jit->base);
+	FreeJit8080(jit);
+	return 0;
+}
+
+#endif
+
+/*
+ scaling benchmark for RunBatch8080: the same batch of machines running
+ the rom, on 1, 2, 4 ... threads up to the number of cores or maxthreads
+*/
+
+int batchbench(char* path, int instances, int maxthreads){
+
+	BatchJob8080 *jobs = aligned_alloc(64, instances * sizeof(BatchJob8080));
+	BatchStats8080 *stats = aligned_alloc(64, maxthreads * sizeof(BatchStats8080));
+	double single = 0;
+
+	memset(jobs, 0, instances * sizeof(BatchJob8080));
+	printf("%d machines, 4000000 cycles each, 100000 cycle quanta\n", instances);
+	for (int threads = 1; ; threads = threads * 2 < maxthreads ? threads * 2 : maxthreads){
+		for (int i = 0; i < instances; i++){
+			if (LoadBench8080(&jobs[i].state, path) < 0){
+				printf("error opening file");
+				exit(1);
+			}
+			jobs[i].budget = 4000000;
+			jobs[i].quantum = 100000;
+			jobs[i].instructions = 0;
+		}
+
+		double start = now();
+		if (RunBatch8080(jobs, instances, threads, stats) < 0){
+			printf("could not start threads\n");
+			exit(1);
+		}
+		double elapsed = now() - start;
+
+		uint64_t executed = 0;
+		for (int i = 0; i < instances; i++){
+			executed += jobs[i].instructions;
+		}
+		double mips = executed / elapsed / 1e6;
+		if (threads == 1){
+			single = mips;
+		}
+		printf("%2d threads %lu instructions %.3fs %.1f MIPS %.2fx\n",
+			threads, (unsigned long)executed, elapsed, mips, mips / single);
+		for (int t = 0; t < threads; t++){
+			printf("   thread %2d %10lu instructions %5lu quanta %4lu steals %6lu misses %3.0f%% busy\n",
+				t, (unsigned long)stats[t].instructions, (unsigned long)stats[t].quanta,
+				(unsigned long)stats[t].steals, (unsigned long)stats[t].misses,
+				100.0 * stats[t].busy / elapsed);
+		}
+		if (threads == maxthreads){
 			break;
-		case 0xfe:
-			printf("CPI	#$%02x", code[1]);
-			opbytes = 2;
+		}
+	}
+
+	for (int i = 0; i < instances; i++){
+		free(jobs[i].state.memory);
+	}
+	free(stats);
+	free(jobs);
+	return 0;
+}
+
+/*
+ runs the same machines through RunLanes8080 in groups of LANES and
+ through the scalar batch path on one thread, every machine with its
+ own seed in the rom's work RAM, and checks both end in the same state
+*/
+
+int lanesbench(char* path, int machines, long cycles){
+
+	machines = (machines + LANES - 1) / LANES * LANES;
+	BatchJob8080 *jobs = aligned_alloc(64, machines * sizeof(BatchJob8080));
+	State8080 *machine = aligned_alloc(64, machines * sizeof(State8080));
+	Lanes8080 *lanes = aligned_alloc(64, sizeof(Lanes8080));
+	BatchStats8080 stats;
+	LaneStats8080 lanestats = {0};
+
+	memset(jobs, 0, machines * sizeof(BatchJob8080));
+	for (int i = 0; i < machines; i++){
+		if (LoadBench8080(&jobs[i].state, path) < 0){
+			printf("error opening file");
+			exit(1);
+		}
+		srand(i);
+		for (int addr = 0x2000; addr < 0x2100; addr++){
+			jobs[i].state.memory[addr] = rand();
+		}
+		jobs[i].budget = cycles;
+		jobs[i].quantum = 100000;
+		machine[i] = jobs[i].state;
+		machine[i].memory = malloc(0x10000 + 2);
+		memcpy(machine[i].memory, jobs[i].state.memory, 0x10000 + 2);
+	}
+
+	uint64_t executed = 0;
+	double start = now();
+	for (int group = 0; group < machines; group += LANES){
+		for (int i = 0; i < LANES; i++){
+			SetLane8080(lanes, i, &machine[group + i]);
+		}
+		executed += RunLanes8080(lanes, cycles, &lanestats);
+		for (int i = 0; i < LANES; i++){
+			GetLane8080(lanes, i, &machine[group + i]);
+		}
+	}
+	double lanetime = now() - start;
+
+	start = now();
+	RunBatch8080(jobs, machines, 1, &stats);
+	double scalartime = now() - start;
+
+	int differ = 0;
+	for (int i = 0; i < machines; i++){
+		State8080 *a = &machine[i], *b = &jobs[i].state;
+		differ += a->bc != b->bc || a->de != b->de || a->hl != b->hl ||
+			a->a != b->a || a->sp != b->sp || a->pc != b->pc ||
+			a->cc.psw != flags(b)->psw || a->cycles != b->cycles ||
+			a->halted != b->halted || memcmp(a->memory, b->memory, 0x10000) != 0;
+	}
+
+	printf("%d machines in %d lanes, %ld cycles each\n", machines, LANES, cycles);
+	printf("lanes     %lu instructions %.3fs %.1f MIPS\n", (unsigned long)executed,
+		lanetime, executed / lanetime / 1e6);
+	printf("          %.1f%% of instructions in %lu vector steps, %.1f of %d lanes busy (%.0f%%)\n",
+		100.0 * lanestats.vectorlanes / executed, (unsigned long)lanestats.vector,
+		lanestats.vector ? (double)lanestats.vectorlanes / lanestats.vector : 0.0, LANES,
+		lanestats.vector ? 100.0 * lanestats.vectorlanes / lanestats.vector / LANES : 0.0);
+	printf("scalar    %lu instructions %.3fs %.1f MIPS\n", (unsigned long)stats.instructions,
+		scalartime, stats.instructions / scalartime / 1e6);
+	printf("%d of %d machines end in a different state\n", differ, machines);
+
+	for (int i = 0; i < machines; i++){
+		free(machine[i].memory);
+		free(jobs[i].state.memory);
+	}
+	free(lanes);
+	free(machine);
+	free(jobs);
+	return differ != 0;
+}
+
+/*
+ takes count snapshots of the rom one 60Hz frame apart, each against the
+ one before through the dirty map, then forks a machine from each. one
+ more machine is run a frame at a time and restored to each snapshot
+ in turn. a sample of forks is run on for a frame and checked against
+ the next snapshot
+*/
+
+int snapshotbench(char* path, int count){
+
+	State8080 state = {0}, fork;
+	Map8080 forkmap;
+	uint8_t dirty[SNAP_PAGES] = {0}, forkdirty[SNAP_PAGES] = {0};
+	Snapshot8080 **snaps = calloc(count, sizeof(Snapshot8080*));
+	const long frame = 2000000 / 60;
+
+	if (LoadBench8080(&state, path) < 0){
+		printf("error opening file");
+		exit(1);
+	}
+	state.dirty = dirty;
+
+	/* each state is also taken without the dirty map, every page compared, first every other time */
+	double taking = 0, comparing = 0;
+	for (int i = 0; i < count; i++){
+		for (int pass = 0; pass < 2; pass++){
+			int compare = pass ^ (i & 1);
+			double start = now();
+			if (compare){
+				state.dirty = NULL;
+				Snapshot8080 *again = TakeSnapshot8080(&state, i > 0 ? snaps[i - 1] : NULL);
+				comparing += now() - start;
+				FreeSnapshot8080(again);
+				state.dirty = dirty;
+				continue;
+			}
+			snaps[i] = TakeSnapshot8080(&state, i > 0 ? snaps[i - 1] : NULL);
+			taking += now() - start;
+			if (snaps[i] == NULL){
+				printf("out of memory after %d snapshots\n", i);
+				exit(1);
+			}
+		}
+		Run8080(&state, frame);
+	}
+
+	double forking = 0;
+	for (int i = 0; i < count; i++){
+		double start = now();
+		Fork8080(&fork, &forkmap, snaps[i]);
+		forking += now() - start;
+		free(fork.memory);
+	}
+
+	/* the same from one flat buffer, checked so the copy is kept */
+	double copying = 0;
+	int differ = 0, checked = 0;
+	for (int i = 0; i < count; i++){
+		double start = now();
+		uint8_t *copy = malloc(0x10000 + 2);
+		memcpy(copy, state.memory, 0x10000 + 2);
+		copying += now() - start;
+		differ += memcmp(copy, state.memory, 0x10000 + 2) != 0;
+		free(copy);
+	}
+
+	/* one machine put on each snapshot in turn after running a frame */
+	double restoring = 0;
+	Fork8080(&fork, &forkmap, snaps[0]);
+	fork.dirty = forkdirty;
+	memset(forkdirty, DIRTY_ALL, sizeof(forkdirty));
+	for (int i = 1; i < count; i++){
+		Run8080(&fork, frame);
+		double start = now();
+		RestoreSnapshot8080(&fork, snaps[i], snaps[i - 1]);
+		restoring += now() - start;
+		for (int p = 0; p < SNAP_PAGES; p++){
+			differ += memcmp(&fork.memory[p * SNAP_PAGE], snaps[i]->page[p]->data, SNAP_PAGE) != 0;
+		}
+	}
+	free(fork.memory);
+
+	for (int i = 0; i + 1 < count; i += count / 100 + 1){
+		Fork8080(&fork, &forkmap, snaps[i]);
+		Run8080(&fork, frame);
+		const Snapshot8080 *next = snaps[i + 1];
+		int same = fork.pc == next->state.pc && fork.sp == next->state.sp &&
+			fork.bc == next->state.bc && fork.de == next->state.de &&
+			fork.hl == next->state.hl && fork.a == next->state.a &&
+			fork.cycles == next->state.cycles;
+		for (int p = 0; p < SNAP_PAGES; p++){
+			same = same && memcmp(&fork.memory[p * SNAP_PAGE], next->page[p]->data, SNAP_PAGE) == 0;
+		}
+		differ += !same;
+		checked++;
+		free(fork.memory);
+	}
+
+	long pages = atomic_load(&snapshot_pages);
+	double shared = (double)pages * sizeof(Page8080) + (double)count * sizeof(Snapshot8080);
+	double flat = (double)count * (0x10000 + sizeof(State8080));
+	printf("%d snapshots one frame apart\n", count);
+	printf("take      %.2f us each, %.1f new pages per snapshot, %.2f us comparing every page\n",
+		taking / count * 1e6, (double)(pages - SNAP_PAGES) / (count > 1 ? count - 1 : 1),
+		comparing / count * 1e6);
+	printf("fork      %.2f us each, full 64K copy %.2f us\n", forking / count * 1e6,
+		copying / count * 1e6);
+	printf("restore   %.2f us each onto the machine a frame later\n",
+		restoring / (count > 1 ? count - 1 : 1) * 1e6);
+	printf("memory    %.1f MB shared pages, %.0f bytes per snapshot, %.1f MB as flat copies\n",
+		shared / 1e6, shared / count, flat / 1e6);
+	printf("%d of %d forks differ from the next snapshot after a frame\n", differ, checked);
+
+	for (int i = 0; i < count; i++){
+		FreeSnapshot8080(snaps[i]);
+	}
+	free(snaps);
+	free(state.memory);
+	return differ != 0;
+}
+
+/*
+ runs the rom for one frame and resets it, count times: to a baseline
+ through the dirty map, by copying all 64K back, and by loading the rom
+ again. every run has to end where the first one did
+*/
+
+int resetbench(char* path, int count){
+
+	State8080 state = {0};
+	uint8_t dirty[SNAP_PAGES] = {0};
+	const long frame = 2000000 / 60;
+
+	if (LoadBench8080(&state, path) < 0){
+		printf("error opening file");
+		exit(1);
+	}
+	state.dirty = dirty;
+	Snapshot8080 *baseline = TakeSnapshot8080(&state, NULL);
+	State8080 start = state;
+	uint8_t *flat = malloc(0x10000 + 2);
+	memcpy(flat, state.memory, 0x10000 + 2);
+
+	Run8080(&state, frame);
+	State8080 end = state;
+	uint8_t *expected = malloc(0x10000 + 2);
+	memcpy(expected, state.memory, 0x10000 + 2);
+	Reset8080ToBaseline(&state, baseline);
+
+	int differ = 0;
+	long pages = 0;
+	double resetting = 0;
+	for (int i = 0; i < count; i++){
+		Run8080(&state, frame);
+		differ += state.pc != end.pc || state.cycles != end.cycles ||
+			memcmp(state.memory, expected, 0x10000) != 0;
+		for (int p = 0; p < SNAP_PAGES; p++){
+			pages += (dirty[p] & DIRTY_RESET) != 0;
+		}
+		double t = now();
+		Reset8080ToBaseline(&state, baseline);
+		resetting += now() - t;
+	}
+
+	double copying = 0;
+	for (int i = 0; i < count; i++){
+		Run8080(&state, frame);
+		differ += state.pc != end.pc || state.cycles != end.cycles;
+		double t = now();
+		uint8_t *memory = state.memory;
+		state = start;
+		state.memory = memory;
+		memcpy(state.memory, flat, 0x10000 + 2);
+		copying += now() - t;
+	}
+
+	int reloads = count / 10 + 1;
+	double loading = 0;
+	for (int i = 0; i < reloads; i++){
+		Run8080(&state, frame);
+		differ += state.pc != end.pc || state.cycles != end.cycles;
+		double t = now();
+		LoadBench8080(&state, path);
+		loading += now() - t;
+	}
+
+	printf("%d runs of one frame, %.1f dirty pages each\n", count, (double)pages / count);
+	printf("dirty map  %8.3f us per reset %10.0f resets/s\n", resetting / count * 1e6, count / resetting);
+	printf("full copy  %8.3f us per reset %10.0f resets/s\n", copying / count * 1e6, count / copying);
+	printf("reload rom %8.3f us per reset %10.0f resets/s\n", loading / reloads * 1e6, reloads / loading);
+	printf("%d runs differ from the first\n", differ);
+
+	FreeSnapshot8080(baseline);
+	free(expected);
+	free(flat);
+	free(state.memory);
+	return differ != 0;
+}
+
+/*
+ the rom with and without the Space Invaders memory map on the
+ interpreting engines, then single stores to video RAM: raw, through
+ write8 with no map, with a map of plain RAM, with the Invaders mirrors
+ aliased and with the same mirrors copied
+*/
+
+int mapbench(char* path, long cycles, long stores){
+
+	static const char *names[] = {"threaded", "blocks", "jit"};
+	static RunResult8080 (*const run[])(State8080*, long) = {
+		Run8080, RunBlocks8080,
+#ifdef USE_JIT
+		RunJit8080
+#endif
+	};
+	int engines = sizeof(run) / sizeof(run[0]);
+	State8080 flat = {0}, mapped = {0};
+	Map8080 map;
+	int differ = 0;
+
+	printf("%ld cycles\n", cycles);
+	for (int engine = 0; engine < engines; engine++){
+		double seconds[2];
+		uint64_t instructions[2];
+		for (int m = 0; m < 2; m++){
+			State8080 *state = m ? &mapped : &flat;
+			if (m){
+				MapInvaders8080(&map);
+				FreeMemory8080(state->memory, &map);
+				state->memory = NewMemory8080(&map);
+			}
+			if (state->memory == NULL && m){
+				printf("error mapping memory");
+				exit(1);
+			}
+			if (LoadBench8080(state, path) < 0){
+				printf("error opening file");
+				exit(1);
+			}
+			if (m){
+				SyncMirrors8080(&map, state->memory);
+				state->map = &map;
+			}
+			if (engine == 1){
+				state->blocks = NewBlockCache8080();
+			}
+#ifdef USE_JIT
+			Jit8080 *jit = engine == 2 ? NewJit8080() : NULL;
+			if (engine == 2 && jit == NULL){
+				printf("jit       no executable memory\n");
+				return differ != 0;
+			}
+			if (jit != NULL){
+				state->blocks = jit->cache;
+			}
+#endif
+			double start = now();
+			RunResult8080 r = run[engine](state, cycles);
+			seconds[m] = now() - start;
+			instructions[m] = r.instructions;
+#ifdef USE_JIT
+			if (jit != NULL){
+				FreeJit8080(jit);
+				state->blocks = NULL;
+			}
+#endif
+			free(state->blocks);
+			state->blocks = NULL;
+		}
+		differ += flat.pc != mapped.pc || flat.cycles != mapped.cycles ||
+			memcmp(flat.memory, mapped.memory, 0x4000) != 0;
+		for (int base = 0x4000; base < 0x10000; base += 0x4000){
+			differ += memcmp(mapped.memory, &mapped.memory[base], 0x4000) != 0;
+		}
+		printf("%-9s flat %.1f MIPS, mapped %.1f MIPS, %+.1f%%\n", names[engine],
+			instructions[0] / seconds[0] / 1e6, instructions[1] / seconds[1] / 1e6,
+			100.0 * (seconds[1] / instructions[1] / (seconds[0] / instructions[0]) - 1));
+	}
+	printf("%lu stores to ROM dropped, %d engines differ\n", (unsigned long)map.dropped, differ);
+
+	/* the same mirrors, moved off host page boundaries so they are copied */
+	Map8080 ram, copied;
+	InitMap8080(&ram);
+	InitMap8080(&copied);
+	for (int base = 0x6400; base < 0x10000; base += 0x4000){
+		MirrorPages8080(&copied, base, base + 0x1bff, 0x2400);
+	}
+	const char *kinds[] = {"raw array", "write8", "plain map", "aliased", "copied"};
+	Map8080 *maps[] = {NULL, NULL, &ram, &map, &copied};
+	for (int kind = 0; kind < 5; kind++){
+		State8080 *state = kind == 3 ? &mapped : &flat;
+		state->map = maps[kind];
+		uint16_t addr = 0x2400;
+		double start = now();
+		for (long i = 0; i < stores; i++){
+			if (kind == 0){
+				state->memory[addr] = i;
+			}else{
+				write8(state, addr, i);
+			}
+			addr = 0x2400 + ((addr + 0x101) & 0x1bff);
+		}
+		double elapsed = now() - start;
+		printf("%-10s %.2f ns per store to video RAM\n", kinds[kind], elapsed / stores * 1e9);
+	}
+
+	free(flat.memory);
+	FreeMemory8080(mapped.memory, &map);
+	return differ != 0;
+}
+
+/* the shift register as ordinary port handlers, for comparison */
+static uint8_t shiftin(State8080* state, uint8_t port){
+
+	Map8080 *map = state->map;
+	(void)port;
+	return map->shift >> (8 - map->shift_offset);
+
+}
+
+static void shiftout(State8080* state, uint8_t port, uint8_t value){
+
+	Map8080 *map = state->map;
+	if (port == 2){
+		map->shift_offset = value & 7;
+	}else{
+		map->shift = (value << 8) | (map->shift >> 8);
+	}
+
+}
+
+/*
+ the rom on the threaded engine with no ports, with the Invaders ports
+ and the shift register inline, and with the shift register through
+ handlers. then OUT 4, OUT 2 and IN 3 on their own, inline and through
+ handlers, to give the port traffic and port time per 60Hz frame
+*/
+
+int portbench(char* path, long cycles, long rounds){
+
+	static const char *names[] = {"no ports", "inline", "handlers"};
+	const double frames = cycles / (2000000.0 / 60);
+	State8080 state = {0};
+	Map8080 map;
+	double seconds[3], access[2];
+	uint64_t instructions[3];
+
+	for (int kind = 0; kind < 3; kind++){
+		if (LoadBench8080(&state, path) < 0){
+			printf("error opening file");
+			exit(1);
+		}
+		InitMap8080(&map);
+		map.inputs[0] = 0x0e;
+		map.inputs[1] = 0x08;
+		if (kind == 2){
+			map.in[3] = shiftin;
+			map.out[2] = map.out[4] = shiftout;
+		}else{
+			map.shifter = 1;
+		}
+		state.map = kind ? &map : NULL;
+		double start = now();
+		RunResult8080 r = Run8080(&state, cycles);
+		seconds[kind] = now() - start;
+		instructions[kind] = r.instructions;
+		printf("%-9s %.1f MIPS\n", names[kind], instructions[kind] / seconds[kind] / 1e6);
+	}
+
+	uint64_t accesses = 0;
+	printf("%.0f frames\nport reads/frame writes/frame\n", frames);
+	for (int port = 0; port < 256; port++){
+		if (map.reads[port] + map.writes[port] > 0){
+			printf("%4d %11.1f %12.1f\n", port, map.reads[port] / frames, map.writes[port] / frames);
+		}
+		accesses += map.reads[port] + map.writes[port];
+	}
+
+	uint8_t sum = 0;
+	for (int kind = 0; kind < 2; kind++){
+		map.shifter = !kind;
+		double start = now();
+		for (long i = 0; i < rounds; i++){
+			output(&state, 4, i);
+			output(&state, 2, i >> 8);
+			sum += input(&state, 3);
+		}
+		access[kind] = (now() - start) / (rounds * 3);
+	}
+	double frame = seconds[1] / frames;
+	double ports = accesses / frames * access[0];
+	printf("%.2f ns per port access inline, %.2f through handlers (%d)\n",
+		access[0] * 1e9, access[1] * 1e9, sum & 1);
+	printf("%.2f us of port handling in a %.1f us frame, %.2f%%\n",
+		ports * 1e6, frame * 1e6, 100.0 * ports / frame);
+
+	free(state.memory);
+	return instructions[1] != instructions[2];
+}
+
+/*
+ the rom with the Space Invaders video interrupts. first each engine
+ runs through RunScheduled8080 in uneven slices next to the switch
+ interpreter, which looks for due events after every instruction, and
+ both must reach the same state with the same interrupts delivered.
+ then each engine is timed with and without the interrupts
+*/
+
+int interruptbench(char* path, long cycles){
+
+	static const char *names[] = {"threaded", "blocks", "jit"};
+	static RunResult8080 (*const run[])(State8080*, long) = {
+		Run8080, RunBlocks8080,
+#ifdef USE_JIT
+		RunJit8080
+#endif
+	};
+	int engines = sizeof(run) / sizeof(run[0]);
+	State8080 ref = {0}, state = {0};
+	Scheduler8080 s, r;
+	int failed = 0;
+#ifdef USE_JIT
+	Jit8080 *jit = NewJit8080();
+	if (jit == NULL){
+		engines--;
+	}
+#endif
+
+	for (int engine = 0; engine < engines; engine++){
+		BlockCache8080 *blocks = NULL;
+		if (LoadBench8080(&ref, path) < 0 || LoadBench8080(&state, path) < 0){
+			printf("error opening file");
+			exit(1);
+		}
+		if (engine == 1){
+			blocks = NewBlockCache8080();
+			state.blocks = blocks;
+		}
+#ifdef USE_JIT
+		if (engine == 2){
+			FlushJit8080(jit);
+			state.blocks = jit->cache;
+		}
+#endif
+		memset(&s, 0, sizeof(s));
+		memset(&r, 0, sizeof(r));
+		ScheduleInvaders8080(&s, 0);
+		ScheduleInvaders8080(&r, 0);
+
+		srand(engine);
+		int diverged = 0;
+		while(state.cycles < (uint64_t)cycles / 10 && !diverged){
+			RunScheduled8080(&state, &s, 1 + rand() % 50000, run[engine]);
+			while(ref.cycles < state.cycles){
+				Emulate8080Op(&ref);
+				deliver(&ref, &r);
+			}
+			diverged = state.bc != ref.bc || state.de != ref.de ||
+				state.hl != ref.hl || state.a != ref.a ||
+				state.sp != ref.sp || state.pc != ref.pc ||
+				flags(&state)->psw != flags(&ref)->psw ||
+				state.cc.interrupt_enabled != ref.cc.interrupt_enabled ||
+				state.cycles != ref.cycles || s.delivered != r.delivered ||
+				s.missed != r.missed || memcmp(state.memory, ref.memory, 0x10000) != 0;
+		}
+		printf("%-9s %lu interrupts delivered, %lu missed, %s\n", names[engine],
+			(unsigned long)s.delivered, (unsigned long)s.missed,
+			diverged ? "FAIL at cycle" : "exact");
+		if (diverged){
+			printf("          cycle %lu pc %04x, switch pc %04x\n",
+				(unsigned long)state.cycles, state.pc, ref.pc);
+		}
+		failed |= diverged;
+		state.blocks = NULL;
+		free(blocks);
+	}
+
+	printf("%ld cycles, %ld frames\n", cycles, cycles / FRAME_CYCLES);
+	for (int engine = 0; engine < engines; engine++){
+		double seconds[2];
+		uint64_t instructions[2];
+		BlockCache8080 *blocks = engine == 1 ? NewBlockCache8080() : NULL;
+		for (int scheduled = 0; scheduled < 2; scheduled++){
+			LoadBench8080(&state, path);
+			state.blocks = blocks;
+#ifdef USE_JIT
+			if (engine == 2){
+				FlushJit8080(jit);
+				state.blocks = jit->cache;
+			}
+#endif
+			if (blocks != NULL){
+				FlushBlocks8080(blocks);
+			}
+			memset(&s, 0, sizeof(s));
+			ScheduleInvaders8080(&s, 0);
+			double start = now();
+			RunResult8080 result = scheduled ? RunScheduled8080(&state, &s, cycles, run[engine]) :
+				run[engine](&state, cycles);
+			seconds[scheduled] = now() - start;
+			instructions[scheduled] = result.instructions;
+		}
+		double plain = seconds[0] / instructions[0], timed = seconds[1] / instructions[1];
+		printf("%-9s plain %.1f MIPS, interrupts %.1f MIPS, %+.1f%% per instruction, %lu delivered\n",
+			names[engine], 1e-6 / plain, 1e-6 / timed, 100.0 * (timed / plain - 1),
+			(unsigned long)s.delivered);
+		state.blocks = NULL;
+		free(blocks);
+	}
+
+#ifdef USE_JIT
+	if (jit != NULL){
+		FreeJit8080(jit);
+	}
+#endif
+	free(ref.memory);
+	free(state.memory);
+	return failed;
+}
+
+/* bench drivers at $18d4 for a machine taking the video interrupts */
+static const uint8_t waitdriver[] = {
+	0x31, 0x00, 0x24,	/* LXI SP, $2400 */
+	0xfb,	/* EI */
+	0x3e, 0x01,	/* MVI A, 1 */
+	0x32, 0xc0, 0x20,	/* STA $20c0 */
+	0x3a, 0xc0, 0x20,	/* LDA $20c0 */
+	0xa7,	/* ANA A */
+	0xc2, 0xdd, 0x18,	/* JNZ $18dd */
+	0xc3, 0xd8, 0x18	/* JMP $18d8 */
+};
+
+static const uint8_t haltdriver[] = {
+	0x31, 0x00, 0x24,	/* LXI SP, $2400 */
+	0xfb,	/* EI */
+	0x76,	/* HLT */
+	0xc3, 0xd8, 0x18	/* JMP $18d8 */
+};
+
+/*
+ a headless run: the rom's own interrupt handlers driven by the video
+ interrupts, and a main loop that waits for the end of screen handler
+ to count $20c0 down, as the game's wait routine does. each engine
+ first runs with idle loops skipped in uneven slices next to the switch
+ interpreter, which runs every pass, then is timed with and without
+ skipping. last, the bench driver, which never idles, shows the cost
+ of looking
+*/
+
+int idlebench(char* path, long cycles){
+
+	static const char *names[] = {"threaded", "blocks", "jit"};
+	static RunResult8080 (*const run[])(State8080*, long) = {
+		Run8080, RunBlocks8080,
+#ifdef USE_JIT
+		RunJit8080
+#endif
+	};
+	int engines = sizeof(run) / sizeof(run[0]);
+	State8080 ref = {0}, state = {0};
+	Scheduler8080 s, r;
+	int failed = 0;
+#ifdef USE_JIT
+	Jit8080 *jit = NewJit8080();
+	if (jit == NULL){
+		engines--;
+	}
+#endif
+
+	for (int engine = 0; engine < engines; engine++){
+		BlockCache8080 *blocks = engine == 1 ? NewBlockCache8080() : NULL;
+		double seconds[2];
+		int diverged = 0;
+		for (int skip = 0; skip < 3; skip++){
+			if (LoadBench8080(&state, path) < 0 || LoadBench8080(&ref, path) < 0){
+				printf("error opening file");
+				exit(1);
+			}
+			memcpy(&state.memory[0x18d4], waitdriver, sizeof(waitdriver));
+			memcpy(&ref.memory[0x18d4], waitdriver, sizeof(waitdriver));
+			if (blocks != NULL){
+				FlushBlocks8080(blocks);
+			}
+			state.blocks = blocks;
+#ifdef USE_JIT
+			if (engine == 2){
+				FlushJit8080(jit);
+				state.blocks = jit->cache;
+			}
+#endif
+			memset(&s, 0, sizeof(s));
+			memset(&r, 0, sizeof(r));
+			ScheduleInvaders8080(&s, 0);
+			ScheduleInvaders8080(&r, 0);
+			s.fastforward = skip != 1;
+
+			if (skip == 0){
+				srand(engine);
+				while(state.cycles < (uint64_t)cycles / 10 && !diverged){
+					RunScheduled8080(&state, &s, 1 + rand() % 50000, run[engine]);
+					while(ref.cycles < state.cycles){
+						Emulate8080Op(&ref);
+						deliver(&ref, &r);
+					}
+					diverged = state.bc != ref.bc || state.de != ref.de ||
+						state.hl != ref.hl || state.a != ref.a ||
+						state.sp != ref.sp || state.pc != ref.pc ||
+						flags(&state)->psw != flags(&ref)->psw ||
+						state.cycles != ref.cycles || s.delivered != r.delivered ||
+						memcmp(state.memory, ref.memory, 0x10000) != 0;
+				}
+				printf("%-9s %lu interrupts, %d idle loops, %s\n", names[engine],
+					(unsigned long)s.delivered, s.loops, diverged ? "FAIL" : "exact");
+				failed |= diverged;
+				continue;
+			}
+			double start = now();
+			RunScheduled8080(&state, &s, cycles, run[engine]);
+			seconds[skip - 1] = now() - start;
+		}
+		printf("          %ld cycles in %.3fs running every pass, %.3fs skipping, %.1fx\n",
+			cycles, seconds[0], seconds[1], seconds[0] / seconds[1]);
+		printf("          %.0f and %.0f times real time\n",
+			cycles / 2e6 / seconds[0], cycles / 2e6 / seconds[1]);
+		state.blocks = NULL;
+		free(blocks);
+	}
+	printf("idle loop  length cycles      skips   cycles skipped\n");
+	for (int i = 0; i < s.loops; i++){
+		printf("$%04x      %6d %6d %10lu %16lu\n", s.loop[i].pc, s.loop[i].length, s.loop[i].cycles,
+			(unsigned long)s.loop[i].skips, (unsigned long)s.loop[i].skipped);
+	}
+
+	/* the bench driver calls the handlers itself and never waits, best of 3 */
+	double seconds[2] = {1e9, 1e9};
+	for (int round = 0; round < 6; round++){
+		int skip = round & 1;
+		LoadBench8080(&state, path);
+		memset(&s, 0, sizeof(s));
+		ScheduleInvaders8080(&s, 0);
+		s.fastforward = skip;
+		double start = now();
+		RunScheduled8080(&state, &s, cycles, Run8080);
+		double elapsed = now() - start;
+		seconds[skip] = elapsed < seconds[skip] ? elapsed : seconds[skip];
+	}
+	printf("bench driver, threaded: %d idle loops, %+.1f%% time looking for them\n",
+		s.loops, 100.0 * (seconds[1] / seconds[0] - 1));
+
+#ifdef USE_JIT
+	if (jit != NULL){
+		FreeJit8080(jit);
+	}
+#endif
+	free(ref.memory);
+	free(state.memory);
+	return failed;
+}
+
+static double cputime(void){
+
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+/*
+ a main loop that halts until each video interrupt. each engine runs it
+ in uneven slices next to the switch interpreter, which steps a halted
+ cpu to the next event itself. then the halting and the spinning
+ drivers run headless and in real time, for the host cpu each uses,
+ and the spinning one once more paced by polling the clock instead of
+ sleeping
+*/
+
+int haltbench(char* path, long cycles, double seconds){
+
+	static const char *names[] = {"threaded", "blocks", "jit"};
+	static RunResult8080 (*const run[])(State8080*, long) = {
+		Run8080, RunBlocks8080,
+#ifdef USE_JIT
+		RunJit8080
+#endif
+	};
+	static const uint8_t *drivers[] = {haltdriver, waitdriver};
+	static const int sizes[] = {sizeof(haltdriver), sizeof(waitdriver)};
+	int engines = sizeof(run) / sizeof(run[0]);
+	State8080 ref = {0}, state = {0};
+	Scheduler8080 s, r;
+	int failed = 0;
+#ifdef USE_JIT
+	Jit8080 *jit = NewJit8080();
+	if (jit == NULL){
+		engines--;
+	}
+#endif
+
+	for (int engine = 0; engine < engines; engine++){
+		BlockCache8080 *blocks = engine == 1 ? NewBlockCache8080() : NULL;
+		if (LoadBench8080(&state, path) < 0 || LoadBench8080(&ref, path) < 0){
+			printf("error opening file");
+			exit(1);
+		}
+		memcpy(&state.memory[0x18d4], haltdriver, sizeof(haltdriver));
+		memcpy(&ref.memory[0x18d4], haltdriver, sizeof(haltdriver));
+		state.blocks = blocks;
+#ifdef USE_JIT
+		if (engine == 2){
+			FlushJit8080(jit);
+			state.blocks = jit->cache;
+		}
+#endif
+		memset(&s, 0, sizeof(s));
+		memset(&r, 0, sizeof(r));
+		ScheduleInvaders8080(&s, 0);
+		ScheduleInvaders8080(&r, 0);
+
+		srand(engine);
+		int diverged = 0;
+		uint64_t halts = 0;
+		while(state.cycles < (uint64_t)cycles / 10 && !diverged){
+			RunScheduled8080(&state, &s, 1 + rand() % 50000, run[engine]);
+			halts += state.halted;
+			while(ref.cycles < state.cycles){
+				if (ref.halted){
+					ref.cycles = r.heap[0].at < state.cycles ? r.heap[0].at : state.cycles;
+				}else{
+					Emulate8080Op(&ref);
+				}
+				deliver(&ref, &r);
+			}
+			diverged = state.bc != ref.bc || state.de != ref.de ||
+				state.hl != ref.hl || state.a != ref.a ||
+				state.sp != ref.sp || state.pc != ref.pc ||
+				flags(&state)->psw != flags(&ref)->psw ||
+				state.cycles != ref.cycles || state.halted != ref.halted ||
+				s.delivered != r.delivered || memcmp(state.memory, ref.memory, 0x10000) != 0;
+		}
+		printf("%-9s %lu interrupts, %lu slices ended halted, %s\n", names[engine],
+			(unsigned long)s.delivered, (unsigned long)halts, diverged ? "FAIL" : "exact");
+		failed |= diverged;
+		state.blocks = NULL;
+		free(blocks);
+	}
+
+	for (int d = 0; d < 2; d++){
+		LoadBench8080(&state, path);
+		memcpy(&state.memory[0x18d4], drivers[d], sizes[d]);
+		memset(&s, 0, sizeof(s));
+		ScheduleInvaders8080(&s, 0);
+		double start = now();
+		RunResult8080 result = RunScheduled8080(&state, &s, cycles, Run8080);
+		double elapsed = now() - start;
+		printf("%s headless: %ld cycles, %lu instructions in %.3fs, %.0f times real time\n",
+			d ? "spinning" : "halting ", cycles, (unsigned long)result.instructions,
+			elapsed, cycles / (double)CLOCK_HZ / elapsed);
+	}
+	for (int d = 0; d < 2; d++){
+		LoadBench8080(&state, path);
+		memcpy(&state.memory[0x18d4], drivers[d], sizes[d]);
+		memset(&s, 0, sizeof(s));
+		ScheduleInvaders8080(&s, 0);
+		double start = now(), cpu = cputime();
+		RunRealtime8080(&state, &s, seconds * CLOCK_HZ, Run8080);
+		double elapsed = now() - start;
+		cpu = cputime() - cpu;
+		printf("%s real time: %.2fs of guest in %.2fs, %.3f ms of host cpu (%.3f%%)\n",
+			d ? "spinning" : "halting ", seconds, elapsed, cpu * 1e3, 100.0 * cpu / elapsed);
+	}
+	/* the spinning driver paced by polling the clock, a host loop that never sleeps */
+	LoadBench8080(&state, path);
+	memcpy(&state.memory[0x18d4], waitdriver, sizeof(waitdriver));
+	memset(&s, 0, sizeof(s));
+	ScheduleInvaders8080(&s, 0);
+	double start = now(), cpu = cputime();
+	while(state.cycles < (uint64_t)(seconds * CLOCK_HZ)){
+		RunScheduled8080(&state, &s, s.heap[0].at > state.cycles ? s.heap[0].at - state.cycles : 0, Run8080);
+		while(now() < start + (double)state.cycles / CLOCK_HZ){
+		}
+	}
+	double elapsed = now() - start;
+	cpu = cputime() - cpu;
+	printf("polling  real time: %.2fs of guest in %.2fs, %.3f ms of host cpu (%.3f%%)\n",
+		seconds, elapsed, cpu * 1e3, 100.0 * cpu / elapsed);
+
+#ifdef USE_JIT
+	if (jit != NULL){
+		FreeJit8080(jit);
+	}
+#endif
+	free(ref.memory);
+	free(state.memory);
+	return failed;
+}
+
+/*
+ checks that a lone pixel lands where the rotation puts it and that the
+ kernels agree on random frame buffers, then times each one, RGBA and
+ indexed. with a file, or - for stdout, the rom then runs frames frames
+ with the video interrupts and writes each one to it, as PPM if the
+ name ends in .ppm and PAM otherwise
+*/
+
+int renderbench(char* path, int frames, char* file){
+
+#ifdef USE_AVX2
+	static const char *names[] = {"scalar", "sse2", "avx2"};
+	static void (*const kernel[])(const uint8_t*, uint8_t*, int, uint32_t) = {renderscalar, rendervector, renderavx2};
+	int kernels = __builtin_cpu_supports("avx2") ? 3 : 2;
+#else
+	static const char *names[] = {"scalar", "vector"};
+	static void (*const kernel[])(const uint8_t*, uint8_t*, int, uint32_t) = {renderscalar, rendervector};
+	int kernels = 2;
+#endif
+	static const uint16_t lone[][2] = {{0, 0}, {223, 255}, {100, 37}, {5, 200}};
+	FILE *log = file != NULL && strcmp(file, "-") == 0 ? stderr : stdout;
+	uint8_t *memory = calloc(0x10000 + 2, 1);
+	uint8_t *out = malloc(FRAME_W * FRAME_H * 4);
+	uint8_t *want = malloc(FRAME_W * FRAME_H * 4);
+	int failed = 0;
+
+	for (int k = 0; k < kernels; k++){
+		for (int indexed = 0; indexed < 2; indexed++){
+			for (int i = 0; i < 4; i++){
+				int y = lone[i][0], x = lone[i][1], at = (FRAME_H - 1 - x) * FRAME_W + y, lit = 0;
+				memset(&memory[VRAM], 0, FRAME_W * 32);
+				memory[VRAM + y * 32 + x / 8] = 1 << (x & 7);
+				kernel[k](memory, out, indexed, ALL_GROUPS);
+				for (int p = 0; p < FRAME_W * FRAME_H; p++){
+					lit += indexed ? out[p] : out[p * 4];
+				}
+				failed |= lit != (indexed ? 1 : 0xff) || out[indexed ? at : at * 4] == 0;
+			}
+			srand(1);
+			for (int n = 0; n < 16; n++){
+				for (int addr = VRAM; addr < VRAM + FRAME_W * 32; addr++){
+					memory[addr] = rand();
+				}
+				renderscalar(memory, want, indexed, ALL_GROUPS);
+				kernel[k](memory, out, indexed, ALL_GROUPS);
+				failed |= memcmp(out, want, FRAME_W * FRAME_H * (indexed ? 1 : 4)) != 0;
+			}
+		}
+	}
+	fprintf(log, "rotation and kernels %s\n", failed ? "FAIL" : "agree");
+
+	for (int indexed = 0; indexed < 2; indexed++){
+		double scalar = 0;
+		for (int k = 0; k < kernels; k++){
+			double start = now();
+			for (int n = 0; n < frames; n++){
+				memory[VRAM + n % (FRAME_W * 32)] ^= n;
+				kernel[k](memory, out, indexed, ALL_GROUPS);
+			}
+			double elapsed = now() - start;
+			scalar = k == 0 ? elapsed : scalar;
+			fprintf(log, "%-7s %-6s %9.0f frames/s, %5.2f ns per pixel, %5.1fx\n",
+				indexed ? "indexed" : "RGBA", names[k], frames / elapsed,
+				elapsed / frames / (FRAME_W * FRAME_H) * 1e9, scalar / elapsed);
+		}
+	}
+
+	if (file != NULL){
+		FILE *f = strcmp(file, "-") == 0 ? stdout : fopen(file, "wb");
+		size_t length = strlen(file);
+		int pam = length < 4 || strcmp(&file[length - 4], ".ppm") != 0;
+		State8080 state = {0};
+		Scheduler8080 s = {0};
+		if (f == NULL || LoadBench8080(&state, path) < 0){
+			printf("error opening file");
+			exit(1);
+		}
+		ScheduleInvaders8080(&s, 0);
+		double start = now();
+		int written = 0;
+		while(written < frames && !failed){
+			RunScheduled8080(&state, &s, FRAME_CYCLES, Run8080);
+			RenderFrame8080(state.memory, out, 0);
+			failed |= WriteFrame8080(f, out, pam) < 0;
+			written += !failed;
+		}
+		double elapsed = now() - start;
+		fprintf(log, "%d %s frames written in %.3fs, %.0f frames/s\n", written,
+			pam ? "PAM" : "PPM", elapsed, written / elapsed);
+		if (f != stdout){
+			fclose(f);
+		}
+		free(state.memory);
+	}
+
+	free(want);
+	free(out);
+	free(memory);
+	return failed;
+}
+
+/*
+ a main loop that waits for each end of screen interrupt, then erases
+ a 16x8 pixel sprite and draws it again one byte further on. runs at
+ $18d4, with the sprite routine at $1900
+*/
+static const uint8_t spritedriver[] = {
+	0x31, 0x00, 0x24,	/* LXI SP, $2400 */
+	0x21, 0x00, 0x28,	/* LXI H, $2800 */
+	0xfb,	/* EI */
+	0x3e, 0x01,	/* MVI A, 1 */
+	0x32, 0xc0, 0x20,	/* STA $20c0 */
+	0x3a, 0xc0, 0x20,	/* LDA $20c0 */
+	0xa7,	/* ANA A */
+	0xc2, 0xe0, 0x18,	/* JNZ $18e0 */
+	0x0e, 0x00,	/* MVI C, 0 */
+	0xcd, 0x00, 0x19,	/* CALL $1900 */
+	0x23,	/* INX H */
+	0x7c,	/* MOV A, H */
+	0xfe, 0x3e,	/* CPI $3e */
+	0xda, 0xf5, 0x18,	/* JC $18f5 */
+	0x26, 0x24,	/* MVI H, $24 */
+	0x0e, 0xff,	/* MVI C, $ff */
+	0xcd, 0x00, 0x19,	/* CALL $1900 */
+	0xc3, 0xdb, 0x18	/* JMP $18db */
+};
+
+static const uint8_t spriteroutine[] = {
+	0xe5,	/* PUSH H */
+	0x11, 0x1f, 0x00,	/* LXI D, $001f */
+	0x06, 0x08,	/* MVI B, 8 */
+	0x71,	/* MOV M, C */
+	0x23,	/* INX H */
+	0x71,	/* MOV M, C */
+	0x19,	/* DAD D */
+	0x05,	/* DCR B */
+	0xc2, 0x06, 0x19,	/* JNZ $1906 */
+	0xe1,	/* POP H */
+	0xc9	/* RET */
+};
+
+/*
+ runs the sprite driver with the video interrupts and a dirty map, on
+ the threaded engine and the translator, and after every frame draws
+ it both in full and as a delta, which must agree. reports how much of
+ the frame buffer changes per frame and what the delta saves
+*/
+
+int deltabench(char* path, int frames){
+
+	static const char *names[] = {"threaded", "jit"};
+	static RunResult8080 (*const run[])(State8080*, long) = {
+		Run8080,
+#ifdef USE_JIT
+		RunJit8080
+#endif
+	};
+	int engines = sizeof(run) / sizeof(run[0]);
+	uint8_t *full = malloc(FRAME_W * FRAME_H * 4);
+	uint8_t *delta = malloc(FRAME_W * FRAME_H * 4);
+	uint8_t dirty[SNAP_PAGES];
+	State8080 state = {0};
+	Scheduler8080 s;
+	Video8080 *v = malloc(sizeof(Video8080));
+	int failed = 0;
+#ifdef USE_JIT
+	Jit8080 *jit = NewJit8080();
+	if (jit == NULL){
+		engines--;
+	}
+#endif
+
+	for (int engine = 0; engine < engines; engine++){
+		for (int indexed = 0; indexed < 2; indexed++){
+			if (LoadBench8080(&state, path) < 0){
+				printf("error opening file");
+				exit(1);
+			}
+			memcpy(&state.memory[0x18d4], spritedriver, sizeof(spritedriver));
+			memcpy(&state.memory[0x1900], spriteroutine, sizeof(spriteroutine));
+			memset(dirty, 0, sizeof(dirty));
+			state.dirty = dirty;
+#ifdef USE_JIT
+			if (engine == 1){
+				FlushJit8080(jit);
+				state.blocks = jit->cache;
+			}
+#endif
+			memset(&s, 0, sizeof(s));
+			ScheduleInvaders8080(&s, 0);
+			memset(v, 0, sizeof(Video8080));
+
+			double drawing[2] = {0, 0};
+			int differ = 0;
+			for (int frame = 0; frame < frames; frame++){
+				RunScheduled8080(&state, &s, FRAME_CYCLES, run[engine]);
+				double start = now();
+				RenderFrame8080(state.memory, full, indexed);
+				drawing[0] += now() - start;
+				start = now();
+				RenderDelta8080(v, &state, delta, indexed);
+				drawing[1] += now() - start;
+				differ += memcmp(full, delta, FRAME_W * FRAME_H * (indexed ? 1 : 4)) != 0;
+			}
+			/* nothing ran, so the delta is empty */
+			differ += RenderDelta8080(v, &state, delta, indexed) != 0;
+			state.blocks = NULL;
+
+			printf("%-8s %-7s %lu of %d frames empty, %.1f of 224 scanlines changed, "
+				"%.1f of 28 pages compared, %.1f redrawn per frame\n",
+				names[engine], indexed ? "indexed" : "RGBA", (unsigned long)v->empty - 1, frames,
+				(double)v->scanlines / frames, (double)v->compared / frames, (double)v->groups / frames);
+			printf("         full %.2f us, delta %.2f us per frame, %.1fx, %s\n",
+				drawing[0] / frames * 1e6, drawing[1] / frames * 1e6,
+				drawing[0] / drawing[1], differ ? "FAIL" : "same frames");
+			failed |= differ != 0;
+		}
+	}
+
+#ifdef USE_JIT
+	if (jit != NULL){
+		FreeJit8080(jit);
+	}
+#endif
+	free(state.memory);
+	free(v);
+	free(delta);
+	free(full);
+	return failed;
+}
+
+/* from its frame on, IN port reads value */
+typedef struct ScriptInput8080{
+	int frame;
+	uint8_t port;
+	uint8_t value;
+} ScriptInput8080;
+
+/*
+ reads an input script of "frame port value" lines, in frame order, with
+ # starting a comment. returns the number of inputs, -1 if the file is
+ unreadable or a line is bad
+*/
+static int readscript(char* path, ScriptInput8080** inputs){
+
+	FILE *f = fopen(path, "r");
+	char line[256];
+	int count = 0, size = 0, number = 0;
+
+	*inputs = NULL;
+	if (f == NULL){
+		return -1;
+	}
+	while(fgets(line, sizeof(line), f) != NULL){
+		int frame, port, value;
+		char *hash = strchr(line, '#');
+		number++;
+		if (hash != NULL){
+			*hash = 0;
+		}
+		if (strspn(line, " \t\r\n") == strlen(line)){
+			continue;
+		}
+		if (sscanf(line, "%d %i %i", &frame, &port, &value) != 3 || frame < 0 ||
+			port < 0 || port > 255 || value < 0 || value > 255 ||
+			(count > 0 && frame < (*inputs)[count - 1].frame)){
+			printf("%s:%d: expected frame port value, in frame order\n", path, number);
+			fclose(f);
+			return -1;
+		}
+		if (count == size){
+			size = size ? size * 2 : 64;
+			*inputs = realloc(*inputs, size * sizeof(ScriptInput8080));
+		}
+		(*inputs)[count++] = (ScriptInput8080){frame, port, value};
+	}
+	fclose(f);
+	return count;
+
+}
+
+/*
+ a regression run: the rom with the video interrupts, the waiting main
+ loop and the Invaders ports, unthrottled, with idle loops skipped, on
+ the translator where there is one. script, if not NULL, sets the
+ ports' inputs as it goes. every frame is hashed, and the hashes are
+ written to golden, or printed in hex if golden is "-". with check,
+ the run is as long as golden and stops at the first frame whose hash
+ differs
+*/
+
+int hashrun(char* path, int frames, char* golden, char* script, int check){
+
+	State8080 state = {0};
+	Scheduler8080 s;
+	Map8080 map;
+	ScriptInput8080 *inputs = NULL;
+	int count = 0, next = 0, diverged = -1, failed = 0;
+	uint64_t *hashes, *expected = NULL;
+	RunResult8080 (*engine)(State8080*, long) = Run8080;
+	double hashing = 0;
+#ifdef USE_JIT
+	Jit8080 *jit = NULL;
+#endif
+
+	if (script != NULL && (count = readscript(script, &inputs)) < 0){
+		return 1;
+	}
+	if (check){
+		FILE *f = fopen(golden, "rb");
+		expected = malloc(sizeof(uint64_t) << 20);
+		frames = f != NULL ? ReadHashes8080(f, expected, 1 << 20) : -1;
+		if (f != NULL){
+			fclose(f);
+		}
+		if (frames < 0){
+			printf("%s is not a golden file\n", golden);
+			free(inputs);
+			free(expected);
+			return 1;
+		}
+	}
+	hashes = malloc((frames > 0 ? frames : 1) * sizeof(uint64_t));
+
+	if (LoadBench8080(&state, path) < 0){
+		printf("error opening file");
+		exit(1);
+	}
+	memcpy(&state.memory[0x18d4], waitdriver, sizeof(waitdriver));
+	InitMap8080(&map);
+	map.inputs[0] = 0x0e;
+	map.inputs[1] = 0x08;
+	map.shifter = 1;
+	state.map = &map;
+#ifdef USE_JIT
+	if ((jit = NewJit8080()) != NULL){
+		state.blocks = jit->cache;
+		engine = RunJit8080;
+	}
+#endif
+	memset(&s, 0, sizeof(s));
+	ScheduleInvaders8080(&s, 0);
+	s.fastforward = 1;
+
+	double start = now();
+	for (int frame = 0; frame < frames; frame++){
+		while(next < count && inputs[next].frame <= frame){
+			map.inputs[inputs[next].port] = inputs[next].value;
+			next++;
+		}
+		/* frames end on fixed cycles, so an overshoot does not build up */
+		RunScheduled8080(&state, &s, (uint64_t)(frame + 1) * FRAME_CYCLES - state.cycles, engine);
+		double hashed = now();
+		hashes[frame] = HashFrame8080(&state);
+		hashing += now() - hashed;
+		if (check && hashes[frame] != expected[frame]){
+			diverged = frame;
 			break;
-		case 0xff:
-			printf("RST	7");
-			break;	
+		}
 	}
-	printf("\n");
+	double seconds = now() - start;
+	int ran = diverged >= 0 ? diverged + 1 : frames;
 
-	return opbytes;
+	if (diverged >= 0){
+		printf("frame %d differs: hash %016llx, golden %016llx\n", diverged,
+			(unsigned long long)hashes[diverged], (unsigned long long)expected[diverged]);
+		printf("pc %04x sp %04x a %02x f %02x bc %04x de %04x hl %04x ie %d halted %d cycles %lu\n",
+			state.pc, state.sp, state.a, flags(&state)->psw, state.bc, state.de, state.hl,
+			state.cc.interrupt_enabled, state.halted, (unsigned long)state.cycles);
+	}else if (!check && strcmp(golden, "-") == 0){
+		for (int frame = 0; frame < frames; frame++){
+			printf("%016llx\n", (unsigned long long)hashes[frame]);
+		}
+	}else if (!check){
+		FILE *f = fopen(golden, "wb");
+		if (f == NULL || WriteHashes8080(f, hashes, frames) != 0){
+			printf("cannot write %s\n", golden);
+			failed = 1;
+		}
+		if (f != NULL){
+			fclose(f);
+		}
+	}
+	fprintf(check || strcmp(golden, "-") != 0 ? stdout : stderr,
+		"%d frames, %d inputs, %.3fs, %.0f frames/s, %.0f times real time, %.2f us hashing per frame, %s\n",
+		ran, next, seconds, ran / seconds, ran / 60.0 / seconds, hashing / (ran > 0 ? ran : 1) * 1e6,
+		diverged >= 0 || failed ? "FAIL" : check ? "same as golden" : "written");
+
+	state.blocks = NULL;
+#ifdef USE_JIT
+	if (jit != NULL){
+		FreeJit8080(jit);
+	}
+#endif
+	free(state.memory);
+	free(inputs);
+	free(expected);
+	free(hashes);
+	return diverged >= 0 || failed;
+}
+
+/*
+ the rom with the video interrupts and the waiting main loop, on the
+ threaded engine and the translator with flat memory and on the
+ threaded engine with the Invaders mirrors. after every frame the
+ memory hash is taken from the dirty map and from scratch, which must
+ agree. the same frames also run without a dirty map, for what the
+ marks cost the stores
+*/
+
+int hashbench(char* path, int frames){
+
+	static const char *names[] = {"threaded", "jit", "mirrored"};
+	static RunResult8080 (*const run[])(State8080*, long) = {
+		Run8080,
+#ifdef USE_JIT
+		RunJit8080,
+#else
+		Run8080,
+#endif
+		Run8080
+	};
+	State8080 state = {0};
+	Scheduler8080 s;
+	Map8080 map;
+	uint8_t dirty[SNAP_PAGES];
+	uint8_t *flat = NULL, *mirrored;
+	RamHash8080 *h = malloc(sizeof(RamHash8080)), *all = malloc(sizeof(RamHash8080));
+	int failed = 0;
+#ifdef USE_JIT
+	Jit8080 *jit = NewJit8080();
+#endif
+
+	MapInvaders8080(&map);
+	mirrored = NewMemory8080(&map);
+	if (mirrored == NULL){
+		printf("error mapping memory");
+		exit(1);
+	}
+
+	for (int config = 0; config < 3; config++){
+		double emulating[2] = {1e9, 1e9}, incremental = 0, scratch = 0;
+		int differ = 0;
+#ifdef USE_JIT
+		if (config == 1 && jit == NULL){
+			continue;
+		}
+#else
+		if (config == 1){
+			continue;
+		}
+#endif
+		/* best of 3 each way, the hashes from the last run */
+		for (int round = 0; round < 6; round++){
+			int marked = round & 1;
+			double elapsed = 0;
+			state.memory = config == 2 ? mirrored : flat;
+			if (LoadBench8080(&state, path) < 0){
+				printf("error opening file");
+				exit(1);
+			}
+			flat = config == 2 ? flat : state.memory;
+			memcpy(&state.memory[0x18d4], waitdriver, sizeof(waitdriver));
+			if (config == 2){
+				SyncMirrors8080(&map, state.memory);
+				state.map = &map;
+			}
+#ifdef USE_JIT
+			if (config == 1){
+				FlushJit8080(jit);
+				state.blocks = jit->cache;
+			}
+#endif
+			memset(dirty, 0, sizeof(dirty));
+			state.dirty = marked ? dirty : NULL;
+			memset(&s, 0, sizeof(s));
+			ScheduleInvaders8080(&s, 0);
+			InitRamHash8080(h, &state);
+			h->rehashed = 0;
+			incremental = scratch = 0;
+
+			for (int frame = 0; frame < frames; frame++){
+				double start = now();
+				RunScheduled8080(&state, &s, (uint64_t)(frame + 1) * FRAME_CYCLES - state.cycles, run[config]);
+				elapsed += now() - start;
+				if (!marked){
+					continue;
+				}
+				start = now();
+				uint64_t sum = HashRam8080(h, &state);
+				incremental += now() - start;
+				start = now();
+				InitRamHash8080(all, &state);
+				scratch += now() - start;
+				differ += sum != all->sum;
+			}
+			/* nothing ran, so nothing is hashed again */
+			uint64_t rehashed = h->rehashed;
+			differ += marked && (HashRam8080(h, &state) != all->sum || h->rehashed != rehashed);
+			state.blocks = NULL;
+			emulating[marked] = elapsed < emulating[marked] ? elapsed : emulating[marked];
+		}
+
+		printf("%-9s %.1f of 256 pages hashed again per frame, %.3f us per query, %.2f us from scratch, %.0fx, %s\n",
+			names[config], (double)h->rehashed / frames, incremental / frames * 1e6,
+			scratch / frames * 1e6, scratch / incremental, differ ? "FAIL" : "same hashes");
+		printf("          %.2f us per frame emulated without the dirty map, %.2f with it, %+.1f%%\n",
+			emulating[0] / frames * 1e6, emulating[1] / frames * 1e6, 100.0 * (emulating[1] / emulating[0] - 1));
+		failed |= differ != 0;
+	}
+
+#ifdef USE_JIT
+	if (jit != NULL){
+		FreeJit8080(jit);
+	}
+#endif
+	FreeMemory8080(mirrored, &map);
+	free(flat);
+	free(all);
+	free(h);
+	return failed;
+}
+
+
+/*
+ records a synthetic player on the rom with the video interrupts and
+ the waiting main loop, with a state check every 10 seconds, saves the
+ log and loads it back, then replays it unthrottled on each engine,
+ where every check must pass. last, one logged input is changed and the
+ replay must diverge
+*/
+
+int replaybench(char* path, int frames){
+
+	static const char *names[] = {"threaded", "blocks", "jit"};
+	static RunResult8080 (*const run[])(State8080*, long) = {
+		Run8080, RunBlocks8080,
+#ifdef USE_JIT
+		RunJit8080
+#endif
+	};
+	const int period = 600;	/* frames between checks */
+	int engines = sizeof(run) / sizeof(run[0]);
+	State8080 state = {0};
+	Scheduler8080 s;
+	Map8080 map;
+	uint8_t dirty[SNAP_PAGES];
+	Replay8080 *rec = calloc(1, sizeof(Replay8080)), *play = calloc(1, sizeof(Replay8080));
+	BlockCache8080 *blocks = NewBlockCache8080();
+	size_t tampered = 0;
+	uint64_t when = 0;
+	int failed = 0;
+#ifdef USE_JIT
+	Jit8080 *jit = NewJit8080();
+	if (jit == NULL){
+		engines--;
+	}
+#endif
+
+	for (int pass = 0; pass < engines + 2; pass++){
+		int engine = pass == 0 || pass > engines ? 0 : pass - 1;
+		Replay8080 *r = pass == 0 ? rec : play;
+		int checked = 0;
+
+		if (LoadBench8080(&state, path) < 0){
+			printf("error opening file");
+			exit(1);
+		}
+		memcpy(&state.memory[0x18d4], waitdriver, sizeof(waitdriver));
+		InitMap8080(&map);
+		map.inputs[0] = 0x0e;
+		map.inputs[1] = 0x08;
+		map.shifter = 1;
+		state.map = &map;
+		memset(dirty, 0, sizeof(dirty));
+		state.dirty = dirty;
+		if (engine == 1){
+			FlushBlocks8080(blocks);
+			state.blocks = blocks;
+		}
+#ifdef USE_JIT
+		if (engine == 2){
+			FlushJit8080(jit);
+			state.blocks = jit->cache;
+		}
+#endif
+		memset(&s, 0, sizeof(s));
+		ScheduleInvaders8080(&s, 0);
+		s.fastforward = 1;
+
+		if (pass > engines){
+			/* the player's presses are flipped at the middle input */
+			play->cursor = 0;
+			play->last = 0;
+			for (uint64_t n = 0; n <= rec->inputs / 2; n += play->kind == REPLAY_INPUT){
+				nextrecord(play);
+			}
+			tampered = play->cursor - 1;
+			when = play->at;
+			play->log[tampered] ^= 0xff;
+		}
+		if (pass == 0){
+			RecordInputs8080(rec, &map, &state);
+			srand(1);
+		}else{
+			ReplayInputs8080(play, &map, &state);
+		}
+
+		double start = now();
+		for (int frame = 0; frame < frames && checked == 0; frame++){
+			if (pass == 0 && rand() % 30 == 0){
+				/* coin, fire, left or right */
+				map.inputs[1] ^= (rand() & 3) == 0 ? 0x01 : 0x10 << rand() % 3;
+			}
+			RunScheduled8080(&state, &s, (uint64_t)(frame + 1) * FRAME_CYCLES - state.cycles, run[engine]);
+			if ((frame + 1) % period == 0 || frame == frames - 1){
+				checked = CheckReplay8080(r, &state);
+			}
+		}
+		double seconds = now() - start;
+		StopReplay8080(r, &map);
+		state.blocks = NULL;
+
+		if (pass == 0){
+			FILE *f = tmpfile();
+			if (f == NULL || SaveReplay8080(f, rec) != 0 || fseek(f, 0, SEEK_SET) != 0 ||
+				LoadReplay8080(f, play) != 0 || play->length != rec->length ||
+				memcmp(play->log, rec->log, rec->length) != 0){
+				printf("saving and loading the log failed\n");
+				failed = 1;
+			}
+			if (f != NULL){
+				fclose(f);
+			}
+			printf("recorded %d frames, %.2f hours, in %.3fs: %lu port reads, %lu logged, %lu checks\n",
+				frames, frames / 216000.0, seconds, (unsigned long)rec->reads,
+				(unsigned long)rec->inputs, (unsigned long)rec->checks);
+			printf("log %zu bytes, %.1f KB per hour, %.1f bytes per input\n", rec->length,
+				rec->length / 1024.0 / (frames / 216000.0),
+				(double)(rec->length - rec->checks * 9) / (rec->inputs > 0 ? rec->inputs : 1));
+		}else if (pass <= engines){
+			int exact = play->diverged == UINT64_MAX && play->checks == rec->checks &&
+				play->inputs == rec->inputs && play->reads == rec->reads;
+			printf("%-9s replayed in %.3fs, %.0f frames/s, %.0f times real time, %s\n", names[engine],
+				seconds, frames / seconds, frames / 60.0 / seconds, exact ? "exact" : "FAIL");
+			failed |= !exact;
+		}else{
+			printf("input at cycle %lu, frame %lu, changed: replay diverged at cycle %lu, frame %lu\n",
+				(unsigned long)when, (unsigned long)(when / FRAME_CYCLES),
+				(unsigned long)play->diverged, (unsigned long)(play->diverged / FRAME_CYCLES));
+			failed |= play->diverged == UINT64_MAX;
+			play->log[tampered] ^= 0xff;
+		}
+	}
+
+#ifdef USE_JIT
+	if (jit != NULL){
+		FreeJit8080(jit);
+	}
+#endif
+	FreeReplay8080(play);
+	FreeReplay8080(rec);
+	free(play);
+	free(rec);
+	free(blocks);
+	free(state.memory);
+	return failed;
+}
+
+/* the video interrupts again from the frame cycles is in, after a rewind */
+static void rescheduleinvaders(Scheduler8080* s, uint64_t cycles){
+
+	s->count = 0;
+	ScheduleInvaders8080(s, cycles / FRAME_CYCLES * FRAME_CYCLES);
+
+}
+
+/*
+ the rom with the video interrupts, the waiting main loop and a
+ synthetic player on the translator, run once plainly and once pushing
+ every frame into a rewind buffer of budget bytes with a keyframe a
+ second. then steps back over half the history, runs on for 10
+ seconds and steps back to the oldest frame held, checking every frame
+ stepped to against the state hash taken when it was run
+*/
+
+int rewindbench(char* path, int frames, size_t budget){
+
+	const int keyevery = 60, more = 600;
+	RunResult8080 (*engine)(State8080*, long) = Run8080;
+	State8080 state = {0};
+	Scheduler8080 s;
+	Map8080 map;
+	uint8_t dirty[SNAP_PAGES];
+	RamHash8080 *ram = malloc(sizeof(RamHash8080));
+	uint64_t *ref = malloc((frames + more) * sizeof(uint64_t));
+	Rewind8080 *rw = NewRewind8080(budget, frames + more, keyevery);
+	double running[2] = {0, 0}, pushing = 0;
+	size_t keybytes = 0, deltabytes = 0;
+	int at = -1, failed = 0;
+#ifdef USE_JIT
+	Jit8080 *jit = NewJit8080();
+#endif
+
+	if (rw == NULL){
+		printf("a rewind budget needs at least %zu bytes\n", REWIND_MIN);
+		return 1;
+	}
+
+	for (int pass = 0; pass < 2; pass++){
+		if (LoadBench8080(&state, path) < 0){
+			printf("error opening file");
+			exit(1);
+		}
+		memcpy(&state.memory[0x18d4], waitdriver, sizeof(waitdriver));
+		InitMap8080(&map);
+		map.inputs[0] = 0x0e;
+		map.inputs[1] = 0x08;
+		map.shifter = 1;
+		state.map = &map;
+		memset(dirty, 0, sizeof(dirty));
+		state.dirty = dirty;
+#ifdef USE_JIT
+		if (jit != NULL){
+			FlushJit8080(jit);
+			state.blocks = jit->cache;
+			engine = RunJit8080;
+		}
+#endif
+		memset(&s, 0, sizeof(s));
+		ScheduleInvaders8080(&s, 0);
+		s.fastforward = 1;
+		InitRamHash8080(ram, &state);
+		srand(1);
+
+		for (int frame = 0; frame < frames; frame++){
+			if (rand() % 30 == 0){
+				map.inputs[1] ^= (rand() & 3) == 0 ? 0x01 : 0x10 << rand() % 3;
+			}
+			double start = now();
+			RunScheduled8080(&state, &s, (uint64_t)(frame + 1) * FRAME_CYCLES - state.cycles, engine);
+			running[pass] += now() - start;
+			if (pass == 0){
+				continue;
+			}
+			start = now();
+			size_t n = PushRewind8080(rw, &state);
+			pushing += now() - start;
+			ref[++at] = HashState8080(ram, &state);
+			if (rewindframe(rw, rw->frames - 1)->key){
+				keybytes += n;
+			}else{
+				deltabytes += n;
+			}
+		}
+	}
+
+	double held = rw->frames / 60.0;
+	printf("%d frames run, %d held in %zu of %zu bytes: %.1f seconds of history, %.1f KB per second\n",
+		frames, rw->frames, rw->used, budget, held, rw->used / 1024.0 / held);
+	printf("keyframes %.0f bytes, deltas %.1f bytes on average, %lu frames dropped\n",
+		(double)keybytes / rw->keys, (double)deltabytes / (rw->pushed - rw->keys), (unsigned long)rw->dropped);
+	printf("running %.2f us per frame, %.2f with rewind, %+.1f%%, pushing %.2f us per frame\n",
+		running[0] / frames * 1e6, running[1] / frames * 1e6,
+		100.0 * (running[1] / running[0] - 1), pushing / frames * 1e6);
+
+	/* back over half, on for a while, then back as far as it goes */
+	int wrong = 0, steps = 0, crossings = 0;
+	double stepping = 0, crossing = 0, slowest = 0;
+	for (int phase = 0; phase < 2; phase++){
+		int back = phase == 0 ? rw->frames / 2 : rw->frames - 1;
+		for (int i = 0; i < back; i++){
+			int key = rewindframe(rw, rw->frames - 1)->key;
+			double start = now();
+			if (StepBack8080(rw, &state) != 0){
+				wrong++;
+				break;
+			}
+			double elapsed = now() - start;
+			stepping += elapsed;
+			crossing += key ? elapsed : 0;
+			crossings += key;
+			slowest = elapsed > slowest ? elapsed : slowest;
+			steps++;
+			wrong += HashState8080(ram, &state) != ref[--at];
+		}
+		if (phase == 0){
+			rescheduleinvaders(&s, state.cycles);
+			for (int frame = 0; frame < more; frame++){
+				uint64_t end = (state.cycles / FRAME_CYCLES + 1) * FRAME_CYCLES;
+				RunScheduled8080(&state, &s, end - state.cycles, engine);
+				PushRewind8080(rw, &state);
+				ref[++at] = HashState8080(ram, &state);
+			}
+		}
+	}
+	printf("%d steps back, %.2f us each, %.2f from a keyframe, slowest %.2f us, %d wrong, %d frame left\n",
+		steps, stepping / steps * 1e6, crossing / (crossings > 0 ? crossings : 1) * 1e6,
+		slowest * 1e6, wrong, rw->frames);
+	failed = wrong != 0 || rw->frames != 1 || StepBack8080(rw, &state) != -1;
+
+	state.blocks = NULL;
+#ifdef USE_JIT
+	if (jit != NULL){
+		FreeJit8080(jit);
+	}
+#endif
+	FreeRewind8080(rw);
+	free(state.memory);
+	free(ref);
+	free(ram);
+	return failed;
+}
+
+/*
+ ALU microbenchmark: runs every 8 bit ALU helper on pseudo random
+ operands and reads the whole flag byte back after each one, as a
+ conditional branch or PUSH PSW would. build with and without
+ -DALU_TABLES to compare
+*/
+
+int alubench(long count){
+
+	State8080 state = {0};
+	uint32_t x = 1;
+	unsigned sum = 0;
+
+	double start = now();
+	for (long i = 0; i < count; i++){
+		x = x * 1103515245 + 12345;
+		uint8_t v = x >> 16;
+		state.a = x >> 24;
+		sum += add(&state, v) + flags(&state)->psw;
+		sum += adc(&state, v) + flags(&state)->psw;
+		sum += sub(&state, v) + flags(&state)->psw;
+		sum += sbb(&state, v) + flags(&state)->psw;
+		sum += ana(&state, v) + flags(&state)->psw;
+		sum += xra(&state, v) + flags(&state)->psw;
+		sum += ora(&state, v) + flags(&state)->psw;
+		cmp(&state, v);
+		sum += flags(&state)->psw;
+	}
+	double elapsed = now() - start;
+
+	printf("%s %ld x 8 ALU ops %.3fs %.2f ns/op (checksum %u)\n",
+#ifdef ALU_TABLES
+		"tables",
+#else
+		"computed",
+#endif
+		count, elapsed, elapsed * 1e9 / (count * 8.0), sum);
+	return 0;
+}
+
+/*
+ reference sequences with their cycle totals taken from the 8080
+ data sheet timings. every one ends in HLT
+*/
+
+static const struct{
+	const char *name;
+	uint64_t cycles;
+	uint8_t code[0x40];
+} cycletests[] = {
+	{"DCR/JNZ loop", 7 + 10 * (5 + 10) + 7, {
+		0x06, 0x0a,		/* MVI B, 10 */
+		0x05,			/* DCR B */
+		0xc2, 0x02, 0x00,	/* JNZ $0002 */
+		0x76			/* HLT */
+	}},
+	{"conditional call/return", 10 + 4 + 17 + 11 + 11 + 5 + 7, {
+		0x31, 0x00, 0x01,	/* LXI SP, $0100 */
+		0xaf,			/* XRA A */
+		0xcc, 0x10, 0x00,	/* CZ $0010, taken */
+		0xc4, 0x10, 0x00,	/* CNZ $0010, not taken */
+		0xc0,			/* RNZ, not taken */
+		0x76,			/* HLT */
+		[0x10] = 0xc8		/* RZ, taken */
+	}},
+	{"memory and stack", 10 + 10 + 10 + 7 + 11 + 18 + 10 + 4 + 16 + 16 + 5 + 10 + 17 + 10 + 11 + 10 + 7, {
+		0x31, 0x00, 0x01,	/* LXI SP, $0100 */
+		0x21, 0x00, 0x02,	/* LXI H, $0200 */
+		0x36, 0x05,		/* MVI M, 5 */
+		0x7e,			/* MOV A,M */
+		0xe5,			/* PUSH H */
+		0xe3,			/* XTHL */
+		0xd1,			/* POP D */
+		0xeb,			/* XCHG */
+		0x22, 0x10, 0x02,	/* SHLD $0210 */
+		0x2a, 0x10, 0x02,	/* LHLD $0210 */
+		0x23,			/* INX H */
+		0x29,			/* DAD H */
+		0xcd, 0x30, 0x00,	/* CALL $0030 */
+		0xff,			/* RST 7 */
+		0x76,			/* HLT */
+		[0x30] = 0xc9,		/* RET */
+		[0x38] = 0xc9		/* RET */
+	}},
+	{"patched loop count", 10 + 17 + (7 + 2 * 15 + 10) + 7 + 13 + 17 + (7 + 5 * 15 + 10) + 7, {
+		0x31, 0x00, 0x01,	/* LXI SP, $0100 */
+		0xcd, 0x20, 0x00,	/* CALL $0020 */
+		0x3e, 0x05,		/* MVI A, 5 */
+		0x32, 0x21, 0x00,	/* STA $0021, the MVI B operand */
+		0xcd, 0x20, 0x00,	/* CALL $0020 */
+		0x76,			/* HLT */
+		[0x20] = 0x06, 0x02,	/* MVI B, 2 */
+		0x05,			/* DCR B */
+		0xc2, 0x22, 0x00,	/* JNZ $0022 */
+		0xc9			/* RET */
+	}},
+	{"store into own block", 7 + 13 + 5 + 7, {
+		0x3e, 0x3c,		/* MVI A, INR A */
+		0x32, 0x05, 0x00,	/* STA $0005 */
+		0x00,			/* NOP, becomes INR A */
+		0x76			/* HLT */
+	}}
+};
+
+/* runs every cycletests sequence on each engine, returns 0 if all match */
+
+int selftest(void){
+
+	State8080 state = {0};
+	unsigned char *memory = calloc(0x10000 + 2, 1);
+	BlockCache8080 *cache = NewBlockCache8080();
+	int failed = 0;
+#ifdef USE_JIT
+	/* translate everything on first sight so the short loops run native */
+	Jit8080 *jit = NewJit8080();
+	if (jit != NULL){
+		jit->hot = 0;
+	}
+#endif
+
+	for (size_t i = 0; i < sizeof(cycletests) / sizeof(cycletests[0]); i++){
+		uint64_t counted[4] = {0, 0, 0, 0};
+		int ok = 1;
+
+		for (int engine = 0; engine < ENGINES; engine++){
+			memset(&state, 0, sizeof(State8080));
+			memset(memory, 0, 0x10000 + 2);
+			memcpy(memory, cycletests[i].code, sizeof(cycletests[i].code));
+			state.memory = memory;
+
+			if (engine == 0){
+				uint64_t sum = 0;
+				for (int n = 0; n < 10000 && !state.halted; n++){
+					sum += Emulate8080Op(&state);
+				}
+				counted[0] = sum == state.cycles ? sum : 0;
+			}else{
+				RunResult8080 r;
+				if (engine == 1){
+					r = Run8080(&state, 100000);
+				}else if (engine == 2){
+					FlushBlocks8080(cache);
+					state.blocks = cache;
+					r = RunBlocks8080(&state, 100000);
+				}else{
+#ifdef USE_JIT
+					if (jit != NULL){
+						FlushBlocks8080(jit->cache);
+						state.blocks = jit->cache;
+					}
+					r = RunJit8080(&state, 100000);
+#endif
+				}
+				counted[engine] = r.status == RUN_HALT && r.cycles == state.cycles ? r.cycles : 0;
+			}
+			ok &= counted[engine] == cycletests[i].cycles;
+		}
+
+		printf("%-24s expected %4lu switch %4lu threaded %4lu blocks %4lu",
+			cycletests[i].name, (unsigned long)cycletests[i].cycles,
+			(unsigned long)counted[0], (unsigned long)counted[1],
+			(unsigned long)counted[2]);
+#ifdef USE_JIT
+		printf(" jit %4lu", (unsigned long)counted[3]);
+#endif
+		printf(" %s\n", ok ? "ok" : "FAIL");
+		failed |= !ok;
+	}
+
+#ifdef USE_JIT
+	if (jit != NULL){
+		FreeJit8080(jit);
+	}
+#endif
+	free(cache);
+	free(memory);
+	return failed;
 }
 
 int main(int argc, char** argv){
 
+#ifdef ALU_TABLES
+	InitALUTables();
+#endif
+
+	if (argc > 1 && strcmp(argv[1], "-alubench") == 0){
+		return alubench(argc > 2 ? atol(argv[2]) : 50000000);
+	}
+
+	if (argc > 1 && strcmp(argv[1], "-selftest") == 0){
+		return selftest();
+	}
+
+#ifdef USE_JIT
+	if (argc > 2 && strcmp(argv[1], "-jitcheck") == 0){
+		return jitcheck(argv[2], argc > 3 ? atol(argv[3]) : 1000000);
+	}
+#endif
+
+	if (argc > 2 && strcmp(argv[1], "-profile") == 0){
+		return profile(argv[2], argc > 3 ? atol(argv[3]) : 30000000);
+	}
+
+	if (argc > 2 && strcmp(argv[1], "-batch") == 0){
+		int cores = sysconf(_SC_NPROCESSORS_ONLN);
+		return batchbench(argv[2], argc > 3 ? atoi(argv[3]) : 64,
+			argc > 4 ? atoi(argv[4]) : (cores > 0 ? cores : 1));
+	}
+
+	if (argc > 2 && strcmp(argv[1], "-lanes") == 0){
+		return lanesbench(argv[2], argc > 3 ? atoi(argv[3]) : 64,
+			argc > 4 ? atol(argv[4]) : 4000000);
+	}
+
+	if (argc > 2 && strcmp(argv[1], "-snapshots") == 0){
+		return snapshotbench(argv[2], argc > 3 ? atoi(argv[3]) : 10000);
+	}
+
+	if (argc > 2 && strcmp(argv[1], "-reset") == 0){
+		return resetbench(argv[2], argc > 3 ? atoi(argv[3]) : 100000);
+	}
+
+	if (argc > 2 && strcmp(argv[1], "-map") == 0){
+		return mapbench(argv[2], argc > 3 ? atol(argv[3]) : 200000000, 100000000);
+	}
+
+	if (argc > 2 && strcmp(argv[1], "-ports") == 0){
+		return portbench(argv[2], argc > 3 ? atol(argv[3]) : 200000000, 20000000);
+	}
+
+	if (argc > 2 && strcmp(argv[1], "-interrupts") == 0){
+		return interruptbench(argv[2], argc > 3 ? atol(argv[3]) : 200000000);
+	}
+
+	if (argc > 2 && strcmp(argv[1], "-idle") == 0){
+		return idlebench(argv[2], argc > 3 ? atol(argv[3]) : 200000000);
+	}
+
+	if (argc > 2 && strcmp(argv[1], "-halt") == 0){
+		return haltbench(argv[2], 200000000, argc > 3 ? atof(argv[3]) : 2.0);
+	}
+
+	if (argc > 2 && strcmp(argv[1], "-render") == 0){
+		return renderbench(argv[2], argc > 3 ? atoi(argv[3]) : 10000, argc > 4 ? argv[4] : NULL);
+	}
+
+	if (argc > 2 && strcmp(argv[1], "-delta") == 0){
+		return deltabench(argv[2], argc > 3 ? atoi(argv[3]) : 3000);
+	}
+
+	if (argc > 4 && strcmp(argv[1], "-hashes") == 0){
+		return hashrun(argv[2], atoi(argv[3]), argv[4], argc > 5 ? argv[5] : NULL, 0);
+	}
+
+	if (argc > 3 && strcmp(argv[1], "-regress") == 0){
+		return hashrun(argv[2], 0, argv[3], argc > 4 ? argv[4] : NULL, 1);
+	}
+
+	if (argc > 2 && strcmp(argv[1], "-ramhash") == 0){
+		return hashbench(argv[2], argc > 3 ? atoi(argv[3]) : 3000);
+	}
+
+	if (argc > 2 && strcmp(argv[1], "-replay") == 0){
+		return replaybench(argv[2], argc > 3 ? atoi(argv[3]) : 216000);
+	}
+
+	if (argc > 2 && strcmp(argv[1], "-rewind") == 0){
+		return rewindbench(argv[2], argc > 3 ? atoi(argv[3]) : 36000,
+			(argc > 4 ? atol(argv[4]) : 1024) * 1024);
+	}
+
+	if (argc > 2 && strcmp(argv[1], "-bench") == 0){
+		return bench(argv[2], argc > 3 ? atol(argv[3]) : 100000000);
+	}
+
 	FILE *f = fopen(argv[1], "rb");
 	if (f == NULL){
 		printf("error opening file");
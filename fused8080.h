@@ -0,0 +1,83 @@
+/*
+ superinstruction bodies of the block engine, one per fusions[] entry
+
+ the engine including this file provides what opcodes8080.h needs
+ and FUSED(name), the entry point for handler FUSE_name. u and opcode
+ are on the first record of the sequence and pc is already past the
+ block. a body moves u onto the last record it covers before NEXT
+*/
+
+/* DCR r; JNZ, r is not M */
+FUSED(DCR_JNZ){
+	uint8_t r = *opcode >> 3;
+	uint8_t x = dcr(state, REG(state, r));
+	REG(state, r) = x;
+	if (x != 0){
+		state->pc = u[1].imm;
+	}
+	u++;
+	NEXT;
+}
+
+/* CPI; Jcc */
+FUSED(CPI_JCC)
+	cmp(state, IMM8);
+	if (cond(state, u[1].op >> 3)){
+		state->pc = u[1].imm;
+	}
+	u++;
+	NEXT;
+
+/* LXI H; MOV r,M */
+FUSED(LXI_MOV)
+	state->hl = IMM16;
+	REG(state, u[1].op >> 3) = state->memory[state->hl];
+	u++;
+	NEXT;
+
+/* INX rp; DCR r; JNZ, r is not M */
+FUSED(INX_DCR_JNZ){
+	uint8_t r = u[1].op >> 3;
+	*regpair(state, *opcode >> 4) += 1;
+	uint8_t x = dcr(state, REG(state, r));
+	REG(state, r) = x;
+	if (x != 0){
+		state->pc = u[2].imm;
+	}
+	u += 2;
+	NEXT;
+}
+
+/* LDA; ANA A; Jcc */
+FUSED(LDA_ANA_JCC)
+	state->a = state->memory[IMM16];
+	state->a = ana(state, state->a);
+	if (cond(state, u[2].op >> 3)){
+		state->pc = u[2].imm;
+	}
+	u += 2;
+	NEXT;
+
+/* PUSH; PUSH, the first one may drop the block */
+FUSED(PUSH_PUSH)
+	push(state, pushed(state, *opcode));
+	if (u[1].handler == UOP_STALE){
+		NEXT;
+	}
+	u++;
+	push(state, pushed(state, u->op));
+	NEXT;
+
+/* POP; POP */
+FUSED(POP_POP)
+	popped(state, *opcode, pop(state));
+	popped(state, u[1].op, pop(state));
+	u++;
+	NEXT;
+
+/* EI; RET */
+FUSED(EI_RET)
+	state->cc.interrupt_enabled = 1;
+	ret(state);
+	u++;
+	NEXT;
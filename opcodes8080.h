@@ -0,0 +1,349 @@
+/*
+ *opcode bodies shared by every emulation engine
+
+ the engine including this file provides:
+ OP(n) - entry point for opcode n
+ NEXT - finishes the current instruction
+ STOP - finishes the current instruction and leaves the engine
+ IMM8, IMM16 - the operand byte or word of the current instruction
+ SKIP(n) - moves pc over n operand bytes
+ state and opcode, with pc already past the opcode byte and the
+ cycles8080 cost of the opcode already added to state->cycles
+
+ opcodes that only differ in their register field share one body and
+ pick the register out of the opcode with REG()/getreg()/regpair().
+ guest stores go through write8() so cached blocks see them
+*/
+
+/* NOP and its undocumented aliases */
+OP(0x00) OP(0x08) OP(0x10) OP(0x18) OP(0x20) OP(0x28) OP(0x30) OP(0x38)
+	NEXT;
+
+/* LXI rp */
+OP(0x01) OP(0x11) OP(0x21) OP(0x31)
+	*regpair(state, *opcode >> 4) = IMM16;
+	SKIP(2);
+	NEXT;
+
+/* STAX B, STAX D */
+OP(0x02) OP(0x12)
+	write8(state, *regpair(state, *opcode >> 4), state->a);
+	NEXT;
+
+/* INX rp */
+OP(0x03) OP(0x13) OP(0x23) OP(0x33)
+	*regpair(state, *opcode >> 4) += 1;
+	NEXT;
+
+/* INR r */
+OP(0x04) OP(0x0c) OP(0x14) OP(0x1c) OP(0x24) OP(0x2c) OP(0x34) OP(0x3c){
+	uint8_t r = *opcode >> 3;
+	setreg(state, r, inr(state, getreg(state, r)));
+	NEXT;
+}
+
+/* DCR r */
+OP(0x05) OP(0x0d) OP(0x15) OP(0x1d) OP(0x25) OP(0x2d) OP(0x35) OP(0x3d){
+	uint8_t r = *opcode >> 3;
+	setreg(state, r, dcr(state, getreg(state, r)));
+	NEXT;
+}
+
+/* MVI r */
+OP(0x06) OP(0x0e) OP(0x16) OP(0x1e) OP(0x26) OP(0x2e) OP(0x36) OP(0x3e)
+	setreg(state, *opcode >> 3, IMM8);
+	SKIP(1);
+	NEXT;
+
+OP(0x07){
+	uint8_t x = state->a;
+	setflag(state, FLAG_CY, x >> 7);
+	state->a = (x << 1) | (x >> 7);
+	NEXT;
+}
+
+/* DAD rp */
+OP(0x09) OP(0x19) OP(0x29) OP(0x39){
+	uint32_t answer = (uint32_t)state->hl + *regpair(state, *opcode >> 4);
+	state->hl = answer;
+	setflag(state, FLAG_CY, answer > 0xffff);
+	NEXT;
+}
+
+/* LDAX B, LDAX D */
+OP(0x0a) OP(0x1a)
+	state->a = state->memory[*regpair(state, *opcode >> 4)];
+	NEXT;
+
+/* DCX rp */
+OP(0x0b) OP(0x1b) OP(0x2b) OP(0x3b)
+	*regpair(state, *opcode >> 4) -= 1;
+	NEXT;
+
+OP(0x0f){
+	uint8_t x = state->a;
+	state->a = (x >> 1) | ((x & 1) << 7);
+	setflag(state, FLAG_CY, x & 1);
+	NEXT;
+}
+OP(0x17){
+	uint8_t x = state->a;
+	state->a = (x << 1) | getflag(state, FLAG_CY);
+	setflag(state, FLAG_CY, x >> 7);
+	NEXT;
+}
+OP(0x1f){
+	uint8_t x = state->a;
+	state->a = (x >> 1) | (getflag(state, FLAG_CY) << 7);
+	setflag(state, FLAG_CY, x & 1);
+	NEXT;
+}
+OP(0x22){
+	uint16_t addr = IMM16;
+	write8(state, addr, state->l);
+	write8(state, (uint16_t)(addr + 1), state->h);
+	SKIP(2);
+	NEXT;
+}
+OP(0x27){
+	uint8_t correction = 0;
+	int carry = getflag(state, FLAG_CY);
+	if ((state->a & 0x0f) > 9 || getflag(state, FLAG_AC)){
+		correction |= 0x06;
+	}
+	if (state->a > 0x99 || carry){
+		correction |= 0x60;
+		carry = 1;
+	}
+	state->a = add(state, correction);
+	if (carry){
+		setflag(state, FLAG_CY, 1);
+	}
+	NEXT;
+}
+OP(0x2a){
+	uint16_t addr = IMM16;
+	state->l = state->memory[addr];
+	state->h = state->memory[(uint16_t)(addr + 1)];
+	SKIP(2);
+	NEXT;
+}
+OP(0x2f)
+	state->a = ~(state->a);
+	NEXT;
+OP(0x32)
+	write8(state, IMM16, state->a);
+	SKIP(2);
+	NEXT;
+OP(0x37)
+	setflag(state, FLAG_CY, 1);
+	NEXT;
+OP(0x3a)
+	state->a = state->memory[IMM16];
+	SKIP(2);
+	NEXT;
+OP(0x3f)
+	flags(state)->psw ^= FLAG_CY;
+	NEXT;
+
+/* MOV r, r */
+OP(0x40) OP(0x41) OP(0x42) OP(0x43) OP(0x44) OP(0x45) OP(0x47)
+OP(0x48) OP(0x49) OP(0x4a) OP(0x4b) OP(0x4c) OP(0x4d) OP(0x4f)
+OP(0x50) OP(0x51) OP(0x52) OP(0x53) OP(0x54) OP(0x55) OP(0x57)
+OP(0x58) OP(0x59) OP(0x5a) OP(0x5b) OP(0x5c) OP(0x5d) OP(0x5f)
+OP(0x60) OP(0x61) OP(0x62) OP(0x63) OP(0x64) OP(0x65) OP(0x67)
+OP(0x68) OP(0x69) OP(0x6a) OP(0x6b) OP(0x6c) OP(0x6d) OP(0x6f)
+OP(0x78) OP(0x79) OP(0x7a) OP(0x7b) OP(0x7c) OP(0x7d) OP(0x7f)
+	REG(state, *opcode >> 3) = REG(state, *opcode);
+	NEXT;
+
+/* MOV r, M */
+OP(0x46) OP(0x4e) OP(0x56) OP(0x5e) OP(0x66) OP(0x6e) OP(0x7e)
+	REG(state, *opcode >> 3) = state->memory[state->hl];
+	NEXT;
+
+/* MOV M, r */
+OP(0x70) OP(0x71) OP(0x72) OP(0x73) OP(0x74) OP(0x75) OP(0x77)
+	write8(state, state->hl, REG(state, *opcode));
+	NEXT;
+
+OP(0x76)
+	state->halted = 1;
+	STOP;
+
+/* ADD r */
+OP(0x80) OP(0x81) OP(0x82) OP(0x83) OP(0x84) OP(0x85) OP(0x86) OP(0x87)
+	state->a = add(state, getreg(state, *opcode));
+	NEXT;
+
+/* ADC r */
+OP(0x88) OP(0x89) OP(0x8a) OP(0x8b) OP(0x8c) OP(0x8d) OP(0x8e) OP(0x8f)
+	state->a = adc(state, getreg(state, *opcode));
+	NEXT;
+
+/* SUB r */
+OP(0x90) OP(0x91) OP(0x92) OP(0x93) OP(0x94) OP(0x95) OP(0x96) OP(0x97)
+	state->a = sub(state, getreg(state, *opcode));
+	NEXT;
+
+/* SBB r */
+OP(0x98) OP(0x99) OP(0x9a) OP(0x9b) OP(0x9c) OP(0x9d) OP(0x9e) OP(0x9f)
+	state->a = sbb(state, getreg(state, *opcode));
+	NEXT;
+
+/* ANA r */
+OP(0xa0) OP(0xa1) OP(0xa2) OP(0xa3) OP(0xa4) OP(0xa5) OP(0xa6) OP(0xa7)
+	state->a = ana(state, getreg(state, *opcode));
+	NEXT;
+
+/* XRA r */
+OP(0xa8) OP(0xa9) OP(0xaa) OP(0xab) OP(0xac) OP(0xad) OP(0xae) OP(0xaf)
+	state->a = xra(state, getreg(state, *opcode));
+	NEXT;
+
+/* ORA r */
+OP(0xb0) OP(0xb1) OP(0xb2) OP(0xb3) OP(0xb4) OP(0xb5) OP(0xb6) OP(0xb7)
+	state->a = ora(state, getreg(state, *opcode));
+	NEXT;
+
+/* CMP r */
+OP(0xb8) OP(0xb9) OP(0xba) OP(0xbb) OP(0xbc) OP(0xbd) OP(0xbe) OP(0xbf)
+	cmp(state, getreg(state, *opcode));
+	NEXT;
+
+/* Rcc, 6 more cycles when taken */
+OP(0xc0) OP(0xc8) OP(0xd0) OP(0xd8) OP(0xe0) OP(0xe8) OP(0xf0) OP(0xf8)
+	if (cond(state, *opcode >> 3)){
+		ret(state);
+		state->cycles += 6;
+	}
+	NEXT;
+
+/* POP B, POP D, POP H */
+OP(0xc1) OP(0xd1) OP(0xe1)
+	*regpair(state, *opcode >> 4) = pop(state);
+	NEXT;
+
+/* Jcc */
+OP(0xc2) OP(0xca) OP(0xd2) OP(0xda) OP(0xe2) OP(0xea) OP(0xf2) OP(0xfa)
+	if (cond(state, *opcode >> 3)){
+		state->pc = IMM16;
+	}else{
+		SKIP(2);
+	}
+	NEXT;
+
+/* JMP and its undocumented alias */
+OP(0xc3) OP(0xcb)
+	state->pc = IMM16;
+	NEXT;
+
+/* Ccc, 6 more cycles when taken */
+OP(0xc4) OP(0xcc) OP(0xd4) OP(0xdc) OP(0xe4) OP(0xec) OP(0xf4) OP(0xfc)
+	SKIP(2);
+	if (cond(state, *opcode >> 3)){
+		call(state, IMM16);
+		state->cycles += 6;
+	}
+	NEXT;
+
+/* PUSH B, PUSH D, PUSH H */
+OP(0xc5) OP(0xd5) OP(0xe5)
+	push(state, *regpair(state, *opcode >> 4));
+	NEXT;
+
+OP(0xc6)
+	state->a = add(state, IMM8);
+	SKIP(1);
+	NEXT;
+
+/* RST n */
+OP(0xc7) OP(0xcf) OP(0xd7) OP(0xdf) OP(0xe7) OP(0xef) OP(0xf7) OP(0xff)
+	call(state, *opcode & 0x38);	/* the push may overwrite the opcode */
+	NEXT;
+
+/* RET and its undocumented alias */
+OP(0xc9) OP(0xd9)
+	ret(state);
+	NEXT;
+
+/* CALL and its undocumented aliases */
+OP(0xcd) OP(0xdd) OP(0xed) OP(0xfd)
+	SKIP(2);
+	call(state, IMM16);
+	NEXT;
+
+OP(0xce)
+	state->a = adc(state, IMM8);
+	SKIP(1);
+	NEXT;
+OP(0xd3)
+	output(state, IMM8, state->a);
+	SKIP(1);
+	NEXT;
+OP(0xd6)
+	state->a = sub(state, IMM8);
+	SKIP(1);
+	NEXT;
+OP(0xdb)
+	state->a = input(state, IMM8);
+	SKIP(1);
+	NEXT;
+OP(0xde)
+	state->a = sbb(state, IMM8);
+	SKIP(1);
+	NEXT;
+OP(0xe3){
+	uint16_t hl = state->hl;
+	state->l = state->memory[state->sp];
+	state->h = state->memory[(uint16_t)(state->sp + 1)];
+	write8(state, state->sp, hl & 0xff);
+	write8(state, (uint16_t)(state->sp + 1), hl >> 8);
+	NEXT;
+}
+OP(0xe6)
+	state->a = ana(state, IMM8);
+	SKIP(1);
+	NEXT;
+OP(0xe9)
+	state->pc = state->hl;
+	NEXT;
+OP(0xeb){
+	uint16_t de = state->de;
+	state->de = state->hl;
+	state->hl = de;
+	NEXT;
+}
+OP(0xee)
+	state->a = xra(state, IMM8);
+	SKIP(1);
+	NEXT;
+OP(0xf1)
+	flags(state)->psw = (state->memory[state->sp] & FLAG_MASK) | FLAG_1;
+	state->a = state->memory[(uint16_t)(state->sp + 1)];
+	state->sp += 2;
+	NEXT;
+OP(0xf3)
+	state->cc.interrupt_enabled = 0;
+	NEXT;
+OP(0xf5)
+	write8(state, (uint16_t)(state->sp - 1), state->a);
+	write8(state, (uint16_t)(state->sp - 2), flags(state)->psw);
+	state->sp -= 2;
+	NEXT;
+OP(0xf6)
+	state->a = ora(state, IMM8);
+	SKIP(1);
+	NEXT;
+OP(0xf9)
+	state->sp = state->hl;
+	NEXT;
+/* EI, no interrupt is taken until the next instruction has run */
+OP(0xfb)
+	state->cc.interrupt_enabled = 1;
+	state->ei_shadow = 1;
+	NEXT;
+OP(0xfe)
+	cmp(state, IMM8);
+	SKIP(1);
+	NEXT;